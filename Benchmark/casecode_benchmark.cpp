@@ -0,0 +1,323 @@
+//
+//  casecode_benchmark.cpp
+//  UnrealSandboxTerrain
+//
+//  Substance cache building from density in bricks (voxelbricks.hpp), as TVoxelData keeps it:
+//  per voxel case codes through brick lookups (TVoxelData::performSubstanceCacheLOD) against
+//  brick-wise copy to occupancy plane and row classification (casecode.hpp). No engine dependency.
+//
+//  Build (Linux):
+//      g++ -O2 -std=c++14 -I../Source/UnrealSandboxTerrain/Public casecode_benchmark.cpp -o casecode_benchmark
+//      add -mavx2 for AVX2 kernel, -DCASECODE_NO_SIMD for scalar one
+//
+//  Run:
+//      ./casecode_benchmark [filter]
+//
+//  Results go to stdout as CSV, one row per measurement:
+//      benchmark,param,ops,bytes,seconds,ops_per_sec,mb_per_sec
+//  ops - zones processed, bytes - density bytes processed. Progress goes to stderr.
+//  Both paths are checked to give the same cells in the same order, exit code is 1 if they don't
+//
+
+#include "casecode.hpp"
+#include "voxelbricks.hpp"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+
+typedef unsigned long long ulong64;
+
+static const int ZoneSize = 65; // USBT_ZONE_DIMENSION
+static const int LodNum = 7; // LOD_ARRAY_SIZE
+
+typedef struct TBenchCache {
+	std::vector<uint32_t> IndexList;
+	std::vector<uint8_t> CaseCodeList;
+
+	void Clear() {
+		IndexList.clear();
+		CaseCodeList.clear();
+	}
+} TBenchCache;
+
+typedef std::vector<TBenchCache> TBenchCacheLod;
+
+typedef TVoxelBrickArray<uint8_t> TBenchDensity;
+
+static std::string Filter;
+
+static double Now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool IsEnabled(const char* Name) {
+	return Filter.empty() || std::string(Name).find(Filter) != std::string::npos;
+}
+
+static void PrintHeader() {
+	printf("benchmark,param,ops,bytes,seconds,ops_per_sec,mb_per_sec\n");
+}
+
+static void PrintResult(const char* Name, const std::string& Param, ulong64 Ops, ulong64 Bytes, double Time) {
+	const double Ops_s = (Time > 0) ? (double)Ops / Time : 0;
+	const double Mb_s = (Time > 0) ? (double)Bytes / Time / (1024 * 1024) : 0;
+	printf("%s,%s,%llu,%llu,%.6f,%.1f,%.2f\n", Name, Param.c_str(), (unsigned long long)Ops, (unsigned long long)Bytes, Time, Ops_s, Mb_s);
+	fflush(stdout);
+}
+
+static inline int LinearIndex(int X, int Y, int Z) {
+	return (X * ZoneSize + Y) * ZoneSize + Z;
+}
+
+//============================================================================
+// Zones
+//============================================================================
+
+static uint8_t Clamp(double V) {
+	return (uint8_t)((V < 0) ? 0 : (V > 255) ? 255 : V);
+}
+
+// terrain surface crossing the zone, like most generated surface zones
+static std::vector<uint8_t> MakeHillsZone(unsigned Seed) {
+	std::mt19937 Rnd(Seed);
+	std::uniform_real_distribution<double> Phase(0, 6.28);
+	const double P1 = Phase(Rnd), P2 = Phase(Rnd);
+
+	std::vector<uint8_t> Density(ZoneSize * ZoneSize * ZoneSize);
+	for (int X = 0; X < ZoneSize; X++) {
+		for (int Y = 0; Y < ZoneSize; Y++) {
+			const double H = 32 + 12 * std::sin(X * 0.11 + P1) + 9 * std::cos(Y * 0.07 + P2);
+			for (int Z = 0; Z < ZoneSize; Z++) {
+				Density[LinearIndex(X, Y, Z)] = Clamp(128 + (H - Z) * 32);
+			}
+		}
+	}
+	return Density;
+}
+
+// cave like zone, surface everywhere
+static std::vector<uint8_t> MakeCavesZone(unsigned Seed) {
+	std::mt19937 Rnd(Seed);
+	std::uniform_real_distribution<double> Phase(0, 6.28);
+	const double P1 = Phase(Rnd), P2 = Phase(Rnd), P3 = Phase(Rnd);
+
+	std::vector<uint8_t> Density(ZoneSize * ZoneSize * ZoneSize);
+	for (int X = 0; X < ZoneSize; X++) {
+		for (int Y = 0; Y < ZoneSize; Y++) {
+			for (int Z = 0; Z < ZoneSize; Z++) {
+				const double V = std::sin(X * 0.21 + P1) + std::sin(Y * 0.17 + P2) + std::sin(Z * 0.23 + P3);
+				Density[LinearIndex(X, Y, Z)] = Clamp(128 + V * 60);
+			}
+		}
+	}
+	return Density;
+}
+
+// solid zone with few edited holes
+static std::vector<uint8_t> MakeSolidZone(unsigned Seed) {
+	std::mt19937 Rnd(Seed);
+	std::uniform_int_distribution<int> Pos(8, ZoneSize - 9);
+
+	std::vector<uint8_t> Density(ZoneSize * ZoneSize * ZoneSize, 255);
+	for (int I = 0; I < 3; I++) {
+		const int CX = Pos(Rnd), CY = Pos(Rnd), CZ = Pos(Rnd);
+		for (int X = CX - 6; X <= CX + 6; X++) {
+			for (int Y = CY - 6; Y <= CY + 6; Y++) {
+				for (int Z = CZ - 6; Z <= CZ + 6; Z++) {
+					const double R = std::sqrt((double)(X - CX) * (X - CX) + (Y - CY) * (Y - CY) + (Z - CZ) * (Z - CZ));
+					Density[LinearIndex(X, Y, Z)] = Clamp(128 + (R - 5) * 40);
+				}
+			}
+		}
+	}
+	return Density;
+}
+
+//============================================================================
+// Per voxel path, as TVoxelData::performCellSubstanceCaching
+//============================================================================
+
+static bool PerformCellSubstanceCaching(const TBenchDensity& Density, int X, int Y, int Z, int Step, TBenchCache& Cache) {
+	uint8_t D[8];
+	D[7] = Density.get(X, Y - Step, Z);
+	D[6] = Density.get(X, Y, Z);
+	D[5] = Density.get(X - Step, Y - Step, Z);
+	D[4] = Density.get(X - Step, Y, Z);
+	D[3] = Density.get(X, Y - Step, Z - Step);
+	D[2] = Density.get(X, Y, Z - Step);
+	D[1] = Density.get(X - Step, Y - Step, Z - Step);
+	D[0] = Density.get(X - Step, Y, Z - Step);
+
+	int8_t Corner[8];
+	for (int I = 0; I < 8; I++) {
+		Corner[I] = (D[I] <= 127) ? -127 : 0;
+	}
+
+	const unsigned long CaseCode = ((Corner[0] >> 7) & 0x01)
+		| ((Corner[1] >> 6) & 0x02)
+		| ((Corner[2] >> 5) & 0x04)
+		| ((Corner[3] >> 4) & 0x08)
+		| ((Corner[4] >> 3) & 0x10)
+		| ((Corner[5] >> 2) & 0x20)
+		| ((Corner[6] >> 1) & 0x40)
+		| (Corner[7] & 0x80);
+
+	if (CaseCode == 0 || CaseCode == 255) return false;
+
+	Cache.IndexList.push_back(LinearIndex(X - Step, Y - Step, Z - Step));
+	Cache.CaseCodeList.push_back((uint8_t)CaseCode);
+	return true;
+}
+
+static void MakeCachePerVoxel(const TBenchDensity& Density, TBenchCacheLod& CacheLod) {
+	for (int X = 0; X < ZoneSize; X++) {
+		for (int Y = 0; Y < ZoneSize; Y++) {
+			for (int Z = 0; Z < ZoneSize; Z++) {
+				for (int Lod = 0; Lod < LodNum; Lod++) {
+					const int S = 1 << Lod;
+					if (X >= S && Y >= S && Z >= S) {
+						if (X % S == 0 && Y % S == 0 && Z % S == 0) {
+							PerformCellSubstanceCaching(Density, X, Y, Z, S, CacheLod[Lod]);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+//============================================================================
+// Row path, as TVoxelData::makeSubstanceCache
+//============================================================================
+
+static void MakeCacheRows(const TBenchDensity& Density, std::vector<uint8_t>& Occ, std::vector<uint8_t>& LodOcc, TBenchCacheLod& CacheLod) {
+	const int N = ZoneSize;
+	Density.copyTo(Occ.data());
+	casecode::occupancy(Occ.data(), Occ.data(), Occ.size());
+
+	int Cells[ZoneSize];
+	uint8_t Codes[ZoneSize];
+
+	for (int Lod = 0; Lod < LodNum; Lod++) {
+		const int Step = 1 << Lod;
+		if (Step >= N) break;
+
+		const int M = (N - 1) / Step + 1;
+		const uint8_t* Plane = Occ.data();
+		if (Lod > 0) {
+			casecode::downsample(Occ.data(), N, Step, LodOcc.data());
+			Plane = LodOcc.data();
+		}
+
+		TBenchCache& Cache = CacheLod[Lod];
+		for (int X = 1; X < M; X++) {
+			for (int Y = 1; Y < M; Y++) {
+				const uint8_t* A = Plane + ((X - 1) * M + Y) * M;
+				const uint8_t* B = Plane + ((X - 1) * M + Y - 1) * M;
+				const uint8_t* C = Plane + (X * M + Y) * M;
+				const uint8_t* D = Plane + (X * M + Y - 1) * M;
+				const int Count = casecode::classifyRow(A, B, C, D, M, Cells, Codes);
+
+				const uint32_t Base = LinearIndex((X - 1) * Step, (Y - 1) * Step, 0);
+				for (int I = 0; I < Count; I++) {
+					Cache.IndexList.push_back(Base + Cells[I] * Step);
+					Cache.CaseCodeList.push_back(Codes[I]);
+				}
+			}
+		}
+	}
+}
+
+//============================================================================
+// Substance cache
+//============================================================================
+
+static bool SameCache(const TBenchCacheLod& A, const TBenchCacheLod& B) {
+	for (int Lod = 0; Lod < LodNum; Lod++) {
+		if (A[Lod].IndexList != B[Lod].IndexList || A[Lod].CaseCodeList != B[Lod].CaseCodeList) return false;
+	}
+	return true;
+}
+
+// returns false if paths give different cells
+static bool BenchmarkSubstanceCache(const char* Param, std::vector<uint8_t> (*MakeZone)(unsigned)) {
+	const int ZoneCount = 16;
+	const int Passes = 8;
+
+	std::vector<std::unique_ptr<TBenchDensity>> Zones;
+	int DenseBricks = 0;
+	for (int I = 0; I < ZoneCount; I++) {
+		std::unique_ptr<TBenchDensity> Density(new TBenchDensity());
+		Density->initialize(ZoneSize, 0);
+		Density->assign(MakeZone(I + 1).data());
+		DenseBricks += Density->denseBrickCount();
+		Zones.push_back(std::move(Density));
+	}
+	const ulong64 ZoneBytes = (ulong64)ZoneSize * ZoneSize * ZoneSize;
+
+	TBenchCacheLod PerVoxel(LodNum);
+	TBenchCacheLod Rows(LodNum);
+	std::vector<uint8_t> Occ(ZoneBytes);
+	std::vector<uint8_t> LodOcc(ZoneBytes);
+
+	size_t Cells = 0;
+	for (const auto& Zone : Zones) {
+		for (auto& Cache : PerVoxel) Cache.Clear();
+		for (auto& Cache : Rows) Cache.Clear();
+		MakeCachePerVoxel(*Zone, PerVoxel);
+		MakeCacheRows(*Zone, Occ, LodOcc, Rows);
+		if (!SameCache(PerVoxel, Rows)) {
+			fprintf(stderr, "%s: row classification differs from per voxel path\n", Param);
+			return false;
+		}
+		for (const auto& Cache : PerVoxel) Cells += Cache.IndexList.size();
+	}
+
+	fprintf(stderr, "substance cache %s: %d zones, %d cells and %d dense bricks per zone, %s kernel\n", Param, ZoneCount, (int)(Cells / ZoneCount), 
+		DenseBricks / ZoneCount, casecode::instructionSet());
+
+	// caches keep capacity between zones, as TVoxelData::clearSubstanceCache
+	double Start = Now();
+	for (int P = 0; P < Passes; P++) {
+		for (const auto& Zone : Zones) {
+			for (auto& Cache : PerVoxel) Cache.Clear();
+			MakeCachePerVoxel(*Zone, PerVoxel);
+		}
+	}
+	PrintResult("substance_cache", std::string(Param) + "_per_voxel", ZoneCount * Passes, ZoneBytes * ZoneCount * Passes, Now() - Start);
+
+	// copy part of the row path
+	Start = Now();
+	for (int P = 0; P < Passes; P++) {
+		for (const auto& Zone : Zones) {
+			Zone->copyTo(Occ.data());
+		}
+	}
+	PrintResult("substance_cache", std::string(Param) + "_brick_copy", ZoneCount * Passes, ZoneBytes * ZoneCount * Passes, Now() - Start);
+
+	Start = Now();
+	for (int P = 0; P < Passes; P++) {
+		for (const auto& Zone : Zones) {
+			for (auto& Cache : Rows) Cache.Clear();
+			MakeCacheRows(*Zone, Occ, LodOcc, Rows);
+		}
+	}
+	PrintResult("substance_cache", std::string(Param) + "_rows_" + casecode::instructionSet(), ZoneCount * Passes, ZoneBytes * ZoneCount * Passes, Now() - Start);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	Filter = (argc > 1) ? argv[1] : "";
+
+	PrintHeader();
+	bool bSame = true;
+	if (IsEnabled("hills")) bSame &= BenchmarkSubstanceCache("hills", MakeHillsZone);
+	if (IsEnabled("caves")) bSame &= BenchmarkSubstanceCache("caves", MakeCavesZone);
+	if (IsEnabled("solid")) bSame &= BenchmarkSubstanceCache("solid", MakeSolidZone);
+	return bSame ? 0 : 1;
+}
@@ -0,0 +1,365 @@
+//
+//  kvdb_benchmark.cpp
+//  UnrealSandboxTerrain
+//
+//  Standalone benchmark for kvdb.hpp. No engine dependency.
+//
+//  Build (Linux):
+//      g++ -O2 -std=c++14 -pthread -I../Source/UnrealSandboxTerrain/Public kvdb_benchmark.cpp -o kvdb_benchmark
+//
+//  Run:
+//      ./kvdb_benchmark [work dir] [filter]
+//
+//  Results go to stdout as CSV, one row per measurement:
+//      benchmark,param,ops,bytes,seconds,ops_per_sec,mb_per_sec
+//  Progress goes to stderr. filter - run only benchmarks whose name contains it
+//
+
+#include "kvdb.hpp"
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cstdio>
+
+typedef struct TBenchIndex {
+	int32_t X = 0;
+	int32_t Y = 0;
+	int32_t Z = 0;
+
+	TBenchIndex() {}
+
+	TBenchIndex(int32_t XIndex, int32_t YIndex, int32_t ZIndex) : X(XIndex), Y(YIndex), Z(ZIndex) { }
+
+	bool operator==(const TBenchIndex& Other) const {
+		return X == Other.X && Y == Other.Y && Z == Other.Z;
+	}
+} TBenchIndex;
+
+namespace std {
+	template <>
+	struct hash<TBenchIndex> {
+		std::size_t operator()(const TBenchIndex& k) const {
+			return ((hash<int>()(k.X) ^ (hash<int>()(k.Y) << 1)) >> 1) ^ (hash<int>()(k.Z) << 1);
+		}
+	};
+}
+
+typedef kvdb::KvFile<TBenchIndex, TValueData> TBenchKvFile;
+
+static std::string Filter;
+
+static double Now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool IsEnabled(const char* Name) {
+	return Filter.empty() || std::string(Name).find(Filter) != std::string::npos;
+}
+
+static void PrintHeader() {
+	printf("benchmark,param,ops,bytes,seconds,ops_per_sec,mb_per_sec\n");
+}
+
+static void PrintResult(const char* Name, const std::string& Param, ulong64 Ops, ulong64 Bytes, double Time) {
+	const double Ops_s = (Time > 0) ? (double)Ops / Time : 0;
+	const double Mb_s = (Time > 0) ? (double)Bytes / Time / (1024 * 1024) : 0;
+	printf("%s,%s,%llu,%llu,%.6f,%.1f,%.2f\n", Name, Param.c_str(), (unsigned long long)Ops, (unsigned long long)Bytes, Time, Ops_s, Mb_s);
+	fflush(stdout);
+}
+
+// zone keys around origin, generation order
+static std::vector<TBenchIndex> MakeKeys(int AreaRadius, int SizeZ) {
+	std::vector<TBenchIndex> Keys;
+	for (int X = -AreaRadius; X <= AreaRadius; X++) {
+		for (int Y = -AreaRadius; Y <= AreaRadius; Y++) {
+			for (int Z = -SizeZ; Z <= SizeZ; Z++) {
+				Keys.push_back(TBenchIndex(X, Y, Z));
+			}
+		}
+	}
+	return Keys;
+}
+
+static std::vector<TBenchIndex> Shuffled(std::vector<TBenchIndex> Keys, unsigned Seed) {
+	std::mt19937 Rnd(Seed);
+	std::shuffle(Keys.begin(), Keys.end(), Rnd);
+	return Keys;
+}
+
+// compressed zone sizes seen in saved maps: most zones are uniform (solid or empty) and compress
+// to a few hundred bytes, surface zones take tens of kilobytes, dense mesh data up to ~128 KB
+static std::vector<size_t> MakeValueSizes(size_t Count, unsigned Seed) {
+	std::mt19937 Rnd(Seed);
+	std::uniform_real_distribution<double> Kind(0, 1);
+	std::uniform_int_distribution<size_t> Small(64, 512);
+	std::uniform_int_distribution<size_t> Medium(4 * 1024, 32 * 1024);
+	std::uniform_int_distribution<size_t> Large(32 * 1024, 128 * 1024);
+
+	std::vector<size_t> Sizes(Count);
+	for (size_t I = 0; I < Count; I++) {
+		const double K = Kind(Rnd);
+		Sizes[I] = (K < 0.6) ? Small(Rnd) : (K < 0.9) ? Medium(Rnd) : Large(Rnd);
+	}
+	return Sizes;
+}
+
+// distinct content, so deduplication never kicks in
+static TValueData MakeValue(size_t Size, size_t Seed) {
+	TValueData Value(Size);
+	for (size_t J = 0; J < Size; J += 64) Value[J] = (byte)(Seed + J);
+	if (Size >= sizeof(ulong64)) std::memcpy(Value.data(), &Seed, sizeof(ulong64));
+	return Value;
+}
+
+static bool CreateAndOpen(TBenchKvFile& KvFile, const std::string& FileName) {
+	std::remove((FileName + ".idx").c_str());
+	TBenchKvFile::create(FileName, std::unordered_map<TBenchIndex, TValueData>());
+	if (!KvFile.open(FileName)) {
+		fprintf(stderr, "unable to open %s\n", FileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+static void RemoveFile(const std::string& FileName) {
+	std::remove(FileName.c_str());
+	std::remove((FileName + ".idx").c_str());
+}
+
+static ulong64 FillFile(TBenchKvFile& KvFile, const std::vector<TBenchIndex>& Keys, const std::vector<size_t>& Sizes) {
+	ulong64 Bytes = 0;
+	for (size_t I = 0; I < Keys.size(); I++) {
+		KvFile.save(Keys[I], MakeValue(Sizes[I], I));
+		Bytes += Sizes[I];
+	}
+	return Bytes;
+}
+
+//============================================================================
+// Sequential and random save/load
+//============================================================================
+
+static void BenchmarkSaveLoad(const std::string& WorkDir) {
+	const std::string FileName = WorkDir + "/kvdb_bench_saveload.dat";
+	const std::vector<TBenchIndex> Keys = MakeKeys(20, 5); // 41 x 41 x 11 zones
+	const std::vector<size_t> Sizes = MakeValueSizes(Keys.size(), 1);
+
+	std::vector<TValueData> Values;
+	ulong64 TotalBytes = 0;
+	for (size_t I = 0; I < Keys.size(); I++) {
+		Values.push_back(MakeValue(Sizes[I], I));
+		TotalBytes += Sizes[I];
+	}
+
+	fprintf(stderr, "save/load: %d keys, %f MB\n", (int)Keys.size(), (double)TotalBytes / (1024 * 1024));
+
+	std::vector<size_t> Order(Keys.size());
+	for (size_t I = 0; I < Order.size(); I++) Order[I] = I;
+	std::vector<size_t> RandomOrder = Order;
+	std::shuffle(RandomOrder.begin(), RandomOrder.end(), std::mt19937(2));
+
+	for (int Pass = 0; Pass < 2; Pass++) {
+		const std::vector<size_t>& SaveOrder = (Pass == 0) ? Order : RandomOrder;
+		const char* Param = (Pass == 0) ? "sequential" : "random";
+
+		TBenchKvFile KvFile;
+		if (!CreateAndOpen(KvFile, FileName)) return;
+
+		double Start = Now();
+		for (size_t I : SaveOrder) KvFile.save(Keys[I], Values[I]);
+		PrintResult("save", Param, Keys.size(), TotalBytes, Now() - Start);
+
+		for (int LoadPass = 0; LoadPass < 2; LoadPass++) {
+			const std::vector<size_t>& LoadOrder = (LoadPass == 0) ? Order : RandomOrder;
+			ulong64 Bytes = 0;
+
+			Start = Now();
+			for (size_t I : LoadOrder) {
+				TValueDataPtr DataPtr = KvFile.loadData(Keys[I]);
+				if (DataPtr) Bytes += DataPtr->size();
+			}
+			PrintResult("load", std::string(Param) + "_saved_" + ((LoadPass == 0) ? "sequential" : "random"), Keys.size(), Bytes, Now() - Start);
+		}
+
+		KvFile.close();
+		RemoveFile(FileName);
+	}
+}
+
+//============================================================================
+// Overwrite: in place versus relocating growth
+//============================================================================
+
+static void BenchmarkOverwrite(const std::string& WorkDir) {
+	const std::string FileName = WorkDir + "/kvdb_bench_overwrite.dat";
+	const std::vector<TBenchIndex> Keys = Shuffled(MakeKeys(16, 5), 3);
+	const std::vector<size_t> Sizes = MakeValueSizes(Keys.size(), 4);
+
+	fprintf(stderr, "overwrite: %d keys\n", (int)Keys.size());
+
+	// same size and shrinking values fit the old slot, growing ones move to a new one
+	const struct { const char* Param; double Scale; } CaseList[] = { { "in_place_same", 1.0 }, { "in_place_shrink", 0.75 }, { "relocate_grow", 2.0 } };
+
+	for (const auto& Case : CaseList) {
+		TBenchKvFile KvFile;
+		if (!CreateAndOpen(KvFile, FileName)) return;
+		FillFile(KvFile, Keys, Sizes);
+
+		ulong64 Bytes = 0;
+		double Start = Now();
+		for (size_t I = 0; I < Keys.size(); I++) {
+			const size_t Size = std::max<size_t>(1, (size_t)(Sizes[I] * Case.Scale));
+			KvFile.save(Keys[I], MakeValue(Size, I + 1));
+			Bytes += Size;
+		}
+		const double Time = Now() - Start;
+
+		PrintResult("overwrite", Case.Param, Keys.size(), Bytes, Time);
+		PrintResult("overwrite_file_size", Case.Param, Keys.size(), KvFile.spaceUsage().fileSize, Time);
+
+		KvFile.close();
+		RemoveFile(FileName);
+	}
+}
+
+//============================================================================
+// Erase/reinsert churn
+//============================================================================
+
+static void BenchmarkChurn(const std::string& WorkDir) {
+	const std::string FileName = WorkDir + "/kvdb_bench_churn.dat";
+	const std::vector<TBenchIndex> Keys = MakeKeys(16, 5);
+	const std::vector<size_t> Sizes = MakeValueSizes(Keys.size(), 5);
+	const int RoundCount = 10;
+	const size_t ChurnPerRound = Keys.size() / 4;
+
+	TBenchKvFile KvFile;
+	if (!CreateAndOpen(KvFile, FileName)) return;
+	FillFile(KvFile, Keys, Sizes);
+
+	fprintf(stderr, "churn: %d keys, %d rounds of %d erase + reinsert\n", (int)Keys.size(), RoundCount, (int)ChurnPerRound);
+
+	std::mt19937 Rnd(6);
+	std::uniform_int_distribution<size_t> Dist(0, Keys.size() - 1);
+	const std::vector<size_t> NewSizes = MakeValueSizes(ChurnPerRound * RoundCount, 7);
+
+	for (int Round = 0; Round < RoundCount; Round++) {
+		std::vector<size_t> Picked;
+		for (size_t I = 0; I < ChurnPerRound; I++) Picked.push_back(Dist(Rnd));
+
+		ulong64 Bytes = 0;
+		double Start = Now();
+		for (size_t I : Picked) KvFile.erase(Keys[I]);
+		for (size_t I = 0; I < Picked.size(); I++) {
+			const size_t Size = NewSizes[Round * ChurnPerRound + I];
+			KvFile.save(Keys[Picked[I]], MakeValue(Size, Round * 1000003 + I));
+			Bytes += Size;
+		}
+		const double Time = Now() - Start;
+
+		const kvdb::TSpaceUsage Usage = KvFile.spaceUsage();
+		PrintResult("churn", "round_" + std::to_string(Round), Picked.size() * 2, Bytes, Time);
+		PrintResult("churn_wasted_bytes", "round_" + std::to_string(Round), Usage.freeSlotCount, Usage.wastedBytes(), Time);
+	}
+
+	KvFile.close();
+	RemoveFile(FileName);
+}
+
+//============================================================================
+// Open time against key count
+//============================================================================
+
+static void BenchmarkOpen(const std::string& WorkDir) {
+	const std::string FileName = WorkDir + "/kvdb_bench_open.dat";
+	const int RadiusList[] = { 5, 16, 32, 64 }; // ~1.3K to ~186K keys
+
+	for (int Radius : RadiusList) {
+		const std::vector<TBenchIndex> Keys = MakeKeys(Radius, 5);
+		fprintf(stderr, "open: %d keys\n", (int)Keys.size());
+
+		// small values, open time depends on key count only
+		std::unordered_map<TBenchIndex, TValueData> Data;
+		for (size_t I = 0; I < Keys.size(); I++) Data[Keys[I]] = MakeValue(16, I);
+
+		std::remove((FileName + ".idx").c_str());
+		TBenchKvFile::create(FileName, Data);
+		const std::string Param = std::to_string(Keys.size()) + "_keys";
+
+		for (int Pass = 0; Pass < 2; Pass++) {
+			// first pass walks key tables, close writes index snapshot used by the second one
+			TBenchKvFile KvFile;
+			double Start = Now();
+			if (!KvFile.open(FileName)) {
+				fprintf(stderr, "unable to open %s\n", FileName.c_str());
+				return;
+			}
+			const double Time = Now() - Start;
+
+			PrintResult(KvFile.isIndexFromSnapshot() ? "open_snapshot" : "open_table_walk", Param, KvFile.size(), 0, Time);
+			KvFile.save(Keys[0], MakeValue(16, 0)); // mark index changed, so close writes snapshot
+			KvFile.close();
+		}
+
+		RemoveFile(FileName);
+	}
+}
+
+//============================================================================
+// Concurrent random reads
+//============================================================================
+
+static void BenchmarkConcurrentReads(const std::string& WorkDir) {
+	const std::string FileName = WorkDir + "/kvdb_bench_reads.dat";
+	const std::vector<TBenchIndex> Keys = MakeKeys(16, 5); // 33 x 33 x 11 zones
+	const std::vector<size_t> Sizes = MakeValueSizes(Keys.size(), 8);
+	const int ReadsPerThread = 20000;
+
+	TBenchKvFile KvFile;
+	if (!CreateAndOpen(KvFile, FileName)) return;
+	FillFile(KvFile, Keys, Sizes);
+
+	fprintf(stderr, "concurrent reads: %d keys, %d reads per thread\n", (int)Keys.size(), ReadsPerThread);
+
+	for (int ThreadCount = 1; ThreadCount <= 16; ThreadCount *= 2) {
+		std::atomic<ulong64> Bytes(0);
+		std::vector<std::thread> Threads;
+
+		double Start = Now();
+		for (int T = 0; T < ThreadCount; T++) {
+			Threads.push_back(std::thread([&, T]() {
+				std::mt19937 Rnd(T);
+				std::uniform_int_distribution<size_t> Dist(0, Keys.size() - 1);
+				ulong64 LocalBytes = 0;
+				for (int I = 0; I < ReadsPerThread; I++) {
+					TValueDataPtr DataPtr = KvFile.loadData(Keys[Dist(Rnd)]);
+					if (DataPtr) LocalBytes += DataPtr->size();
+				}
+				Bytes += LocalBytes;
+			}));
+		}
+
+		for (auto& Thread : Threads) Thread.join();
+		const double Time = Now() - Start;
+
+		PrintResult("concurrent_reads", std::to_string(ThreadCount) + "_threads", (ulong64)ReadsPerThread * ThreadCount, Bytes, Time);
+	}
+
+	KvFile.close();
+	RemoveFile(FileName);
+}
+
+int main(int argc, char** argv) {
+	const std::string WorkDir = (argc > 1) ? argv[1] : ".";
+	Filter = (argc > 2) ? argv[2] : "";
+
+	PrintHeader();
+	if (IsEnabled("save_load")) BenchmarkSaveLoad(WorkDir);
+	if (IsEnabled("overwrite")) BenchmarkOverwrite(WorkDir);
+	if (IsEnabled("churn")) BenchmarkChurn(WorkDir);
+	if (IsEnabled("open")) BenchmarkOpen(WorkDir);
+	if (IsEnabled("concurrent_reads")) BenchmarkConcurrentReads(WorkDir);
+	return 0;
+}
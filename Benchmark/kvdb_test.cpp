@@ -0,0 +1,361 @@
+//
+//  kvdb_test.cpp
+//  UnrealSandboxTerrain
+//
+//  Standalone checks for kvdb.hpp. No engine dependency.
+//
+//  Build (Linux):
+//      g++ -O2 -std=c++14 -pthread -I../Source/UnrealSandboxTerrain/Public kvdb_test.cpp -o kvdb_test
+//
+//  Run:
+//      ./kvdb_test [work dir]
+//
+//  Failed checks go to stderr, one line per test to stdout. Exit code is 1 if any check failed
+//
+
+#include "kvdb.hpp"
+
+#include <chrono>
+#include <thread>
+#include <cstdio>
+
+typedef struct TTestIndex {
+	int32_t X = 0;
+	int32_t Y = 0;
+	int32_t Z = 0;
+
+	TTestIndex() {}
+
+	TTestIndex(int32_t XIndex, int32_t YIndex, int32_t ZIndex) : X(XIndex), Y(YIndex), Z(ZIndex) { }
+
+	bool operator==(const TTestIndex& Other) const {
+		return X == Other.X && Y == Other.Y && Z == Other.Z;
+	}
+} TTestIndex;
+
+namespace std {
+	template <>
+	struct hash<TTestIndex> {
+		std::size_t operator()(const TTestIndex& k) const {
+			return ((hash<int>()(k.X) ^ (hash<int>()(k.Y) << 1)) >> 1) ^ (hash<int>()(k.Z) << 1);
+		}
+	};
+}
+
+typedef kvdb::KvFile<TTestIndex, TValueData> TTestKvFile;
+
+static int FailCount = 0;
+
+// stays on in release build, unlike assert()
+#define CHECK(Cond) \
+	do { \
+		if (!(Cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Cond); \
+			FailCount++; \
+		} \
+	} while (0)
+
+static TTestIndex KeyOf(int I) {
+	return TTestIndex(I % 16 - 8, (I / 16) % 16 - 8, I / 256);
+}
+
+// distinct content for each seed
+static TValueData MakeValue(size_t Size, size_t Seed) {
+	TValueData Value(Size);
+	for (size_t J = 0; J < Size; J++) Value[J] = (byte)(Seed * 31 + J);
+	return Value;
+}
+
+static bool HasValue(TTestKvFile& KvFile, const TTestIndex& Key, const TValueData& Expected) {
+	TValueDataPtr Data = KvFile.loadData(Key);
+	return Data != nullptr && *Data == Expected;
+}
+
+static bool HasValue(const TTestKvFile::Snapshot& Snapshot, const TTestIndex& Key, const TValueData& Expected) {
+	TValueDataPtr Data = Snapshot.loadData(Key);
+	return Data != nullptr && *Data == Expected;
+}
+
+static void RemoveFile(const std::string& FileName) {
+	std::remove(FileName.c_str());
+	std::remove((FileName + ".idx").c_str());
+}
+
+static bool CreateAndOpen(TTestKvFile& KvFile, const std::string& FileName) {
+	RemoveFile(FileName);
+	TTestKvFile::create(FileName, std::unordered_map<TTestIndex, TValueData>());
+	return KvFile.open(FileName);
+}
+
+// close and open again. without index snapshot key tables are walked
+static bool Reopen(TTestKvFile& KvFile, const std::string& FileName, bool bKeepIndexSnapshot) {
+	KvFile.close();
+	if (!bKeepIndexSnapshot) std::remove((FileName + ".idx").c_str());
+	return KvFile.open(FileName);
+}
+
+static void PrintResult(const char* Name, int FailCountBefore) {
+	printf("%s: %s\n", Name, (FailCount == FailCountBefore) ? "ok" : "FAILED");
+	fflush(stdout);
+}
+
+//============================================================================
+// Batch of puts and erases is all in file after reopen
+//============================================================================
+
+static void TestReopenAfterBatch(const std::string& WorkDir) {
+	const int FailCountBefore = FailCount;
+	const std::string FileName = WorkDir + "/kvdb_test_batch.dat";
+	const int KeyCount = 1000;
+
+	TTestKvFile KvFile;
+	CHECK(CreateAndOpen(KvFile, FileName));
+
+	for (int I = 0; I < KeyCount; I++) {
+		KvFile.save(KeyOf(I), MakeValue(100 + I % 300, I));
+	}
+
+	// odd keys grow, every fourth is erased, new keys are added
+	TTestKvFile::WriteBatch Batch;
+	for (int I = 0; I < KeyCount; I++) {
+		if (I % 4 == 0) {
+			Batch.erase(KeyOf(I));
+		} else if (I % 2 == 1) {
+			Batch.put(KeyOf(I), MakeValue(500 + I % 300, I + KeyCount));
+		}
+	}
+
+	for (int I = KeyCount; I < KeyCount + 200; I++) {
+		Batch.put(KeyOf(I), MakeValue(200, I));
+	}
+
+	const kvdb::TWriteBatchResult Result = KvFile.commit(Batch);
+	CHECK(Result.putCount == KeyCount / 2 + 200);
+	CHECK(Result.eraseCount == KeyCount / 4);
+
+	auto Verify = [&]() {
+		CHECK(KvFile.size() == KeyCount - KeyCount / 4 + 200);
+		for (int I = 0; I < KeyCount; I++) {
+			if (I % 4 == 0) {
+				CHECK(!KvFile.isExist(KeyOf(I)));
+				CHECK(KvFile.loadData(KeyOf(I)) == nullptr);
+			} else if (I % 2 == 1) {
+				CHECK(HasValue(KvFile, KeyOf(I), MakeValue(500 + I % 300, I + KeyCount)));
+			} else {
+				CHECK(HasValue(KvFile, KeyOf(I), MakeValue(100 + I % 300, I)));
+			}
+		}
+
+		for (int I = KeyCount; I < KeyCount + 200; I++) {
+			CHECK(HasValue(KvFile, KeyOf(I), MakeValue(200, I)));
+		}
+	};
+
+	Verify();
+	CHECK(Reopen(KvFile, FileName, true));
+	CHECK(KvFile.isIndexFromSnapshot());
+	Verify();
+	CHECK(Reopen(KvFile, FileName, false));
+	CHECK(!KvFile.isIndexFromSnapshot());
+	Verify();
+
+	KvFile.close();
+	RemoveFile(FileName);
+	PrintResult("reopen_after_batch", FailCountBefore);
+}
+
+//============================================================================
+// Compaction waits for open snapshot, or gives up after snapshotWaitMs
+//============================================================================
+
+static void TestCompactionWithSnapshot(const std::string& WorkDir) {
+	const int FailCountBefore = FailCount;
+	const std::string FileName = WorkDir + "/kvdb_test_compact.dat";
+	const int KeyCount = 2000;
+
+	TTestKvFile KvFile;
+	CHECK(CreateAndOpen(KvFile, FileName));
+
+	for (int I = 0; I < KeyCount; I++) {
+		KvFile.save(KeyOf(I), MakeValue(1000, I));
+	}
+
+	// free space for compaction to drop
+	for (int I = 0; I < KeyCount; I += 2) {
+		KvFile.erase(KeyOf(I));
+	}
+
+	// snapshot sees values before overwrite, released by other thread while compaction waits for it
+	{
+		TTestKvFile::Snapshot Snapshot = KvFile.snapshot();
+		for (int I = 1; I < KeyCount; I += 4) {
+			KvFile.save(KeyOf(I), MakeValue(1000, I + KeyCount));
+		}
+
+		std::thread Releaser([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			for (int I = 1; I < KeyCount; I += 2) {
+				CHECK(HasValue(Snapshot, KeyOf(I), MakeValue(1000, I)));
+			}
+			Snapshot = TTestKvFile::Snapshot();
+		});
+
+		const kvdb::TCompactionResult Result = KvFile.compact();
+		Releaser.join();
+
+		CHECK(Result.bSuccess);
+		CHECK(!Result.bSnapshotTimeout);
+		CHECK(Result.newFileSize < Result.oldFileSize);
+	}
+
+	auto ValueOf = [&](int I) {
+		return (I % 4 == 1) ? MakeValue(1000, I + KeyCount) : MakeValue(1000, I);
+	};
+
+	auto Verify = [&]() {
+		CHECK(KvFile.size() == KeyCount / 2);
+		for (int I = 1; I < KeyCount; I += 2) {
+			CHECK(HasValue(KvFile, KeyOf(I), ValueOf(I)));
+		}
+	};
+
+	Verify();
+
+	// snapshot is never released in time
+	{
+		TTestKvFile::Snapshot Snapshot = KvFile.snapshot();
+		KvFile.erase(KeyOf(1));
+
+		kvdb::TCompactionBudget Budget;
+		Budget.snapshotWaitMs = 20;
+		const kvdb::TCompactionResult Result = KvFile.compact(Budget);
+
+		CHECK(!Result.bSuccess);
+		CHECK(Result.bSnapshotTimeout);
+		CHECK(HasValue(Snapshot, KeyOf(1), ValueOf(1)));
+		CHECK(!KvFile.isExist(KeyOf(1)));
+	}
+
+	KvFile.save(KeyOf(1), ValueOf(1));
+	Verify();
+	CHECK(Reopen(KvFile, FileName, false));
+	Verify();
+
+	KvFile.close();
+	RemoveFile(FileName);
+	PrintResult("compaction_with_snapshot", FailCountBefore);
+}
+
+//============================================================================
+// Overwrite of value whose slot is shared by deduplication
+//============================================================================
+
+static void TestDedupOverwrite(const std::string& WorkDir) {
+	const int FailCountBefore = FailCount;
+	const std::string FileName = WorkDir + "/kvdb_test_dedup.dat";
+	const TValueData SharedValue(300, 7);
+
+	TTestKvFile KvFile;
+	CHECK(CreateAndOpen(KvFile, FileName));
+	KvFile.setDeduplication(true);
+
+	for (int I = 0; I < 4; I++) {
+		KvFile.save(KeyOf(I), SharedValue);
+	}
+
+	CHECK(KvFile.spaceUsage().sharedKeyCount == 3);
+
+	// same size, bigger and smaller value over the shared slot, the rest keeps it
+	KvFile.save(KeyOf(0), MakeValue(300, 100));
+	KvFile.save(KeyOf(1), MakeValue(600, 101));
+	KvFile.save(KeyOf(2), MakeValue(50, 102));
+
+	auto Verify = [&]() {
+		CHECK(HasValue(KvFile, KeyOf(0), MakeValue(300, 100)));
+		CHECK(HasValue(KvFile, KeyOf(1), MakeValue(600, 101)));
+		CHECK(HasValue(KvFile, KeyOf(2), MakeValue(50, 102)));
+		CHECK(HasValue(KvFile, KeyOf(3), SharedValue));
+	};
+
+	Verify();
+	CHECK(Reopen(KvFile, FileName, true));
+	Verify();
+
+	// last key of the shared slot is erased, new values may take the slot or share content again
+	KvFile.setDeduplication(true);
+	KvFile.erase(KeyOf(3));
+	KvFile.save(KeyOf(4), MakeValue(300, 104));
+	KvFile.save(KeyOf(5), SharedValue);
+
+	auto VerifyAfterErase = [&]() {
+		CHECK(!KvFile.isExist(KeyOf(3)));
+		CHECK(HasValue(KvFile, KeyOf(0), MakeValue(300, 100)));
+		CHECK(HasValue(KvFile, KeyOf(4), MakeValue(300, 104)));
+		CHECK(HasValue(KvFile, KeyOf(5), SharedValue));
+	};
+
+	VerifyAfterErase();
+	CHECK(Reopen(KvFile, FileName, false));
+	VerifyAfterErase();
+
+	KvFile.close();
+	RemoveFile(FileName);
+	PrintResult("dedup_overwrite", FailCountBefore);
+}
+
+//============================================================================
+// Values stored inside key entries survive reopen
+//============================================================================
+
+static void TestInlineReopen(const std::string& WorkDir) {
+	const int FailCountBefore = FailCount;
+	const std::string FileName = WorkDir + "/kvdb_test_inline.dat";
+
+	TTestKvFile KvFile;
+	CHECK(CreateAndOpen(KvFile, FileName));
+
+	for (int I = 0; I < KVDB_INLINE_MAX_SIZE; I++) {
+		KvFile.save(KeyOf(I), MakeValue(I + 1, I));
+	}
+
+	CHECK(KvFile.spaceUsage().inlineKeyCount == KVDB_INLINE_MAX_SIZE);
+
+	// inline value grows out of key entry and back
+	KvFile.save(KeyOf(0), MakeValue(1000, 100));
+	KvFile.save(KeyOf(100), MakeValue(1000, 101));
+	KvFile.save(KeyOf(100), MakeValue(8, 102));
+
+	auto Verify = [&]() {
+		CHECK(HasValue(KvFile, KeyOf(0), MakeValue(1000, 100)));
+		for (int I = 1; I < KVDB_INLINE_MAX_SIZE; I++) {
+			CHECK(HasValue(KvFile, KeyOf(I), MakeValue(I + 1, I)));
+
+			kvdb::TValueView View = KvFile.loadView(KeyOf(I));
+			CHECK(View && TValueData(View.data(), View.data() + View.size()) == MakeValue(I + 1, I));
+		}
+
+		CHECK(HasValue(KvFile, KeyOf(100), MakeValue(8, 102)));
+		CHECK(KvFile.spaceUsage().inlineKeyCount == KVDB_INLINE_MAX_SIZE);
+	};
+
+	Verify();
+	CHECK(Reopen(KvFile, FileName, true));
+	Verify();
+	CHECK(Reopen(KvFile, FileName, false));
+	Verify();
+
+	KvFile.close();
+	RemoveFile(FileName);
+	PrintResult("inline_reopen", FailCountBefore);
+}
+
+int main(int argc, char** argv) {
+	const std::string WorkDir = (argc > 1) ? argv[1] : ".";
+
+	TestReopenAfterBatch(WorkDir);
+	TestCompactionWithSnapshot(WorkDir);
+	TestDedupOverwrite(WorkDir);
+	TestInlineReopen(WorkDir);
+
+	return (FailCount > 0) ? 1 : 0;
+}
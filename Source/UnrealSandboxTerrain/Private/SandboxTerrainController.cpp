@@ -3,10 +3,13 @@
 #include "SandboxTerrainController.h"
 #include "Serialization/ArchiveLoadCompressedProxy.h"
 #include "Serialization/ArchiveSaveCompressedProxy.h"
+#include "Serialization/BufferReader.h"
 #include "Async.h"
 #include "Json.h"
 #include "JsonObjectConverter.h"
 #include "DrawDebugHelpers.h"
+#include "EngineUtils.h"
+#include "HAL/IConsoleManager.h"
 
 #include "TerrainZoneComponent.h"
 #include "VdServerComponent.h"
@@ -26,7 +29,7 @@
 
 
 
-bool LoadDataFromKvFile(TKvFile& KvFile, const TVoxelIndex& Index, std::function<void(TValueDataPtr)> Function);
+bool LoadViewFromKvFile(TKvFile& KvFile, const TVoxelIndex& Index, std::function<void(const kvdb::TValueView&)> Function);
 //TValueDataPtr SerializeMeshData(TMeshData const * MeshDataPtr);
 TValueDataPtr SerializeMeshData(TMeshDataPtr MeshDataPtr);
 //bool CheckSaveDir(FString SaveDir);
@@ -339,7 +342,7 @@ void ASandboxTerrainController::NetworkSerializeVd(FBufferArchive& Buffer, const
 void ASandboxTerrainController::FastSave() {
     const std::lock_guard<std::mutex> lock(FastSaveMutex);
     
-    if (!VdFile.isOpen() || !MdFile.isOpen() || !ObjFile.isOpen()) return;
+    if (!IsStorageOpen()) return;
     double Start, End, Time1, Time2;
     
     Start = FPlatformTime::Seconds();
@@ -350,6 +353,10 @@ void ASandboxTerrainController::FastSave() {
 
 	uint32 SavedMd = 0;
 	uint32 SavedObj = 0;
+
+	TKvFile::WriteBatch VdBatch;
+	TKvFile::WriteBatch MdBatch;
+	TKvFile::WriteBatch ObjBatch;
     
     //save voxel data
     TerrainData->ForEachVdSafe([&](TVoxelIndex Index, TVoxelDataInfo* VdInfo){
@@ -363,7 +370,8 @@ void ASandboxTerrainController::FastSave() {
 	TerrainData->ForEachMeshDataSafeAndClear([&](TVoxelIndex Index, TMeshDataPtr MeshDataPtr) {
 		TValueDataPtr DataPtr = SerializeMeshData(MeshDataPtr);
 		if (DataPtr) {
-			MdFile.save(Index, *DataPtr);
+			MdBatch.put(Index, *DataPtr);
+			MeshDataCache.erase(Index);
 			SavedMd++;
 		}
 	});
@@ -382,7 +390,7 @@ void ASandboxTerrainController::FastSave() {
 		if (FoliageDataAsset) {
 			TValueDataPtr DataPtr = UTerrainZoneComponent::SerializeInstancedMesh(InstanceObjectMap);
 			if (DataPtr) {
-				ObjFile.save(Index, *DataPtr);
+				ObjBatch.put(Index, *DataPtr);
 				SavedObj++;
 			}
 		}
@@ -395,13 +403,11 @@ void ASandboxTerrainController::FastSave() {
     for(auto& Index : VdList){
         TVoxelDataInfo* VdInfo = GetVoxelDataInfo(Index);
         VdInfo->LoadVdMutexPtr->lock();
-        if (VdInfo->Vd == nullptr) return;
-        if (VdInfo->IsChanged()) {
+        if (VdInfo->Vd != nullptr && VdInfo->IsChanged()) {
             auto Data = VdInfo->Vd->serialize();
-            VdFile.save(Index, *Data);
+            VdBatch.put(Index, *Data);
             VdInfo->ResetLastSave();
         }
-        VdInfo->Unload();
         VdInfo->LoadVdMutexPtr->unlock();
     }
     
@@ -410,9 +416,28 @@ void ASandboxTerrainController::FastSave() {
         auto Zone = GetZoneByVectorIndex(Index2);
         if (Zone->IsNeedSave()) {
             auto Data = Zone->SerializeAndResetObjectData();
-            ObjFile.save(Index2, *Data);
+            ObjBatch.put(Index2, *Data);
         }
     }
+
+	CommitZoneData(VdBatch, MdBatch, ObjBatch);
+
+	// index snapshots for fast open. write-behind files are still being written, snapshot is taken on close
+	if (!bWriteBehindSave) {
+		ForEachStorageFile([&](TKvFile& KvFile, const TCHAR* Name) {
+			KvFile.checkpoint();
+		});
+	}
+
+	// unload voxel data only after it is in file or write-behind queue. changed again meanwhile - keep it for next save
+	for (auto& Index : VdList) {
+		TVoxelDataInfo* VdInfo = GetVoxelDataInfo(Index);
+		VdInfo->LoadVdMutexPtr->lock();
+		if (!VdInfo->IsChanged()) {
+			VdInfo->Unload();
+		}
+		VdInfo->LoadVdMutexPtr->unlock();
+	}
     
     SaveJson();
 
@@ -421,33 +446,85 @@ void ASandboxTerrainController::FastSave() {
     UE_LOG(LogSandboxTerrain, Warning, TEXT("Terrain saved: vd/md/obj -> %d/%d/%d  -> %f ms - %f ms"), VdList.size(), SavedMd, ObjList.size() + SavedObj, Time1 , Time2);
 }
 
+void LogWriteBatchResult(TKvFile& KvFile, const kvdb::TWriteBatchResult& Res, const TCHAR* Name) {
+	if (KvFile.isWriteBehind()) {
+		const kvdb::TWriteBehindStats Stats = KvFile.getWriteBehindStats();
+		UE_LOG(LogSandboxTerrain, Log, TEXT("Queue %s batch: %d put / %d erase -> %f ms, queue depth %d keys / %f MB, drain rate %f MB/s"), Name, (int32)Res.putCount, (int32)Res.eraseCount,
+			Res.commitTimeMs, (int32)Stats.queueKeys, (double)Stats.queueBytes / (1024 * 1024), Stats.drainRate() / (1024 * 1024));
+		return;
+	}
+
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Commit %s batch: %d put / %d erase, appended %f KB, in place %f KB, relocated %d, key entries %d -> %f ms"), Name, (int32)Res.putCount, (int32)Res.eraseCount,
+		(double)Res.appendedBytes / 1024, (double)Res.rewrittenBytes / 1024, (int32)Res.relocatedCount, (int32)Res.keyEntryCount, Res.commitTimeMs);
+}
+
+void ASandboxTerrainController::CommitWriteBatch(TKvFile& KvFile, const TKvFile::WriteBatch& Batch, const TCHAR* Name) {
+	if (Batch.isEmpty()) return;
+	LogWriteBatchResult(KvFile, KvFile.commit(Batch), Name);
+}
+
+void ASandboxTerrainController::CommitZoneData(const TKvFile::WriteBatch& VdBatch, const TKvFile::WriteBatch& MdBatch, const TKvFile::WriteBatch& ObjBatch) {
+	if (bSingleFileStorage) {
+		// all columns of zone go to one record, whole save is one batch
+		if (VdBatch.isEmpty() && MdBatch.isEmpty() && ObjBatch.isEmpty()) return;
+		LogWriteBatchResult(TerrainFile.file(), TerrainFile.commit({ &VdBatch, &MdBatch, &ObjBatch }), TEXT("terrain"));
+		return;
+	}
+
+	CommitWriteBatch(VdFile, VdBatch, TEXT("vd"));
+	CommitWriteBatch(MdFile, MdBatch, TEXT("md"));
+	CommitWriteBatch(ObjFile, ObjBatch, TEXT("obj"));
+}
+
+bool ASandboxTerrainController::IsStorageOpen() {
+	if (bSingleFileStorage) {
+		return TerrainFile.isOpen();
+	}
+
+	return VdFile.isOpen() && MdFile.isOpen() && ObjFile.isOpen();
+}
+
+void ASandboxTerrainController::ForEachStorageFile(std::function<void(TKvFile&, const TCHAR*)> Function) {
+	if (bSingleFileStorage) {
+		Function(TerrainFile.file(), TEXT("terrain"));
+		return;
+	}
+
+	Function(VdFile, TEXT("vd"));
+	Function(MdFile, TEXT("md"));
+	Function(ObjFile, TEXT("obj"));
+}
+
 void ASandboxTerrainController::Save() {
-	if (!VdFile.isOpen() || !MdFile.isOpen() || !ObjFile.isOpen()) return;
+	if (!IsStorageOpen()) return;
 	double Start = FPlatformTime::Seconds();
 
 	uint32 SavedVd = 0;
 	uint32 SavedMd = 0;
 	uint32 SavedObj = 0;
 
+	TKvFile::WriteBatch VdBatch;
+	TKvFile::WriteBatch MdBatch;
+	TKvFile::WriteBatch ObjBatch;
+
     //save voxel data
     TerrainData->ForEachVdSafe([&](TVoxelIndex Index, TVoxelDataInfo* VdInfo){
         if (VdInfo->Vd == nullptr) return;
         if (VdInfo->IsChanged()) {
             //TVoxelIndex Index = GetZoneIndex(VdInfo.Vd->getOrigin());
             auto Data = VdInfo->Vd->serialize();
-            VdFile.save(Index, *Data);
+            VdBatch.put(Index, *Data);
             VdInfo->ResetLastSave();
             SavedVd++;
         }
-
-        VdInfo->Unload();
     });
 
 	//save mesh data
 	TerrainData->ForEachMeshDataSafeAndClear([&](TVoxelIndex Index, TMeshDataPtr MeshDataPtr) {
 		TValueDataPtr DataPtr = SerializeMeshData(MeshDataPtr);
 		if (DataPtr) {
-			MdFile.save(Index, *DataPtr);
+			MdBatch.put(Index, *DataPtr);
+			MeshDataCache.erase(Index);
 			SavedMd++;
 		}
 	});
@@ -457,7 +534,7 @@ void ASandboxTerrainController::Save() {
 		if (FoliageDataAsset) {
 			TValueDataPtr DataPtr = UTerrainZoneComponent::SerializeInstancedMesh(InstanceObjectMap);
 			if (DataPtr) {
-				ObjFile.save(Index, *DataPtr);
+				ObjBatch.put(Index, *DataPtr);
 				SavedObj++;
 			}
 		}
@@ -468,11 +545,28 @@ void ASandboxTerrainController::Save() {
         if (FoliageDataAsset) {
             if (Zone->IsNeedSave()) {
                 auto DataPtr = Zone->SerializeAndResetObjectData();
-                ObjFile.save(TVoxelIndex(ZoneIndex.X, ZoneIndex.Y, ZoneIndex.Z), *DataPtr);
+                ObjBatch.put(TVoxelIndex(ZoneIndex.X, ZoneIndex.Y, ZoneIndex.Z), *DataPtr);
                 SavedObj++;
             }
         }
     });
+
+	CommitZoneData(VdBatch, MdBatch, ObjBatch);
+
+	// unload voxel data only after it is in file. changed again meanwhile - keep it for next save
+	std::vector<TVoxelIndex> VdList;
+	TerrainData->ForEachVdSafe([&](TVoxelIndex Index, TVoxelDataInfo* VdInfo) {
+		VdList.push_back(Index);
+	});
+
+	for (auto& Index : VdList) {
+		TVoxelDataInfo* VdInfo = GetVoxelDataInfo(Index);
+		VdInfo->LoadVdMutexPtr->lock();
+		if (!VdInfo->IsChanged()) {
+			VdInfo->Unload();
+		}
+		VdInfo->LoadVdMutexPtr->unlock();
+	}
     
 	SaveJson();
 
@@ -488,6 +582,103 @@ void ASandboxTerrainController::SaveMapAsync() {
 	});
 }
 
+void ASandboxTerrainController::CompactMapFilesAsync() {
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Start compact terrain files async"));
+	RunThread([&]() {
+		ForEachStorageFile([&](TKvFile& KvFile, const TCHAR* Name) {
+			CompactKvFile(KvFile, Name);
+		});
+	});
+}
+
+FString ASandboxTerrainController::DumpStorageStats() {
+	FString JsonStr = TEXT("{\"map\":\"") + MapName + TEXT("\",\"files\":{");
+	bool bFirst = true;
+
+	ForEachStorageFile([&](TKvFile& KvFile, const TCHAR* Name) {
+		const kvdb::TFileStats Stats = KvFile.stats();
+		UE_LOG(LogSandboxTerrain, Log, TEXT("Storage %s file: %d keys, live %f MB, dead %f MB, %d tables, %d reserved keys, read p99 %d us, write p99 %d us"), Name, (int32)Stats.keyCount,
+			(double)Stats.space.liveBytes / (1024 * 1024), (double)Stats.space.wastedBytes() / (1024 * 1024), (int32)Stats.tableCount, (int32)Stats.reservedKeyCount,
+			(int32)(Stats.readLatency.percentile(0.99) / 1000), (int32)(Stats.writeLatency.percentile(0.99) / 1000));
+
+		JsonStr += (bFirst ? TEXT("\"") : TEXT(",\"")) + FString(Name) + TEXT("\":") + FString(UTF8_TO_TCHAR(Stats.toJson().c_str()));
+		bFirst = false;
+	});
+
+	const kvdb::TCacheStats CacheStats = MeshDataCache.stats();
+	JsonStr += FString::Printf(TEXT("},\"meshCache\":{\"hits\":%llu,\"misses\":%llu,\"entries\":%llu,\"bytes\":%llu}"), 
+		(uint64)CacheStats.hits, (uint64)CacheStats.misses, (uint64)CacheStats.entries, (uint64)CacheStats.bytes);
+
+	// resident voxel data. dense zone would take num^3 bytes of density and twice as much of material
+	std::vector<TVoxelIndex> VdList;
+	TerrainData->ForEachVdSafe([&](TVoxelIndex Index, TVoxelDataInfo* VdInfo) {
+		if (VdInfo->Vd != nullptr) {
+			VdList.push_back(Index);
+		}
+	});
+
+	uint64 VdBytes = 0;
+	int32 VdCount = 0;
+	int32 MixedVdCount = 0;
+	for (const TVoxelIndex& Index : VdList) {
+		TVoxelDataInfo* VdInfo = GetVoxelDataInfo(Index);
+		VdInfo->LoadVdMutexPtr->lock();
+		if (VdInfo->Vd != nullptr) {
+			VdBytes += VdInfo->Vd->memoryUsage();
+			VdCount++;
+			if (VdInfo->Vd->getDensityFillState() == TVoxelDataFillState::MIXED) {
+				MixedVdCount++;
+			}
+		}
+		VdInfo->LoadVdMutexPtr->unlock();
+	}
+
+	const TVoxelBufferPoolStats PoolStats = TVoxelBufferPool::instance().stats();
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Voxel data: %d zones (%d mixed), resident %f MB, buffer pool hit rate %f (%llu/%llu), pooled %f MB"), VdCount, MixedVdCount, (double)VdBytes / (1024 * 1024),
+		PoolStats.hitRate(), (uint64)PoolStats.hits, (uint64)(PoolStats.hits + PoolStats.misses), (double)PoolStats.pooledBytes / (1024 * 1024));
+	JsonStr += FString::Printf(TEXT(",\"voxelData\":{\"zones\":%d,\"mixedZones\":%d,\"residentBytes\":%llu,\"poolHits\":%llu,\"poolMisses\":%llu,\"poolDropped\":%llu,\"pooledBytes\":%llu}"), 
+		VdCount, MixedVdCount, VdBytes, (uint64)PoolStats.hits, (uint64)PoolStats.misses, (uint64)PoolStats.dropped, (uint64)PoolStats.pooledBytes);
+
+	// mesher reads density through bricks, compare with maps saved before
+	const kvdb::THistogram MeshTime = MeshGenerationTime.snapshot();
+	const kvdb::THistogram CacheTime = SubstanceCacheTime.snapshot();
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Mesh generation: %llu zones, mean %f ms, p99 %f ms. Substance cache: %llu zones, mean %f ms, p99 %f ms"), 
+		(uint64)MeshTime.count, MeshTime.mean() / 1000, (double)MeshTime.percentile(0.99) / 1000, (uint64)CacheTime.count, CacheTime.mean() / 1000, (double)CacheTime.percentile(0.99) / 1000);
+	JsonStr += FString::Printf(TEXT(",\"meshGeneration\":{\"count\":%llu,\"sumUs\":%llu,\"p50Us\":%llu,\"p99Us\":%llu},\"substanceCache\":{\"count\":%llu,\"sumUs\":%llu,\"p50Us\":%llu,\"p99Us\":%llu}}"),
+		(uint64)MeshTime.count, (uint64)MeshTime.sum, (uint64)MeshTime.percentile(0.5), (uint64)MeshTime.percentile(0.99),
+		(uint64)CacheTime.count, (uint64)CacheTime.sum, (uint64)CacheTime.percentile(0.5), (uint64)CacheTime.percentile(0.99));
+
+	const FString FullPath = FPaths::ProjectSavedDir() + TEXT("/Map/") + MapName + TEXT("/storage_stats.json");
+	FFileHelper::SaveStringToFile(JsonStr, *FullPath);
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Storage stats saved: %s"), *FullPath);
+
+	return JsonStr;
+}
+
+static FAutoConsoleCommandWithWorld DumpTerrainStorageStatsCommand(
+	TEXT("sandbox.DumpTerrainStorageStats"),
+	TEXT("Log terrain storage statistics and write them to Saved/Map/<MapName>/storage_stats.json"),
+	FConsoleCommandWithWorldDelegate::CreateLambda([](UWorld* World) {
+		for (TActorIterator<ASandboxTerrainController> It(World); It; ++It) {
+			It->DumpStorageStats();
+		}
+	})
+);
+
+void ASandboxTerrainController::CompactKvFile(TKvFile& KvFile, const TCHAR* Name) {
+	kvdb::TCompactionBudget Budget;
+	Budget.bytesPerSecond = (ulong64)FMath::Max(CompactionBudgetMbPerSecond, 0) * 1024 * 1024;
+	Budget.isCancelled = [&]() { return IsWorkFinished(); };
+
+	const kvdb::TCompactionResult Res = KvFile.compact(Budget);
+	if (Res.bSuccess) {
+		UE_LOG(LogSandboxTerrain, Log, TEXT("Compact %s file: %d keys (%d copied again), %f MB -> %f MB -> %f ms"), Name, (int32)Res.keyCount, (int32)Res.recopiedKeyCount,
+			(double)Res.oldFileSize / (1024 * 1024), (double)Res.newFileSize / (1024 * 1024), Res.timeMs);
+	} else {
+		UE_LOG(LogSandboxTerrain, Warning, TEXT("Compact %s file: skipped or cancelled"), Name);
+	}
+}
+
 void ASandboxTerrainController::AutoSaveByTimer() {
     UE_LOG(LogSandboxTerrain, Log, TEXT("Start auto save..."));
     FastSave();
@@ -512,7 +703,8 @@ void ASandboxTerrainController::SaveJson() {
 // kv file
 //======================================================================================================================================================================
 
-bool OpenKvFile(kvdb::KvFile<TVoxelIndex, TValueData>& KvFile, const FString& FileName, const FString& SaveDir) {
+bool OpenKvFile(kvdb::KvFile<TVoxelIndex, TValueData>& KvFile, const FString& FileName, const FString& SaveDir, int32 ValueCacheSizeMb = 0) {
+	double Start = FPlatformTime::Seconds();
 	FString FullPath = SaveDir + FileName;
 	std::string FilePathString = std::string(TCHAR_TO_UTF8(*FullPath));
 
@@ -525,6 +717,22 @@ bool OpenKvFile(kvdb::KvFile<TVoxelIndex, TValueData>& KvFile, const FString& Fi
 		return false;
 	}
 
+	// solid underground and empty sky zones serialize to the same few values
+	KvFile.setDeduplication(true);
+
+	// zero-copy loading through TValueView
+	if (!KvFile.setMemoryMapped(true)) {
+		UE_LOG(LogSandboxTerrain, Log, TEXT("Memory mapping is not supported, fallback to buffered reading: %s"), *FullPath);
+		KvFile.setValueCacheCapacity((ulong64)FMath::Max(ValueCacheSizeMb, 0) * 1024 * 1024);
+	}
+
+	double Time = (FPlatformTime::Seconds() - Start) * 1000;
+
+	const kvdb::TSpaceUsage Usage = KvFile.spaceUsage();
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Open file %s: %d keys, %f MB, wasted %f MB (free slots %d), shared %d keys / %f MB, inline %d keys, index %s -> %f ms"), *FileName, KvFile.size(), (double)Usage.fileSize / (1024 * 1024),
+		(double)Usage.wastedBytes() / (1024 * 1024), (int32)Usage.freeSlotCount, (int32)Usage.sharedKeyCount, (double)Usage.sharedBytes / (1024 * 1024), (int32)Usage.inlineKeyCount,
+		KvFile.isIndexFromSnapshot() ? TEXT("snapshot") : TEXT("table walk"), Time);
+
 	return true;
 }
 
@@ -558,25 +766,44 @@ bool ASandboxTerrainController::OpenFile() {
         return false;
     }
 
-	if (!OpenKvFile(VdFile, FileNameVd, SaveDir)) {
-		return false;
-	}
+	if (bSingleFileStorage) {
+		if (!OpenKvFile(TerrainFile.file(), TEXT("terrain.dat"), SaveDir, ValueCacheSizeMb)) {
+			return false;
+		}
+	} else {
+		if (!OpenKvFile(VdFile, FileNameVd, SaveDir, ValueCacheSizeMb)) {
+			return false;
+		}
 
-	if (!OpenKvFile(MdFile, FileNameMd, SaveDir)) {
-		return false;
-	}
+		if (!OpenKvFile(MdFile, FileNameMd, SaveDir)) {
+			return false;
+		}
 
-	if (!OpenKvFile(ObjFile, FileNameObj, SaveDir)) {
-		return false;
+		if (!OpenKvFile(ObjFile, FileNameObj, SaveDir)) {
+			return false;
+		}
 	}
 
+	MeshDataCache.setCapacity((ulong64)FMath::Max(MeshCacheSizeMb, 0) * 1024 * 1024);
+	TVoxelBufferPool::instance().setCapacity((size_t)FMath::Max(VoxelBufferPoolSizeMb, 0) * 1024 * 1024);
+
+	ForEachStorageFile([&](TKvFile& KvFile, const TCHAR* Name) {
+		KvFile.setWriteBehind(bWriteBehindSave);
+	});
+
 	return true;
 }
 
 void ASandboxTerrainController::CloseFile() {
-	VdFile.close();
-	MdFile.close();
-	ObjFile.close();
+	const kvdb::TCacheStats Stats = MeshDataCache.stats();
+	UE_LOG(LogSandboxTerrain, Log, TEXT("Mesh data cache: %d hits, %d misses (%f), %d evictions, %f MB"), (int32)Stats.hits, (int32)Stats.misses, Stats.hitRate(), 
+		(int32)Stats.evictions, (double)Stats.bytes / (1024 * 1024));
+	MeshDataCache.clear();
+
+	// close waits for write-behind queue
+	ForEachStorageFile([&](TKvFile& KvFile, const TCHAR* Name) {
+		KvFile.close();
+	});
 }
 
 
@@ -644,9 +871,10 @@ TVoxelData* ASandboxTerrainController::NewVoxelData() {
 	return new TVoxelData(USBT_ZONE_DIMENSION, USBT_ZONE_SIZE);
 }
 
-int ASandboxTerrainController::GeneratePipeline(const TVoxelIndex& Index) {
-	TVoxelDataInfo* VdInfo = new TVoxelDataInfo();
-	if (!VdFile.isExist(Index)) {
+int ASandboxTerrainController::GeneratePipeline(const TVoxelIndex& Index, const TZonePrefetchData* Prefetch) {
+	const bool bVdExist = (Prefetch) ? Prefetch->bVdExist : IsVdExist(Index);
+	if (!bVdExist) {
+		TVoxelDataInfo* VdInfo = new TVoxelDataInfo();
 		FVector Pos = GetZonePos(Index);
 
 		// generate new voxel data
@@ -674,7 +902,7 @@ int ASandboxTerrainController::GeneratePipeline(const TVoxelIndex& Index) {
 
 
 // load or generate new zone voxel data and mesh
-int ASandboxTerrainController::SpawnZonePipeline(const TVoxelIndex& Index, const TTerrainLodMask TerrainLodMask) {
+int ASandboxTerrainController::SpawnZonePipeline(const TVoxelIndex& Index, const TTerrainLodMask TerrainLodMask, const TZonePrefetchData* Prefetch) {
 	//UE_LOG(LogTemp, Log, TEXT("SpawnZone -> %d %d %d "), Index.X, Index.Y, Index.Z);
 	FVector Pos = GetZonePos(Index);
 
@@ -695,7 +923,8 @@ int ASandboxTerrainController::SpawnZonePipeline(const TVoxelIndex& Index, const
 	if (!bMemoryHasVoxelData) {
         TVoxelDataInfo* VdInfo = new TVoxelDataInfo();
 		// if voxel data exist in file
-		if (VdFile.isExist(Index)) {
+		const bool bVdExist = (Prefetch) ? Prefetch->bVdExist : IsVdExist(Index);
+		if (bVdExist) {
 			VdInfo->DataState = TVoxelDataState::READY_TO_LOAD;
             TerrainData->RegisterVoxelData(VdInfo, Index);
 		} else {
@@ -715,7 +944,14 @@ int ASandboxTerrainController::SpawnZonePipeline(const TVoxelIndex& Index, const
 	TVoxelDataInfo* VoxelDataInfo = GetVoxelDataInfo(Index);
 
 	// if mesh data exist in file - load, apply and return
-	TMeshDataPtr MeshDataPtr = LoadMeshDataByIndex(Index);
+	TMeshDataPtr MeshDataPtr = nullptr;
+	if (Prefetch && Prefetch->bMdPrefetched) {
+		if (Prefetch->MdView) {
+			MeshDataPtr = UnpackMeshData(Index, Prefetch->MdView);
+		}
+	} else {
+		MeshDataPtr = LoadMeshDataByIndex(Index);
+	}
 	if (MeshDataPtr) {
         if(bMeshExist){
             // just change lod mask
@@ -1081,6 +1317,7 @@ void ASandboxTerrainController::PerformZoneEditHandler(TVoxelDataInfo* VdInfo, H
 	VdInfo->Vd->vd_edit_mutex.lock();
 	bIsChanged = handler(VdInfo->Vd);
 	if (bIsChanged) {
+		VdInfo->Vd->optimize();
 		VdInfo->SetChanged();
 		VdInfo->Vd->setCacheToValid();
 		MeshDataPtr = GenerateMesh(VdInfo->Vd);
@@ -1244,8 +1481,10 @@ TVoxelData* ASandboxTerrainController::LoadVoxelDataByIndex(const TVoxelIndex& I
 	TVoxelData* Vd = NewVoxelData();
 	Vd->setOrigin(GetZonePos(Index));
 
-	bool bIsLoaded = LoadDataFromKvFile(VdFile, Index, [=](TValueDataPtr DataPtr) {
-		deserializeVoxelData(Vd, *DataPtr);
+	bool bIsLoaded = LoadZoneDataView(TDC_VoxelData, Index, [=](const kvdb::TValueView& View) {
+		if (!deserializeVoxelData(Vd, View.data())) {
+			UE_LOG(LogSandboxTerrain, Warning, TEXT("Bad voxel data: %d %d %d"), Index.X, Index.Y, Index.Z);
+		}
 	});
 
 	double End = FPlatformTime::Seconds();
@@ -1260,6 +1499,7 @@ TVoxelData* ASandboxTerrainController::LoadVoxelDataByIndex(const TVoxelIndex& I
 
 		double End2 = FPlatformTime::Seconds();
 		double Time2 = (End2 - Start2) * 1000;
+		SubstanceCacheTime.add((uint64)(Time2 * 1000));
 		UE_LOG(LogTemp, Log, TEXT("makeSubstanceCache() -> %d %d %d -> %f ms"), Index.X, Index.Y, Index.Z, Time2);
 	}
 
@@ -1467,6 +1707,7 @@ std::shared_ptr<TMeshData> ASandboxTerrainController::GenerateMesh(TVoxelData* V
 
 	double End = FPlatformTime::Seconds();
 	double Time = (End - Start) * 1000;
+	MeshGenerationTime.add((uint64)(Time * 1000));
 
 	//UE_LOG(LogTemp, Warning, TEXT("generateMesh -------------> %f %f %f --> %f ms"), Vd->getOrigin().X, Vd->getOrigin().Y, Vd->getOrigin().Z, Time);
 	return MeshDataPtr;
@@ -1601,9 +1842,9 @@ void DeserializeMeshContainerFast(TMeshContainer& MeshContainer, FastUnsafeDeser
 	}
 }
 
-TMeshDataPtr DeserializeMeshDataFast(const std::vector<uint8>& Data, uint32 CollisionMeshSectionLodIndex) {
+TMeshDataPtr DeserializeMeshDataFast(const uint8* Data, uint32 CollisionMeshSectionLodIndex) {
 	TMeshDataPtr MeshDataPtr(new TMeshData);
-	FastUnsafeDeserializer Deserializer(Data.data());
+	FastUnsafeDeserializer Deserializer(Data);
 
 	int32 LodArraySize;
 	Deserializer.readObj(LodArraySize);
@@ -1627,13 +1868,75 @@ TMeshDataPtr DeserializeMeshDataFast(const std::vector<uint8>& Data, uint32 Coll
 	return MeshDataPtr;
 }
 
-bool LoadDataFromKvFile(TKvFile& KvFile, const TVoxelIndex& Index, std::function<void(TValueDataPtr)> Function) {
-	TValueDataPtr DataPtr = KvFile.loadData(Index);
-	if (DataPtr == nullptr || DataPtr->size() == 0) { return false;	}
-	Function(DataPtr);
+TMeshDataPtr DeserializeMeshDataFast(const std::vector<uint8>& Data, uint32 CollisionMeshSectionLodIndex) {
+	return DeserializeMeshDataFast(Data.data(), CollisionMeshSectionLodIndex);
+}
+
+bool LoadViewFromKvFile(TKvFile& KvFile, const TVoxelIndex& Index, std::function<void(const kvdb::TValueView&)> Function) {
+	kvdb::TValueView View = KvFile.loadView(Index);
+	if (!View || View.size() == 0) { return false; }
+	Function(View);
 	return true;
 }
 
+bool ASandboxTerrainController::LoadZoneDataView(ETerrainDataColumn Column, const TVoxelIndex& Index, std::function<void(const kvdb::TValueView&)> Function) {
+	if (bSingleFileStorage) {
+		const kvdb::TValueView View = TerrainFile.load(Index).column(Column);
+		if (!View) { return false; }
+		Function(View);
+		return true;
+	}
+
+	switch (Column) {
+	case TDC_VoxelData:
+		return LoadViewFromKvFile(VdFile, Index, Function);
+	case TDC_MeshData:
+		return LoadViewFromKvFile(MdFile, Index, Function);
+	default:
+		return LoadViewFromKvFile(ObjFile, Index, Function);
+	}
+}
+
+bool ASandboxTerrainController::IsVdExist(const TVoxelIndex& Index) {
+	return (bSingleFileStorage) ? TerrainFile.isExist(Index, TDC_VoxelData) : VdFile.isExist(Index);
+}
+
+// decompress data written by FArchiveSaveCompressedProxy straight from view memory.
+// returns pointer to decompressed payload inside Buffer or nullptr
+const uint8* DecompressView(const kvdb::TValueView& View, TValueData& Buffer) {
+	FBufferReader Reader((void*)View.data(), View.size(), false);
+
+	// compressed proxy writes one compressed block per chunk of serialized TArray<uint8>
+	int64 Offset = 0;
+	int64 Total = -1;
+	while (!Reader.AtEnd() && (Total < 0 || Offset < Total)) {
+		if ((int64)Buffer.size() < Offset + LOADING_COMPRESSION_CHUNK_SIZE) {
+			Buffer.resize(Offset + LOADING_COMPRESSION_CHUNK_SIZE);
+		}
+
+		Reader.SerializeCompressed(Buffer.data() + Offset, LOADING_COMPRESSION_CHUNK_SIZE, NAME_Zlib);
+		if (Reader.IsError()) {
+			return nullptr;
+		}
+
+		if (Total < 0) {
+			// array size is the first serialized value
+			int32 Num;
+			FMemory::Memcpy(&Num, Buffer.data(), sizeof(int32));
+			Total = sizeof(int32) + Num;
+			Buffer.resize(((Total + LOADING_COMPRESSION_CHUNK_SIZE - 1) / LOADING_COMPRESSION_CHUNK_SIZE) * LOADING_COMPRESSION_CHUNK_SIZE);
+		}
+
+		Offset += LOADING_COMPRESSION_CHUNK_SIZE;
+	}
+
+	if (Total < 0 || Offset < Total) {
+		return nullptr;
+	}
+
+	return Buffer.data() + sizeof(int32);
+}
+
 TValueDataPtr Decompress(TValueDataPtr CompressedDataPtr) {
 	TValueDataPtr Result = std::make_shared<TValueData>();
 	TArray<uint8> BinaryArray;
@@ -1661,13 +1964,28 @@ TValueDataPtr Decompress(TValueDataPtr CompressedDataPtr) {
 }
 
 
+TMeshDataPtr ASandboxTerrainController::UnpackMeshData(const TVoxelIndex& Index, const kvdb::TValueView& View) {
+	TValueData Buffer;
+	const uint8* Data = DecompressView(View, Buffer);
+	if (Data) {
+		TMeshDataPtr MeshDataPtr = DeserializeMeshDataFast(Data, GetCollisionMeshSectionLodIndex());
+		MeshDataCache.put(Index, MeshDataPtr, Buffer.size()); // decompressed size as estimate
+		return MeshDataPtr;
+	}
+
+	return nullptr;
+}
+
 TMeshDataPtr ASandboxTerrainController::LoadMeshDataByIndex(const TVoxelIndex& Index) {
+	TMeshDataPtr MeshDataPtr = MeshDataCache.get(Index);
+	if (MeshDataPtr) {
+		return MeshDataPtr;
+	}
+
 	double Start = FPlatformTime::Seconds();
-	TMeshDataPtr MeshDataPtr = nullptr;
 
-	bool bIsLoaded = LoadDataFromKvFile(MdFile, Index, [&](TValueDataPtr DataPtr) {
-		auto DecompressedDataPtr = Decompress(DataPtr);
-		MeshDataPtr = DeserializeMeshDataFast(*DecompressedDataPtr, GetCollisionMeshSectionLodIndex());
+	bool bIsLoaded = LoadZoneDataView(TDC_MeshData, Index, [&](const kvdb::TValueView& View) {
+		MeshDataPtr = UnpackMeshData(Index, View);
 	});
 
 	double End = FPlatformTime::Seconds();
@@ -1684,8 +2002,9 @@ void ASandboxTerrainController::LoadObjectDataByIndex(UTerrainZoneComponent* Zon
 	double Start = FPlatformTime::Seconds();
 	TVoxelIndex Index = GetZoneIndex(Zone->GetComponentLocation());
 
-	bool bIsLoaded = LoadDataFromKvFile(ObjFile, Index, [&](TValueDataPtr DataPtr) {
-		Zone->DeserializeInstancedMeshes(*DataPtr, ZoneInstMeshMap);
+	bool bIsLoaded = LoadZoneDataView(TDC_ObjectData, Index, [&](const kvdb::TValueView& View) {
+		TValueData Data(View.data(), View.data() + View.size());
+		Zone->DeserializeInstancedMeshes(Data, ZoneInstMeshMap);
 	});
 
 	double End = FPlatformTime::Seconds();
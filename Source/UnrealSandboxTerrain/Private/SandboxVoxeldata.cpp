@@ -715,7 +715,8 @@ typedef std::shared_ptr<VoxelMeshExtractor> VoxelMeshExtractorPtr;
 TMeshDataPtr polygonizeCellSubstanceCacheNoLOD(const TVoxelData &vd, const TVoxelDataParam &vdp) {
 	TMeshData* mesh_data = new TMeshData();
 	VoxelMeshExtractorPtr mesh_extractor_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[0], vd, vdp));
-	for (const auto& itm : vd.substanceCacheLOD[0].cellList) { mesh_extractor_ptr->generateCell(itm); }
+	const TSubstanceCache& lodCache = vd.substanceCacheLOD[0];
+	for (size_t i = 0; i < lodCache.size(); i++) { mesh_extractor_ptr->generateCell(lodCache.item(i, vd.num())); }
 	mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[0].WholeMesh;
 	return TMeshDataPtr(mesh_data);
 }
@@ -731,12 +732,13 @@ TMeshDataPtr polygonizeCellSubstanceCacheLOD(const TVoxelData &vd, const TVoxelD
 		me_vdp.lod = lod;
 		VoxelMeshExtractorPtr mesh_extractor_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[lod], vd, me_vdp));
 		int step = me_vdp.step();
-		for (const auto& itm : vd.substanceCacheLOD[lod].cellList) { 
+		const TSubstanceCache& lodCache = vd.substanceCacheLOD[lod];
+		for (size_t i = 0; i < lodCache.size(); i++) { 
 
 #if USBT_USE_VD_PREBUILD_DATA == 1
-			mesh_extractor_ptr->generateCell(itm);
+			mesh_extractor_ptr->generateCell(lodCache.item(i, vd.num()));
 #else
-			const int index = itm.index;
+			const int index = lodCache.indexList[i];
 			const int x = index / (vd.num() * vd.num());
 			const int y = (index / vd.num()) % vd.num();
 			const int z = index % vd.num();
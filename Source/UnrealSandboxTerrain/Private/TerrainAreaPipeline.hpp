@@ -2,6 +2,8 @@
 
 #include "EngineMinimal.h"
 #include "VoxelIndex.h"
+#include <vector>
+#include <unordered_map>
 
 //======================================================================================================================================================================
 //
@@ -61,6 +63,11 @@ protected:
 		return TZoneSpawnResult::None;
 	}
 
+	// bulk lookup of whole zone column before performing zones one by one
+	virtual void PrefetchChunk(const std::vector<TVoxelIndex>& ChunkIndexList) {
+
+	}
+
 	void EndChunk(int x, int y) {
 		//Controller->TerrainGeneratorComponent->Clean();
 		//Controller->TerrainGenerator->Clean(Index);
@@ -69,8 +76,15 @@ protected:
 private:
 
 	void PerformChunk(int x, int y) {
+		std::vector<TVoxelIndex> ChunkIndexList;
+		ChunkIndexList.reserve(Params.TerrainSizeMinZ + Params.TerrainSizeMaxZ + 1);
 		for (int z = -Params.TerrainSizeMinZ; z <= Params.TerrainSizeMaxZ; z++) {
-			TVoxelIndex Index(x + OriginIndex.X, y + OriginIndex.Y, z);
+			ChunkIndexList.push_back(TVoxelIndex(x + OriginIndex.X, y + OriginIndex.Y, z));
+		}
+
+		PrefetchChunk(ChunkIndexList);
+
+		for (const TVoxelIndex& Index : ChunkIndexList) {
 			TZoneSpawnResult Res = (TZoneSpawnResult)PerformZone(Index);
 			Progress++;
 
@@ -143,8 +157,63 @@ public:
 
 	using TTerrainAreaPipeline::TTerrainAreaPipeline;
 
+private:
+
+	std::unordered_map<TVoxelIndex, TZonePrefetchData> ChunkPrefetchMap;
+
 protected :
 
+	virtual void PrefetchChunk(const std::vector<TVoxelIndex>& ChunkIndexList) override {
+		ChunkPrefetchMap.clear();
+		if (ChunkIndexList.empty()) return;
+
+		// mesh data only for zones which are not spawned yet and not in decoded mesh cache
+		for (const TVoxelIndex& Index : ChunkIndexList) {
+			ChunkPrefetchMap[Index].bMdPrefetched = (Controller->GetZoneByVectorIndex(Index) == nullptr) && !Controller->MeshDataCache.contains(Index);
+		}
+
+		if (Controller->bSingleFileStorage) {
+			// whole chunk as of one moment, keys and records. saves running meanwhile never write over the records
+			TKvContainer::Snapshot Snapshot = Controller->TerrainFile.snapshot();
+
+			// one record per zone serves both voxel and mesh data
+			std::vector<TVoxelIndex> IndexList;
+			Controller->TerrainFile.forEachInBox(Snapshot, ChunkIndexList.front(), ChunkIndexList.back(), [&](const TVoxelIndex& Index) {
+				IndexList.push_back(Index);
+			});
+
+			std::vector<kvdb::TColumnRecord> RecordList = Controller->TerrainFile.loadMany(Snapshot, IndexList);
+			for (size_t I = 0; I < IndexList.size(); I++) {
+				TZonePrefetchData& Prefetch = ChunkPrefetchMap[IndexList[I]];
+				Prefetch.bVdExist = RecordList[I].hasColumn(TDC_VoxelData);
+				if (Prefetch.bMdPrefetched) {
+					Prefetch.MdView = RecordList[I].column(TDC_MeshData);
+				}
+			}
+
+			return;
+		}
+
+		// only zones stored in files
+		Controller->VdFile.forEachInBox(ChunkIndexList.front(), ChunkIndexList.back(), [&](const TVoxelIndex& Index) {
+			ChunkPrefetchMap[Index].bVdExist = true;
+		});
+
+		TKvFile::Snapshot MdSnapshot = Controller->MdFile.snapshot();
+
+		std::vector<TVoxelIndex> MdIndexList;
+		MdSnapshot.forEachInBox(ChunkIndexList.front(), ChunkIndexList.back(), [&](const TVoxelIndex& Index) {
+			if (ChunkPrefetchMap[Index].bMdPrefetched) {
+				MdIndexList.push_back(Index);
+			}
+		});
+
+		std::vector<kvdb::TValueView> MdViewList = MdSnapshot.loadViewMany(MdIndexList);
+		for (size_t I = 0; I < MdIndexList.size(); I++) {
+			ChunkPrefetchMap[MdIndexList[I]].MdView = MdViewList[I];
+		}
+	}
+
 	virtual int PerformZone(const TVoxelIndex& Index) override {
 		TTerrainLodMask TerrainLodMask = (TTerrainLodMask)ETerrainLodMaskPreset::All;
 		FVector ZonePos = Controller->GetZonePos(Index);
@@ -160,8 +229,11 @@ protected :
 			}
 		}
 
+		auto It = ChunkPrefetchMap.find(Index);
+		const TZonePrefetchData* Prefetch = (It != ChunkPrefetchMap.end()) ? &It->second : nullptr;
+
 		double Start = FPlatformTime::Seconds();
-		auto Res = Controller->SpawnZonePipeline(Index, TerrainLodMask);
+		auto Res = Controller->SpawnZonePipeline(Index, TerrainLodMask, Prefetch);
 		double End = FPlatformTime::Seconds();
 		double Time = (End - Start) * 1000;
 		return Res;
@@ -174,11 +246,38 @@ public:
 
 	using TTerrainAreaPipeline::TTerrainAreaPipeline;
 
+private:
+
+	std::unordered_map<TVoxelIndex, TZonePrefetchData> ChunkPrefetchMap;
+
 protected:
 
+	virtual void PrefetchChunk(const std::vector<TVoxelIndex>& ChunkIndexList) override {
+		ChunkPrefetchMap.clear();
+		if (ChunkIndexList.empty()) return;
+
+		// zones not found in file are known as absent
+		for (const TVoxelIndex& Index : ChunkIndexList) {
+			ChunkPrefetchMap[Index];
+		}
+
+		// only zones stored in file
+		if (Controller->bSingleFileStorage) {
+			Controller->TerrainFile.forEachInBox(ChunkIndexList.front(), ChunkIndexList.back(), [&](const TVoxelIndex& Index) {
+				ChunkPrefetchMap[Index].bVdExist = Controller->TerrainFile.isExist(Index, TDC_VoxelData);
+			});
+		} else {
+			Controller->VdFile.forEachInBox(ChunkIndexList.front(), ChunkIndexList.back(), [&](const TVoxelIndex& Index) {
+				ChunkPrefetchMap[Index].bVdExist = true;
+			});
+		}
+	}
+
 	virtual int PerformZone(const TVoxelIndex& Index) override {
 		//UE_LOG(LogTemp, Warning, TEXT("TTerrainGeneratorPipeline::PerformZone %d %d %d"), Index.X, Index.Y, Index.Z);
-		return Controller->GeneratePipeline(Index);
+		auto It = ChunkPrefetchMap.find(Index);
+		const TZonePrefetchData* Prefetch = (It != ChunkPrefetchMap.end()) ? &It->second : nullptr;
+		return Controller->GeneratePipeline(Index, Prefetch);
 	}
 };
 
@@ -204,6 +204,9 @@ private:
             }
         }
 
+        // bricks filled with solid rock or air while generating
+        VoxelData.optimize();
+
         int s = VoxelData.num() * VoxelData.num() * VoxelData.num();
 
         if (zc == s) {
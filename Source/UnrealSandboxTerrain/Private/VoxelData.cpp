@@ -2,66 +2,109 @@
 #include "UnrealSandboxTerrainPrivatePCH.h"
 #include "VoxelData.h"
 #include "serialization.hpp"
+#include "casecode.hpp"
+
+//====================================================================================
+// Voxel buffer pool
+//====================================================================================
+
+// never destroyed, voxel data may outlive static objects at exit
+TVoxelBufferPool& TVoxelBufferPool::instance() {
+	static TVoxelBufferPool* pool = new TVoxelBufferPool();
+	return *pool;
+}
+
+void* TVoxelBufferPool::allocate(size_t bytes) {
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		auto it = free_map.find(bytes);
+		if (it != free_map.end() && !it->second.empty()) {
+			void* ptr = it->second.back();
+			it->second.pop_back();
+			pool_stats.pooledBytes -= bytes;
+			pool_stats.hits++;
+			return ptr;
+		}
+
+		pool_stats.misses++;
+	}
+
+	return ::operator new(bytes);
+}
+
+void TVoxelBufferPool::free(void* ptr, size_t bytes) {
+	if (ptr == nullptr) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(pool_mutex);
+		if (pool_stats.pooledBytes + bytes <= capacity) {
+			free_map[bytes].push_back(ptr);
+			pool_stats.pooledBytes += bytes;
+			return;
+		}
+
+		pool_stats.dropped++;
+	}
+
+	::operator delete(ptr);
+}
+
+void TVoxelBufferPool::setCapacity(size_t bytes) {
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	capacity = bytes;
+	trim();
+}
+
+// expects lock
+void TVoxelBufferPool::trim() {
+	for (auto& it : free_map) {
+		while (pool_stats.pooledBytes > capacity && !it.second.empty()) {
+			::operator delete(it.second.back());
+			it.second.pop_back();
+			pool_stats.pooledBytes -= it.first;
+		}
+	}
+}
+
+TVoxelBufferPoolStats TVoxelBufferPool::stats() const {
+	std::unique_lock<std::mutex> lock(pool_mutex);
+	return pool_stats;
+}
 
 //====================================================================================
 // Voxel data impl
 //====================================================================================
 
 TVoxelData::TVoxelData() {
-	density_data = nullptr;
 	density_state = TVoxelDataFillState::ZERO;
-	material_data = nullptr;
 
 	voxel_num = 0;
 	volume_size = 0;
 }
 
 TVoxelData::TVoxelData(int num, float size) {
-	density_data = nullptr;
 	density_state = TVoxelDataFillState::ZERO;
-	material_data = nullptr;
 
 	voxel_num = num;
 	volume_size = size;
 }
 
 TVoxelData::~TVoxelData() {
-	if (density_data != nullptr) delete[] density_data;
-	if (material_data != nullptr) delete[] material_data;
 }
 
+// all bricks start uniform, only bricks touched by different value get storage
 FORCEINLINE void TVoxelData::initializeDensity() {
-	const int s = voxel_num * voxel_num * voxel_num;
-	density_data = new TDensityVal[s];
-	for (auto x = 0; x < voxel_num; x++) {
-		for (auto y = 0; y < voxel_num; y++) {
-			for (auto z = 0; z < voxel_num; z++) {
-				if (density_state == TVoxelDataFillState::FULL) {
-					setDensity(x, y, z, 1);
-				}
-
-				if (density_state == TVoxelDataFillState::ZERO) {
-					setDensity(x, y, z, 0);
-				}
-			}
-		}
-	}
+	density_data.initialize(voxel_num, (density_state == TVoxelDataFillState::FULL) ? 255 : 0);
 }
 
 FORCEINLINE void TVoxelData::initializeMaterial() {
-	const int s = voxel_num * voxel_num * voxel_num;
-	material_data = new unsigned short[s];
-	for (auto x = 0; x < voxel_num; x++) {
-		for (auto y = 0; y < voxel_num; y++) {
-			for (auto z = 0; z < voxel_num; z++) {
-				setMaterial(x, y, z, base_fill_mat);
-			}
-		}
-	}
+	material_data.initialize(voxel_num, base_fill_mat);
 }
 
 FORCEINLINE void TVoxelData::setDensity(int x, int y, int z, float density) {
-	if (density_data == NULL) {
+	if (!density_data.isInitialized()) {
 		if (density_state == TVoxelDataFillState::ZERO && density == 0) {
 			return;
 		}
@@ -75,19 +118,17 @@ FORCEINLINE void TVoxelData::setDensity(int x, int y, int z, float density) {
 	}
 
 	if (x < voxel_num && y < voxel_num && z < voxel_num) {
-		const int index = clcLinearIndex(x, y, z);
-
 		if (density < 0) density = 0;
 		if (density > 1) density = 1;
 
 		TDensityVal d = 255 * density;
 
-		density_data[index] = d;
+		density_data.set(x, y, z, d);
 	}
 }
 
 FORCEINLINE float TVoxelData::getDensity(int x, int y, int z) const {
-	if (density_data == NULL) {
+	if (!density_data.isInitialized()) {
 		if (density_state == TVoxelDataFillState::FULL) {
 			return 1;
 		}
@@ -96,9 +137,7 @@ FORCEINLINE float TVoxelData::getDensity(int x, int y, int z) const {
 	}
 
 	if (x < voxel_num && y < voxel_num && z < voxel_num) {
-		const int index = clcLinearIndex(x, y, z);
-
-		float d = (float)density_data[index] / 255.0f;
+		float d = (float)density_data.get(x, y, z) / 255.0f;
 		return d;
 	}
 	else {
@@ -107,34 +146,34 @@ FORCEINLINE float TVoxelData::getDensity(int x, int y, int z) const {
 }
 
 FORCEINLINE TDensityVal TVoxelData::getRawDensityUnsafe(int x, int y, int z) const {
-	const int index = clcLinearIndex(x, y, z);
-	return density_data[index];
+	return density_data.get(x, y, z);
 }
 
 FORCEINLINE unsigned short TVoxelData::getRawMaterialUnsafe(int x, int y, int z) const {
-	const int index = clcLinearIndex(x, y, z);
-	return material_data[index];
+	return material_data.get(x, y, z);
 }
 
 FORCEINLINE void TVoxelData::setMaterial(const int x, const int y, const int z, const unsigned short material) {
-	if (material_data == NULL) {
+	if (!material_data.isInitialized()) {
+		if (material == base_fill_mat) {
+			return;
+		}
+
 		initializeMaterial();
 	}
 
 	if (x < voxel_num && y < voxel_num && z < voxel_num) {
-		const int index = clcLinearIndex(x, y, z);
-		material_data[index] = material;
+		material_data.set(x, y, z, material);
 	}
 }
 
 FORCEINLINE unsigned short TVoxelData::getMaterial(int x, int y, int z) const {
-	if (material_data == NULL) {
+	if (!material_data.isInitialized()) {
 		return base_fill_mat;
 	}
 
 	if (x < voxel_num && y < voxel_num && z < voxel_num) {
-		const int index = clcLinearIndex(x, y, z);
-		return material_data[index];
+		return material_data.get(x, y, z);
 	}
 	else {
 		return 0;
@@ -203,76 +242,67 @@ FORCEINLINE int TVoxelData::num() const {
 }
 
 FORCEINLINE void TVoxelData::getRawVoxelData(int x, int y, int z, TDensityVal& density, unsigned short& material) const {
-	const int index = clcLinearIndex(x, y, z);
-
-	if (density_data != NULL) {
-		density = density_data[index];
+	if (density_data.isInitialized()) {
+		density = density_data.get(x, y, z);
 	} else {
 		density = 0;
 	}
 
-	if (material_data != NULL) {
-		material = material_data[index];
+	if (material_data.isInitialized()) {
+		material = material_data.get(x, y, z);
 	} else {
 		material = base_fill_mat;
 	}
 }
 
 FORCEINLINE void TVoxelData::setVoxelPoint(int x, int y, int z, TDensityVal density, unsigned short material) {
-	if (density_data == NULL) {
-		initializeDensity();
-		density_state = TVoxelDataFillState::MIXED;
-	}
-
-	if (material_data == NULL) {
-		initializeMaterial();
-	}
-
-	const int index = clcLinearIndex(x, y, z);
-	material_data[index] = material;
-	density_data[index] = density;
+	setVoxelPointDensity(x, y, z, density);
+	setVoxelPointMaterial(x, y, z, material);
 }
 
 FORCEINLINE void TVoxelData::setVoxelPointDensity(int x, int y, int z, TDensityVal density) {
-	if (density_data == NULL) {
+	if (!density_data.isInitialized()) {
 		initializeDensity();
 		density_state = TVoxelDataFillState::MIXED;
 	}
 
-	const int index = clcLinearIndex(x, y, z);
-	density_data[index] = density;
+	density_data.set(x, y, z, density);
 }
 
 FORCEINLINE void TVoxelData::setVoxelPointMaterial(int x, int y, int z, unsigned short material) {
-	if (material_data == NULL) {
+	if (!material_data.isInitialized()) {
 		initializeMaterial();
 	}
 
-	const int index = clcLinearIndex(x, y, z);
-	material_data[index] = material;
+	material_data.set(x, y, z, material);
 }
 
-FORCEINLINE void TVoxelData::deinitializeDensity(TVoxelDataFillState State) {
+FORCEINLINE void TVoxelData::deinitializeDensity(TVoxelDataFillState State) {
 	if (State == TVoxelDataFillState::MIXED) {
 		return;
-	}
-
-	density_state = State;
-	if (density_data != NULL) {
-		delete density_data;
-	}
-
-	density_data = NULL;
-}
-
+	}
+
+	density_state = State;
+	density_data.clear();
+}
+
 FORCEINLINE void TVoxelData::deinitializeMaterial(unsigned short base_mat) {
 	base_fill_mat = base_mat;
+	material_data.clear();
+}
 
-	if (material_data != NULL) {
-		delete material_data;
-	}
-
-	material_data = NULL;
+void TVoxelData::optimize() {
+	density_data.optimize();
+	material_data.optimize();
+}
+
+size_t TVoxelData::memoryUsage() const {
+	size_t res = sizeof(TVoxelData) + density_data.memoryUsage() + material_data.memoryUsage() + normal_data.capacity() * sizeof(FVector);
+	for (const TSubstanceCache& lodCache : substanceCacheLOD) {
+		res += lodCache.memoryUsage();
+	}
+
+	return res;
 }
 
 FORCEINLINE TVoxelDataFillState TVoxelData::getDensityFillState()	const {
@@ -306,21 +336,14 @@ FORCEINLINE TVoxelDataFillState TVoxelData::getDensityFillState()	const {
 
 	if (caseCode == 0 || caseCode == 255) return false;
 
-	int index = clcLinearIndex(x - step, y - step, z - step);
 	TSubstanceCache& lodCache = substanceCacheLOD[lod];
-	TSubstanceCacheItem cacheItm;
-	cacheItm.caseCode = caseCode;
-	cacheItm.index = index;
-	cacheItm.x = x - step;
-	cacheItm.y = y - step;
-	cacheItm.z = z - step;
-	lodCache.cellList.push_back(cacheItm);
+	lodCache.add(clcLinearIndex(x - step, y - step, z - step), (uint8)caseCode);
 	return true;
 }
 
 
 FORCEINLINE void TVoxelData::performSubstanceCacheNoLOD(int x, int y, int z) {
-	if (density_data == NULL) {
+	if (!density_data.isInitialized()) {
 		return;
 	}
 
@@ -328,7 +351,7 @@ FORCEINLINE void TVoxelData::performSubstanceCacheNoLOD(int x, int y, int z) {
 }
 
 void TVoxelData::performSubstanceCacheLOD(int x, int y, int z) {
-	if (density_data == NULL) {
+	if (!density_data.isInitialized()) {
 		return;
 	}
 
@@ -369,7 +392,11 @@ void TVoxelData::forEachWithCache(std::function<void(int x, int y, int z)> func,
 }
 
 void TVoxelData::forEachCacheItem(std::function<void(const TSubstanceCacheItem& itm)> func) const {
-
+	for (const TSubstanceCache& lodCache : substanceCacheLOD) {
+		for (size_t i = 0; i < lodCache.size(); i++) {
+			func(lodCache.item(i, voxel_num));
+		}
+	}
 }
 
 FORCEINLINE int TVoxelData::clcLinearIndex(int x, int y, int z) const {
@@ -382,20 +409,52 @@ FORCEINLINE void TVoxelData::clcVoxelIndex(uint32 idx, uint32& x, uint32& y, uin
 	z = idx % voxel_num;
 };
 
+// same cells and order as performSubstanceCacheLOD for each voxel, but classified by rows
+// from occupancy plane (see casecode.hpp)
 void TVoxelData::makeSubstanceCache() {
-	/*
-	const int s = num() * num() * num();
-	for (int i = 0; i < s; i++) {
-		uint32 x, y, z;
-		clcVoxelIndex(i, x, y, z);
-		performSubstanceCacheLOD(x, y, z);
-	}
-	*/
-	
-	for (int x = 0u; x < num(); x++) {
-		for (int y = 0u; y < num(); y++) {
-			for (int z = 0u; z < num(); z++) {
-				performSubstanceCacheLOD(x, y, z);
+	if (!density_data.isInitialized()) {
+		return;
+	}
+
+	const int n = num();
+	const size_t s = (size_t)n * n * n;
+	TVoxelPooledBuffer<uint8> occ(s);
+	density_data.copyTo(occ.data());
+	casecode::occupancy(occ.data(), occ.data(), s);
+
+	const int lod_n = (n - 1) / 2 + 1;
+	TVoxelPooledBuffer<uint8> lod_occ((size_t)lod_n * lod_n * lod_n);
+	std::vector<int> cells(n);
+	std::vector<uint8> codes(n);
+
+	for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+		const int step = 1 << lod;
+		if (step >= n) {
+			break;
+		}
+
+		// samples by one axis at this LOD
+		const int m = (n - 1) / step + 1;
+		const uint8* plane = occ.data();
+		if (lod > 0) {
+			casecode::downsample(occ.data(), n, step, lod_occ.data());
+			plane = lod_occ.data();
+		}
+
+		TSubstanceCache& lodCache = substanceCacheLOD[lod];
+
+		for (int x = 1; x < m; x++) {
+			for (int y = 1; y < m; y++) {
+				const uint8* a = plane + ((x - 1) * m + y) * m;
+				const uint8* b = plane + ((x - 1) * m + y - 1) * m;
+				const uint8* c = plane + (x * m + y) * m;
+				const uint8* d = plane + (x * m + y - 1) * m;
+				const int count = casecode::classifyRow(a, b, c, d, m, cells.data(), codes.data());
+
+				const uint32 base = clcLinearIndex((x - 1) * step, (y - 1) * step, 0);
+				for (int i = 0; i < count; i++) {
+					lodCache.add(base + cells[i] * step, codes[i]);
+				}
 			}
 		}
 	}
@@ -404,27 +463,57 @@ void TVoxelData::makeSubstanceCache() {
 #define DATA_END_MARKER 0x000A2D77
 
 bool deserializeVoxelData(TVoxelData* vd, std::vector<uint8>& data) {
-	FastUnsafeDeserializer deserializer(data.data());
+	return deserializeVoxelData(vd, data.data());
+}
+
+bool deserializeVoxelData(TVoxelData* vd, const uint8* data) {
+	FastUnsafeDeserializer deserializer(data);
 
 	TVoxelDataHeader header;
 	deserializer >> header;
 
+	uint32 version = 0;
+	if (header.density_state & VOXEL_DATA_VERSION_FLAG) {
+		header.density_state = (uint8)(header.density_state & ~VOXEL_DATA_VERSION_FLAG);
+		deserializer.readObj(version);
+	}
+
+	// written by newer build
+	if (version > VOXEL_DATA_FORMAT_VERSION) {
+		return false;
+	}
+
+	if (header.voxel_num == 0 || header.density_state > TVoxelDataFillState::MIXED || header.material_state > TVoxelDataFillState::PACKED) {
+		return false;
+	}
+
 	vd->voxel_num = header.voxel_num;
 	vd->volume_size = header.volume_size;
 	vd->base_fill_mat = header.base_fill_mat;
 
 	const size_t s = header.voxel_num * header.voxel_num * header.voxel_num;
 	if (header.density_state == TVoxelDataFillState::MIXED) {
-		vd->density_data = new TDensityVal[s];
-		deserializer.read(vd->density_data, s);
+		TVoxelPooledBuffer<TDensityVal> linear(s);
+		deserializer.read(linear.data(), s);
+		vd->density_data.initialize(header.voxel_num, 0);
+		vd->density_data.assign(linear.data());
 		vd->density_state = TVoxelDataFillState::MIXED;
 	} else {
 		vd->deinitializeDensity(static_cast<TVoxelDataFillState>(header.density_state));
 	}
 
-	if (header.material_state == TVoxelDataFillState::MIXED) {
-		vd->material_data = new TMaterialId[s];
-		deserializer.read(vd->material_data, s);
+	if (header.material_state == TVoxelDataFillState::PACKED) {
+		vd->material_data.initialize(header.voxel_num, header.base_fill_mat);
+		if (!vd->material_data.read(deserializer)) {
+			vd->deinitializeMaterial(header.base_fill_mat);
+			return false;
+		}
+	} else if (header.material_state == TVoxelDataFillState::MIXED) {
+		// saved before material palette
+		TVoxelPooledBuffer<TMaterialId> linear(s);
+		deserializer.read(linear.data(), s);
+		vd->material_data.initialize(header.voxel_num, header.base_fill_mat);
+		vd->material_data.assign(linear.data());
 	} else {
 		vd->deinitializeMaterial(header.base_fill_mat);
 	}
@@ -437,22 +526,25 @@ bool deserializeVoxelData(TVoxelData* vd, std::vector<uint8>& data) {
 std::shared_ptr<std::vector<uint8>> TVoxelData::serialize() {
 	FastUnsafeSerializer serializer;
 	const size_t s = num() * num() * num();
-	const TVoxelDataFillState material_volume_state = (material_data) ? TVoxelDataFillState::MIXED : TVoxelDataFillState::ZERO;
+	const TVoxelDataFillState material_volume_state = (material_data.isInitialized()) ? TVoxelDataFillState::PACKED : TVoxelDataFillState::ZERO;
 
 	TVoxelDataHeader header;
 	header.voxel_num = num();
 	header.volume_size = size();
-	header.density_state = getDensityFillState();
+	header.density_state = (uint8)(getDensityFillState() | VOXEL_DATA_VERSION_FLAG);
 	header.material_state = material_volume_state;
 	header.base_fill_mat = base_fill_mat;
 	serializer << header;
+	serializer << (uint32)VOXEL_DATA_FORMAT_VERSION;
 
 	if (getDensityFillState() == TVoxelDataFillState::MIXED) {
-		serializer.write(density_data, s);
+		TVoxelPooledBuffer<TDensityVal> linear(s);
+		density_data.copyTo(linear.data());
+		serializer.write(linear.data(), s);
 	}
 
-	if (material_volume_state == TVoxelDataFillState::MIXED) {
-		serializer.write(material_data, s);
+	if (material_volume_state == TVoxelDataFillState::PACKED) {
+		material_data.write(serializer);
 	}
 
 	serializer << (uint32)DATA_END_MARKER;
@@ -29,6 +29,14 @@ class TTerrainGeneratorPipeline;
 typedef TMap<int32, TInstanceMeshArray> TInstanceMeshTypeMap;
 typedef std::shared_ptr<TMeshData> TMeshDataPtr;
 typedef kvdb::KvFile<TVoxelIndex, TValueData> TKvFile;
+typedef kvdb::KvContainer<TVoxelIndex> TKvContainer;
+
+// column families of single-file storage
+enum ETerrainDataColumn : uint32 {
+	TDC_VoxelData = 0,
+	TDC_MeshData = 1,
+	TDC_ObjectData = 2,
+};
 
 
 UENUM(BlueprintType)
@@ -224,6 +232,13 @@ struct FTerrainSwapAreaParams {
 };
 
 
+// zone data looked up in bulk by area pipeline
+typedef struct TZonePrefetchData {
+	bool bVdExist = false;
+	bool bMdPrefetched = false;
+	kvdb::TValueView MdView;
+} TZonePrefetchData;
+
 typedef struct TVoxelDensityFunctionData {
     float Density;
     float GroundLelel;
@@ -333,6 +348,40 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "UnrealSandbox")
 	void SaveMapAsync();
 
+	UFUNCTION(BlueprintCallable, Category = "UnrealSandbox")
+	void CompactMapFilesAsync();
+
+	// storage file layout, I/O counters and latency histograms as json.
+	// also written to Saved/Map/<MapName>/storage_stats.json. console: sandbox.DumpTerrainStorageStats
+	UFUNCTION(BlueprintCallable, Category = "UnrealSandbox")
+	FString DumpStorageStats();
+
+	// background compaction disk traffic limit. 0 - unlimited
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	int32 CompactionBudgetMbPerSecond = 16;
+
+	// decoded mesh data of recently visited zones. 0 - disabled
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	int32 MeshCacheSizeMb = 128;
+
+	// raw voxel data if file can't be memory mapped. 0 - disabled
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	int32 ValueCacheSizeMb = 32;
+
+	// freed scratch buffers of zone load, save and substance cache kept for reuse. 0 - disabled
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	int32 VoxelBufferPoolSizeMb = 16;
+
+	// save only queues data, dedicated thread per file writes it to disk. 
+	// off by default: queued saves are lost on crash and FastSave skips index checkpoint
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bWriteBehindSave = false;
+
+	// voxel, mesh and object data of zone as one record in terrain.dat instead of three files.
+	// existing maps are not converted
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bSingleFileStorage = false;
+
     UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
     int32 AutoSavePeriod;
     
@@ -455,6 +504,16 @@ private:
 	void Save();
     
     void FastSave();
+
+	void CommitWriteBatch(TKvFile& KvFile, const TKvFile::WriteBatch& Batch, const TCHAR* Name);
+
+	void CommitZoneData(const TKvFile::WriteBatch& VdBatch, const TKvFile::WriteBatch& MdBatch, const TKvFile::WriteBatch& ObjBatch);
+
+	bool IsStorageOpen();
+
+	void ForEachStorageFile(std::function<void(TKvFile&, const TCHAR*)> Function);
+
+	void CompactKvFile(TKvFile& KvFile, const TCHAR* Name);
     
     void AutoSaveByTimer();
 
@@ -466,9 +525,9 @@ private:
 	// pipeline
 	//===============================================================================
 
-	int GeneratePipeline(const TVoxelIndex& Index);
+	int GeneratePipeline(const TVoxelIndex& Index, const TZonePrefetchData* Prefetch = nullptr);
 
-	int SpawnZonePipeline(const TVoxelIndex& pos, const TTerrainLodMask TerrainLodMask = 0);
+	int SpawnZonePipeline(const TVoxelIndex& pos, const TTerrainLodMask TerrainLodMask = 0, const TZonePrefetchData* Prefetch = nullptr);
 
 	UTerrainZoneComponent* AddTerrainZone(FVector pos);
 
@@ -502,6 +561,19 @@ private:
 
 	TKvFile ObjFile;
 
+	TKvContainer TerrainFile;
+
+	bool IsVdExist(const TVoxelIndex& Index);
+
+	bool LoadZoneDataView(ETerrainDataColumn Column, const TVoxelIndex& Index, std::function<void(const kvdb::TValueView&)> Function);
+
+	kvdb::TLruCache<TVoxelIndex, TMeshData> MeshDataCache;
+
+	// microseconds, reported by DumpStorageStats
+	kvdb::TAtomicHistogram MeshGenerationTime;
+
+	kvdb::TAtomicHistogram SubstanceCacheTime;
+
 	TVoxelData* GetVoxelDataByPos(const FVector& Pos);
 
 	TVoxelData* GetVoxelDataByIndex(const TVoxelIndex& Index);
@@ -520,6 +592,8 @@ private:
 
 	TMeshDataPtr LoadMeshDataByIndex(const TVoxelIndex& Index);
 
+	TMeshDataPtr UnpackMeshData(const TVoxelIndex& Index, const kvdb::TValueView& View);
+
 	void LoadObjectDataByIndex(UTerrainZoneComponent* Zone, TInstanceMeshTypeMap& ZoneInstMeshMap);
 
 	//===============================================================================
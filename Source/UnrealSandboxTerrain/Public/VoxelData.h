@@ -1,6 +1,7 @@
 #pragma once
 
 #include "EngineMinimal.h"
+#include "voxelbricks.hpp"
 
 #include <list>
 #include <array>
@@ -9,9 +10,18 @@
 #include <mutex>
 #include <functional>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
 
 #define LOD_ARRAY_SIZE 7
 
+// serialized voxel data format. 0 - unversioned data, material as linear array. 1 - material as palette bricks
+#define VOXEL_DATA_FORMAT_VERSION 1
+// set in density_state of header when format version follows the header. older builds reject it as bad density state
+#define VOXEL_DATA_VERSION_FLAG 0x80
+
+#define VOXEL_BUFFER_POOL_CAPACITY (16 * 1024 * 1024) // bytes of free buffers kept for reuse
+
 typedef unsigned char TDensityVal;
 typedef unsigned short TMaterialId;
 
@@ -19,9 +29,11 @@ typedef unsigned short TMaterialId;
 enum TVoxelDataFillState : uint8 {
 	ZERO = 0,		// data contains only zero values
 	FULL = 1,		// data contains only one same value
-	MIXED = 2		// mixed state, any value in any point
+	MIXED = 2,		// mixed state, any value in any point
+	PACKED = 3		// material only. mixed state serialized as bricks with palette
 };
 
+// surface cell decoded from substance cache
 typedef struct TSubstanceCacheItem {
 	uint32 index = 0;
 	unsigned long caseCode = 0;
@@ -30,11 +42,45 @@ typedef struct TSubstanceCacheItem {
 	uint32 z = 0;
 } TSubstanceCacheItem;
 
+// surface cells of one LOD in flat arrays: linear index of cell corner and its case code.
+// grows with the surface and is cleared without freeing, so rebuilt cache reuses capacity of the previous one
 typedef struct TSubstanceCache {
-	std::list<TSubstanceCacheItem> cellList;
+	std::vector<uint32> indexList;
+	std::vector<uint8> caseCodeList;
+
+	FORCEINLINE void add(uint32 index, uint8 caseCode) {
+		indexList.push_back(index);
+		caseCodeList.push_back(caseCode);
+	}
+
+	void clear() {
+		indexList.clear();
+		caseCodeList.clear();
+	}
+
+	size_t size() const {
+		return indexList.size();
+	}
+
+	// heap memory in bytes
+	size_t memoryUsage() const {
+		return indexList.capacity() * sizeof(uint32) + caseCodeList.capacity() * sizeof(uint8);
+	}
+
+	// num - voxel number by one axis
+	FORCEINLINE TSubstanceCacheItem item(size_t i, uint32 num) const {
+		TSubstanceCacheItem itm;
+		itm.index = indexList[i];
+		itm.caseCode = caseCodeList[i];
+		itm.x = itm.index / (num * num);
+		itm.y = (itm.index / num) % num;
+		itm.z = itm.index % num;
+		return itm;
+	}
 } TSubstanceCache;
 
-// POD structure. used in fast serialization
+// POD structure. used in fast serialization. 
+// density_state & VOXEL_DATA_VERSION_FLAG - uint32 format version follows
 typedef struct TVoxelDataHeader {
 	uint32 voxel_num;
 	float volume_size;
@@ -43,8 +89,69 @@ typedef struct TVoxelDataHeader {
 	TMaterialId base_fill_mat;
 } TVoxelDataHeader;
 
+typedef struct TVoxelBufferPoolStats {
+	uint64 hits = 0;
+	uint64 misses = 0;
+	uint64 dropped = 0; // freed over capacity
+	uint64 pooledBytes = 0;
+
+	double hitRate() const {
+		return (hits + misses > 0) ? (double)hits / (hits + misses) : 0;
+	}
+} TVoxelBufferPoolStats;
+
+// thread-safe pool of large temporary voxel buffers by size: dense arrays of serialization and occupancy planes.
+// zones are loaded and saved all the time, so freed buffers are kept for reuse up to capacity.
+// small dense bricks stay on the regular heap, a pool lock per brick would cost more than it saves
+class TVoxelBufferPool {
+
+private:
+	mutable std::mutex pool_mutex;
+	std::unordered_map<size_t, std::vector<void*>> free_map; // by size in bytes
+	size_t capacity = VOXEL_BUFFER_POOL_CAPACITY;
+	TVoxelBufferPoolStats pool_stats;
+
+	void trim();
+
+public:
+	static TVoxelBufferPool& instance();
+
+	void* allocate(size_t bytes);
+	void free(void* ptr, size_t bytes);
+
+	// 0 - no reuse
+	void setCapacity(size_t bytes);
+
+	TVoxelBufferPoolStats stats() const;
+};
+
+// pooled array for the time of scope
+template <typename T>
+class TVoxelPooledBuffer {
+
+private:
+	T* data_ptr;
+	size_t count;
+
+public:
+	explicit TVoxelPooledBuffer(size_t n) : count(n) {
+		data_ptr = (T*)TVoxelBufferPool::instance().allocate(count * sizeof(T));
+	}
+
+	TVoxelPooledBuffer(const TVoxelPooledBuffer&) = delete;
+	TVoxelPooledBuffer& operator=(const TVoxelPooledBuffer&) = delete;
+
+	~TVoxelPooledBuffer() {
+		TVoxelBufferPool::instance().free(data_ptr, count * sizeof(T));
+	}
+
+	T* data() const {
+		return data_ptr;
+	}
+};
+
 class TVoxelData;
-typedef std::shared_ptr<TVoxelData> TVoxelDataPtr;
+typedef std::shared_ptr<TVoxelData> TVoxelDataPtr;
 
 class TVoxelData {
 
@@ -54,8 +161,8 @@ private:
 
 	int voxel_num;
 	float volume_size;
-	TDensityVal* density_data;
-	unsigned short* material_data;
+	TVoxelBrickArray<TDensityVal> density_data;
+	TVoxelPaletteArray<TMaterialId> material_data;
 	std::vector<FVector> normal_data;
 
 	volatile double last_change;
@@ -126,13 +233,19 @@ public:
 	void deinitializeDensity(TVoxelDataFillState density_state);
 	void deinitializeMaterial(unsigned short base_mat);
 
+	// uniform bricks release dense storage
+	void optimize();
+
+	// resident memory of voxel channels and substance cache in bytes
+	size_t memoryUsage() const;
+
 	bool isSubstanceCacheValid() const { return last_change <= last_cache_check; }
 	void setCacheToValid() { last_cache_check = FPlatformTime::Seconds(); }
 
 	virtual void makeSubstanceCache();
 	void clearSubstanceCache() {
 		for (TSubstanceCache& lodCache : substanceCacheLOD) {
-			lodCache.cellList.clear();
+			lodCache.clear();
 		}
 
 		last_cache_check = -1;
@@ -145,6 +258,7 @@ public:
 	friend void deserializeVoxelDataFast(TVoxelData* vd, TArray<uint8>& Data, bool createSubstanceCache);
 
 	friend bool deserializeVoxelData(TVoxelData* vd, std::vector<uint8>& data);
+	friend bool deserializeVoxelData(TVoxelData* vd, const uint8* data);
 };
 
 
@@ -0,0 +1,155 @@
+#pragma once
+
+//
+// Marching cubes case codes for rows of cells. No engine dependency,
+// used by TVoxelData::makeSubstanceCache and Benchmark/casecode_benchmark.cpp
+//
+// Density is turned to occupancy plane first: one byte per sample, 1 if density <= 127.
+// Cell corner bits follow TVoxelData::performCellSubstanceCaching. For row of cells along z
+// between columns a (x-s, y), b (x-s, y-s), c (x, y), d (x, y-s):
+//     q[z] = a[z] | b[z] << 1 | c[z] << 2 | d[z] << 3
+//     code(cell z) = q[z] | q[z + 1] << 4
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CASECODE_NO_SIMD - scalar code only, for comparison
+#if defined(CASECODE_NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define CASECODE_USE_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CASECODE_USE_SSE2 1
+#endif
+
+namespace casecode {
+
+	inline const char* instructionSet() {
+#if defined(CASECODE_USE_AVX2)
+		return "avx2";
+#elif defined(CASECODE_USE_SSE2)
+		return "sse2";
+#else
+		return "scalar";
+#endif
+	}
+
+	// occ may point to density, conversion works in place
+	inline void occupancy(const uint8_t* density, uint8_t* occ, size_t size) {
+		size_t i = 0;
+
+#if defined(CASECODE_USE_AVX2)
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi8(1);
+		for (; i + 32 <= size; i += 32) {
+			const __m256i v = _mm256_loadu_si256((const __m256i*)(density + i));
+			// signed compare: density >= 128 is negative
+			const __m256i outside = _mm256_cmpgt_epi8(zero, v);
+			_mm256_storeu_si256((__m256i*)(occ + i), _mm256_andnot_si256(outside, one));
+		}
+#elif defined(CASECODE_USE_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+		for (; i + 16 <= size; i += 16) {
+			const __m128i v = _mm_loadu_si128((const __m128i*)(density + i));
+			const __m128i outside = _mm_cmplt_epi8(v, zero);
+			_mm_storeu_si128((__m128i*)(occ + i), _mm_andnot_si128(outside, one));
+		}
+#endif
+
+		for (; i < size; i++) {
+			occ[i] = (density[i] <= 127) ? 1 : 0;
+		}
+	}
+
+	// n - samples in each column, gives n - 1 cells. cells crossing the surface (code not 0 or 255)
+	// are written to cells (z of cell) and codes, both must hold n - 1 entries. returns number of cells written
+	inline int classifyRow(const uint8_t* a, const uint8_t* b, const uint8_t* c, const uint8_t* d, int n, int* cells, uint8_t* codes) {
+		int count = 0;
+		int z = 0;
+
+#if defined(CASECODE_USE_AVX2)
+		// values are 0..15 in each byte, so 16 bit shifts don't leak into neighbour byte
+		const __m256i full = _mm256_set1_epi8((char)0xff);
+		const __m256i zero = _mm256_setzero_si256();
+		for (; z + 33 <= n; z += 32) {
+			const __m256i q0 = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(a + z)), _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(b + z)), 1)),
+				_mm256_or_si256(_mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(c + z)), 2), _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(d + z)), 3)));
+			const __m256i q1 = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(a + z + 1)), _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(b + z + 1)), 1)),
+				_mm256_or_si256(_mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(c + z + 1)), 2), _mm256_slli_epi16(_mm256_loadu_si256((const __m256i*)(d + z + 1)), 3)));
+			const __m256i code = _mm256_or_si256(q0, _mm256_slli_epi16(q1, 4));
+			const uint32_t trivial = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(code, zero), _mm256_cmpeq_epi8(code, full)));
+			if (trivial == 0xffffffff) {
+				continue;
+			}
+
+			alignas(32) uint8_t row[32];
+			_mm256_store_si256((__m256i*)row, code);
+			for (int i = 0; i < 32; i++) {
+				if (!(trivial & (1u << i))) {
+					cells[count] = z + i;
+					codes[count] = row[i];
+					count++;
+				}
+			}
+		}
+#elif defined(CASECODE_USE_SSE2)
+		const __m128i full = _mm_set1_epi8((char)0xff);
+		const __m128i zero = _mm_setzero_si128();
+		for (; z + 17 <= n; z += 16) {
+			const __m128i q0 = _mm_or_si128(
+				_mm_or_si128(_mm_loadu_si128((const __m128i*)(a + z)), _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(b + z)), 1)),
+				_mm_or_si128(_mm_slli_epi16(_mm_loadu_si128((const __m128i*)(c + z)), 2), _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(d + z)), 3)));
+			const __m128i q1 = _mm_or_si128(
+				_mm_or_si128(_mm_loadu_si128((const __m128i*)(a + z + 1)), _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(b + z + 1)), 1)),
+				_mm_or_si128(_mm_slli_epi16(_mm_loadu_si128((const __m128i*)(c + z + 1)), 2), _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(d + z + 1)), 3)));
+			const __m128i code = _mm_or_si128(q0, _mm_slli_epi16(q1, 4));
+			const int trivial = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(code, zero), _mm_cmpeq_epi8(code, full)));
+			if (trivial == 0xffff) {
+				continue;
+			}
+
+			alignas(16) uint8_t row[16];
+			_mm_store_si128((__m128i*)row, code);
+			for (int i = 0; i < 16; i++) {
+				if (!(trivial & (1 << i))) {
+					cells[count] = z + i;
+					codes[count] = row[i];
+					count++;
+				}
+			}
+		}
+#endif
+
+		for (; z + 1 < n; z++) {
+			const uint8_t code = (uint8_t)(a[z] | (b[z] << 1) | (c[z] << 2) | (d[z] << 3)
+				| (a[z + 1] << 4) | (b[z + 1] << 5) | (c[z + 1] << 6) | (d[z + 1] << 7));
+			if (code != 0 && code != 255) {
+				cells[count] = z;
+				codes[count] = code;
+				count++;
+			}
+		}
+
+		return count;
+	}
+
+	// every step-th sample of n x n x n occupancy plane to m x m x m plane, m = (n - 1) / step + 1
+	inline void downsample(const uint8_t* occ, int n, int step, uint8_t* out) {
+		const int m = (n - 1) / step + 1;
+		for (int x = 0; x < m; x++) {
+			for (int y = 0; y < m; y++) {
+				const uint8_t* src = occ + ((size_t)x * step * n + (size_t)y * step) * n;
+				uint8_t* dst = out + ((size_t)x * m + y) * m;
+				for (int z = 0; z < m; z++) {
+					dst[z] = src[z * step];
+				}
+			}
+		}
+	}
+
+}
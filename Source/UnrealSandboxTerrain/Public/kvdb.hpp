@@ -12,14 +12,60 @@
 #include <string>
 #include <list>
 #include <set>
+#include <map>
+#include <queue>
+#include <unordered_set>
+#include <functional>
+#include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
 #include <type_traits>
+#include <algorithm>
 #include <cassert>
 #include <cstring> 
+#include <chrono>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define KVDB_POSITIONAL_IO 1
+#elif defined(_WIN32)
+#if defined(PLATFORM_WINDOWS)
+#include "Windows/AllowWindowsPlatformTypes.h"
+#include <windows.h>
+#include "Windows/HideWindowsPlatformTypes.h"
+#else
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+#define KVDB_WIN32_IO 1 // ReadFile at offset and file mapping, no pread() and mmap()
+#endif
 
+
+#define KVDB_FILE_VERSION 4 // 2 - generation counter in file header, 3 - shared value slots, 4 - inline values
+#define KVDB_INDEX_MAGIC 0x3244494B // "KID2", raw key index arrays
 #define KVDB_KEY_SIZE 12 // 3 x int32 (X, Y, Z)
 #define KVDB_RESERVED_TABLE_SIZE 1000
+#define KVDB_MMAP_GRANULARITY (64ull * 1024ull * 1024ull) // grow mapping by 64 MB steps
+#define KVDB_PRESENCE_FILTER_XY 128 // default filter range -128..127 by X and Y
+#define KVDB_PRESENCE_FILTER_Z 32 // default filter range -32..31 by Z
+#define KVDB_WRITE_BEHIND_MAX_BYTES (256ull * 1024ull * 1024ull) // save() blocks if more is waiting for writer
+#define KVDB_DEDUP_MAX_SIZE 4096 // only values up to this size are deduplicated
+#define KVDB_BUILDER_RUN_SIZE (1u << 20) // index records sorted in memory by bulk builder, about 48 MB
+#define KVDB_SLACK_MAX_SHIFT 2 // slack of hot key: 1/4, 1/2, then whole value size
+#define KVDB_SLACK_MAX_SIZE (1024ull * 1024ull) // but not more than 1 MB
+#define KVDB_INLINE_MAX_SIZE 16 // values up to this size fit into key entry in place of data position and slot length
+#define KVDB_INLINE_FLAG (1ull << 63) // in dataLength of key entry with inline value
 
 typedef uint32_t uint32;
 typedef unsigned long long ulong64;
@@ -35,12 +81,18 @@ typedef std::shared_ptr<TValueData> TValueDataPtr;
 namespace std {
 	template <>
 	struct hash<TKeyData> {
+		// key as packed 3 x int32, mixed by murmur3 finalizer
 		std::size_t operator()(const TKeyData& keyData) const {
-			std::size_t h = 0;
-			for (auto elem : keyData) {
-				h ^= std::hash<int>{}(elem)+0x9e3779b9 + (h << 6) + (h >> 2);
-			}
-			return h;
+			uint32_t xyz[3];
+			std::memcpy(xyz, keyData.data(), sizeof(xyz));
+
+			uint64_t h = ((uint64_t)xyz[0] | ((uint64_t)xyz[1] << 32)) ^ ((uint64_t)xyz[2] * 0x9E3779B97F4A7C15ull);
+			h ^= h >> 33;
+			h *= 0xFF51AFD7ED558CCDull;
+			h ^= h >> 33;
+			h *= 0xC4CEB9FE1A85EC53ull;
+			h ^= h >> 33;
+			return (std::size_t)h;
 		}
 	};
 }
@@ -64,516 +116,4631 @@ namespace kvdb {
 		}
 	}
 
+	// flush file content to disk
+	inline void syncFile(const std::string& file) {
+#ifdef KVDB_POSITIONAL_IO
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			::fsync(fd);
+			::close(fd);
+		}
+#elif defined(KVDB_WIN32_IO)
+		HANDLE handle = CreateFileA(file.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle != INVALID_HANDLE_VALUE) {
+			FlushFileBuffers(handle);
+			CloseHandle(handle);
+		}
+#endif
+	}
+
+	// flush directory entries of file to disk, so created or renamed file survives a crash
+	inline void syncParentDirectory(const std::string& file) {
+#ifdef KVDB_POSITIONAL_IO
+		const size_t slash = file.find_last_of('/');
+		const std::string dir = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : file.substr(0, slash);
+		int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd >= 0) {
+			::fsync(fd);
+			::close(fd);
+		}
+#endif
+	}
+
+	// open handle keeps content of file alive after it is replaced. on posix the last close frees 
+	// blocks of replaced file, which takes long for large file, so it is done outside of locks. -1 elsewhere
+	inline int holdFile(const std::string& file) {
+#ifdef KVDB_POSITIONAL_IO
+		return ::open(file.c_str(), O_RDONLY);
+#else
+		return -1;
+#endif
+	}
+
+	inline void releaseFile(int handle) {
+#ifdef KVDB_POSITIONAL_IO
+		if (handle >= 0) ::close(handle);
+#endif
+	}
+
+	// replace dst with src. atomic and durable on posix and windows, elsewhere old file is moved aside first.
+	// mapped file can't be replaced on windows, only renamed, so it stays as .bak while views use it
+	inline bool replaceFile(const std::string& src, const std::string& dst) {
+#ifdef KVDB_POSITIONAL_IO
+		if (std::rename(src.c_str(), dst.c_str()) != 0) return false;
+		syncParentDirectory(dst);
+		return true;
+#elif defined(KVDB_WIN32_IO)
+		if (MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) return true;
+
+		const std::string backup = dst + ".bak";
+		DeleteFileA(backup.c_str());
+		if (!MoveFileExA(dst.c_str(), backup.c_str(), MOVEFILE_REPLACE_EXISTING)) return false;
+		if (!MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_WRITE_THROUGH)) {
+			MoveFileExA(backup.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING);
+			return false;
+		}
+		DeleteFileA(backup.c_str());
+		return true;
+#else
+		const std::string backup = dst + ".bak";
+		std::remove(backup.c_str());
+		if (std::rename(dst.c_str(), backup.c_str()) != 0) return false;
+		if (std::rename(src.c_str(), dst.c_str()) != 0) {
+			std::rename(backup.c_str(), dst.c_str());
+			return false;
+		}
+		std::remove(backup.c_str());
+		return true;
+#endif
+	}
+
 	//============================================================================
-	// File position
+	// Morton code
 	//============================================================================
-	template <typename T>
-	class TPosWrapper {
-
-	private:
-		T objT;
 
-	public:
-		ulong64 pos;
+	// spread lower 21 bits to every third bit
+	inline ulong64 mortonSpread(ulong64 v) {
+		v &= 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffull;
+		v = (v | v << 16) & 0x1f0000ff0000ffull;
+		v = (v | v << 8) & 0x100f00f00f00f00full;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
 
-		TPosWrapper() {};
+	// z-order of key as 3 x int32 (X, Y, Z). coordinates are biased by 2^20 to keep negative indexes in order
+	inline ulong64 mortonCode(const TKeyData& keyData) {
+		int32_t xyz[3];
+		std::memcpy(xyz, keyData.data(), sizeof(xyz));
 
-		TPosWrapper(T t, ulong64 p) : objT(t), pos(p) {};
+		const ulong64 bias = 1ull << 20;
+		return mortonSpread((ulong64)xyz[0] + bias) | (mortonSpread((ulong64)xyz[1] + bias) << 1) | (mortonSpread((ulong64)xyz[2] + bias) << 2);
+	}
 
-		const T& operator()() const { return objT; }
+	// smallest morton code greater than code and inside box [zmin, zmax] (Tropf-Herzog BIGMIN).
+	// expects code inside [zmin, zmax] range but outside of the box
+	inline ulong64 mortonBigMin(ulong64 code, ulong64 zmin, ulong64 zmax) {
+		ulong64 bigMin = 0;
 
-		T& operator()() { return objT; }
+		for (int bit = 62; bit >= 0; bit--) {
+			// this and lower bits of the same dimension
+			ulong64 dimMask = 0;
+			for (int b = bit; b >= 0; b -= 3) dimMask |= 1ull << b;
 
-		T* operator->() { return &objT; }
-	};
+			const ulong64 bitMask = 1ull << bit;
+			const ulong64 load10 = bitMask; // 1000...
+			const ulong64 load01 = dimMask & ~bitMask; // 0111...
 
-	//============================================================================
-	// File header
-	//============================================================================
-	typedef struct TFileHeader {
-		uint32 version = 1;
-		uint32 keySize = 0;
-		ulong64 timestamp = 0;
-		uint32  endOfHeaderOffset = 0;
-	} TFileHeader;
+			const int state = ((code & bitMask) ? 4 : 0) | ((zmin & bitMask) ? 2 : 0) | ((zmax & bitMask) ? 1 : 0);
+			switch (state) {
+			case 1: // 0 0 1
+				bigMin = (zmin & ~dimMask) | load10;
+				zmax = (zmax & ~dimMask) | load01;
+				break;
+			case 3: // 0 1 1
+				return zmin;
+			case 4: // 1 0 0
+				return bigMin;
+			case 5: // 1 0 1
+				zmin = (zmin & ~dimMask) | load10;
+				break;
+			default: // 0 0 0, 1 1 1 - same bit, 0 1 0 and 1 1 0 - not possible with zmin <= zmax
+				break;
+			}
+		}
 
-	inline std::ostream* operator << (std::ostream* os, const TFileHeader& obj) {
-		write(os, obj);
-		return os;
+		return bigMin;
 	}
 
-	inline std::istream* operator >> (std::istream* is, TFileHeader& obj) {
-		read(is, obj);
-		return is;
+	inline bool isKeyInBox(const TKeyData& keyData, const int32_t (&minXyz)[3], const int32_t (&maxXyz)[3]) {
+		int32_t xyz[3];
+		std::memcpy(xyz, keyData.data(), sizeof(xyz));
+
+		return xyz[0] >= minXyz[0] && xyz[0] <= maxXyz[0] &&
+			xyz[1] >= minXyz[1] && xyz[1] <= maxXyz[1] &&
+			xyz[2] >= minXyz[2] && xyz[2] <= maxXyz[2];
 	}
 
 	//============================================================================
-	// Table header
+	// Content hash
 	//============================================================================
-	typedef struct TTableHeader {
-		ulong64 recordCount = 0;
-		ulong64 nextTable = 0;
-	} TTableHeader;
 
-	typedef TPosWrapper<TTableHeader> TTableHeaderInfo;
-
-	inline std::ostream* operator << (std::ostream* os, const TTableHeader& obj) {
-		write(os, obj);
-		return os;
-	}
+	// FNV-1a
+	inline ulong64 contentHash(const byte* data, size_t length) {
+		ulong64 hash = 0xcbf29ce484222325ull;
+		for (size_t i = 0; i < length; i++) {
+			hash ^= data[i];
+			hash *= 0x100000001b3ull;
+		}
 
-	inline std::istream* operator >> (std::istream* is, TTableHeader& obj) {
-		read(is, obj);
-		return is;
+		return hash;
 	}
 
 	//============================================================================
-	// Key Entry
+	// Mapped file region
 	//============================================================================
-	typedef struct TKeyEntry {
-		ulong64 dataPos = 0;
-		ulong64 dataLength = 0;
-		ulong64 initialDataLength = 0;
+	class TMappedRegion {
 
-		TKeyData freeKeyData;
-	} TKeyEntry;
+	private:
+		const byte* ptr = nullptr;
+		ulong64 length = 0;
+#ifdef KVDB_WIN32_IO
+		HANDLE mapping = nullptr;
+#endif
 
-	typedef TPosWrapper<TKeyEntry> TKeyEntryInfo;
+	public:
+
+		TMappedRegion(const byte* ptr_, ulong64 length_) : ptr(ptr_), length(length_) { }
+
+#ifdef KVDB_WIN32_IO
+		TMappedRegion(const byte* ptr_, ulong64 length_, HANDLE mapping_) : ptr(ptr_), length(length_), mapping(mapping_) { }
+#endif
 
-	struct TKeyInfoComparatorByInitialLength {
-		bool operator() (const TKeyEntryInfo &lhs, const TKeyEntryInfo &rhs) const {
-			return (lhs().initialDataLength > rhs().initialDataLength);
+		~TMappedRegion() {
+#ifdef KVDB_POSITIONAL_IO
+			if (ptr) {
+				munmap((void*)ptr, length);
+			}
+#elif defined(KVDB_WIN32_IO)
+			if (ptr) {
+				UnmapViewOfFile(ptr);
+			}
+
+			if (mapping) {
+				CloseHandle(mapping);
+			}
+#endif
 		}
-	};
 
-	inline std::ostream* operator << (std::ostream* os, const TKeyEntry& obj) {
-		write(os, obj);
-		return os;
-	}
+		const byte* data() const { return ptr; }
 
-	inline std::istream* operator >> (std::istream* is, TKeyEntry& obj) {
-		read(is, obj);
-		return is;
-	}
+		ulong64 size() const { return length; }
+	};
+
+	typedef std::shared_ptr<TMappedRegion> TMappedRegionPtr;
 
 	//============================================================================
-	// File db
+	// Read-only value view
+	//
+	// Points directly into mapped file memory (or into an owned buffer if the 
+	// file is not mapped). Guard keeps the backing memory alive as long as the 
+	// view exists, even if the file has been remapped meanwhile. For mapped 
+	// memory it also pins the value slot, so later saves don't write over it.
 	//============================================================================
-	template <typename K, typename V>
-	class KvFile {
+	class TValueView {
 
 	private:
+		const byte* dataPtr = nullptr;
+		ulong64 length = 0;
+		std::shared_ptr<const void> guard;
 
-		std::unordered_map<TKeyData, TKeyEntryInfo> dataMap;
-		std::fstream* filePtr = nullptr;
-		std::list<TKeyEntryInfo> reservedKeyList;
-		std::set<TKeyEntryInfo, TKeyInfoComparatorByInitialLength> deletedKeyList;
-		std::list<TTableHeaderInfo> tableList;
-		mutable std::mutex fileSharedMutex;
-		
-		uint32 reservedKeys = KVDB_RESERVED_TABLE_SIZE;
-		uint32 reservedValueSize = 0;
+	public:
 
-	private:
+		TValueView() { }
 
-		std::shared_ptr<V> valueFromData(TValueDataPtr dataPtr) {
-			if (dataPtr == nullptr) return nullptr;
+		TValueView(const byte* dataPtr_, ulong64 length_, std::shared_ptr<const void> guard_) : dataPtr(dataPtr_), length(length_), guard(guard_) { }
 
-            if (std::is_same<V, TValueData>::value) { //constexpr
-				return std::static_pointer_cast<TValueData>(dataPtr);
-			} else {
-				V* temp = new V();
-				memcpy(temp, dataPtr->data(), dataPtr->size());
-				return std::shared_ptr<V>(temp);
-			}
+		explicit TValueView(TValueDataPtr buffer) : dataPtr(buffer->data()), length(buffer->size()), guard(buffer) { }
+
+		const byte* data() const { return dataPtr; }
+
+		ulong64 size() const { return length; }
+
+		explicit operator bool() const { return dataPtr != nullptr; }
+
+		// part of the value, keeps the same backing memory alive
+		TValueView slice(ulong64 offset, ulong64 sliceLength) const {
+			return TValueView(dataPtr + offset, sliceLength, guard);
 		}
+	};
 
-		static TKeyData toKeyData(K key) {
-			byte temp[KVDB_KEY_SIZE];
-			for (int i = 0; i < KVDB_KEY_SIZE; i++) temp[i] = 0;
+	//============================================================================
+	// Positional read-only file
+	//
+	// Reads by absolute offset and never touches a shared seek cursor, so any 
+	// number of threads can read at the same time. Uses pread() where available, 
+	// ReadFile() with offset on windows, otherwise falls back to a pool of 
+	// independent read handles.
+	//============================================================================
+	class TReadFile {
 
-			memcpy(&temp, &key, sizeof(K));
+	private:
+#ifdef KVDB_POSITIONAL_IO
+		int fd = -1;
+#elif defined(KVDB_WIN32_IO)
+		HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+		std::string fileName;
+		std::mutex poolMutex;
+		std::vector<std::ifstream*> handlePool;
+		bool bIsOpen = false;
 
-			TKeyData arrayOfByte;
-			for (int i = 0; i < KVDB_KEY_SIZE; i++) arrayOfByte[i] = temp[i];
+		std::ifstream* acquire() {
+			{
+				std::lock_guard<std::mutex> guard(poolMutex);
+				if (handlePool.size() > 0) {
+					std::ifstream* handle = handlePool.back();
+					handlePool.pop_back();
+					return handle;
+				}
+			}
 
-			return arrayOfByte;
+			return new std::ifstream(fileName, std::ios::in | std::ios::binary);
 		}
 
-		static void toValueData(V value, TValueData& valueData) {
-			if (valueData.size() < sizeof(value)) valueData.resize(sizeof(value));
-			std::memcpy(valueData.data(), &value, sizeof(value));
+		void release(std::ifstream* handle) {
+			std::lock_guard<std::mutex> guard(poolMutex);
+			handlePool.push_back(handle);
 		}
+#endif
+
+	public:
 
-		void rewritePair(TKeyEntryInfo& keyInfo, const TValueData& valueData) {
-			// rewrite value data
-			filePtr->seekg(keyInfo().dataPos);
-			filePtr->write((char*)valueData.data(), valueData.size());
+		~TReadFile() {
+			close();
+		}
 
-			// rewrite key data
-			keyInfo().dataLength = valueData.size(); // new length
-			filePtr->seekg(keyInfo.pos);
-			filePtr << keyInfo();
+		bool open(const std::string& file) {
+			close();
+#ifdef KVDB_POSITIONAL_IO
+			fd = ::open(file.c_str(), O_RDONLY);
+#elif defined(KVDB_WIN32_IO)
+			// writer keeps its own handle, compaction renames the file while it is open
+			handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+			fileName = file;
+			std::ifstream* handle = acquire();
+			bIsOpen = handle->is_open();
+			release(handle);
+#endif
+			return isOpen();
 		}
 
-		void earsePair(TKeyEntryInfo& keyInfo) {
-			// rewrite key data
-			keyInfo().dataLength = 0; // new length
-			filePtr->seekg(keyInfo.pos);
-			filePtr << keyInfo();
+		void close() {
+#ifdef KVDB_POSITIONAL_IO
+			if (fd >= 0) {
+				::close(fd);
+				fd = -1;
+			}
+#elif defined(KVDB_WIN32_IO)
+			if (handle != INVALID_HANDLE_VALUE) {
+				CloseHandle(handle);
+				handle = INVALID_HANDLE_VALUE;
+			}
+#else
+			std::lock_guard<std::mutex> guard(poolMutex);
+			for (std::ifstream* handle : handlePool) {
+				delete handle;
+			}
+			handlePool.clear();
+			bIsOpen = false;
+#endif
+		}
 
-			deletedKeyList.insert(keyInfo);
-			dataMap.erase(keyInfo().freeKeyData);
+		bool isOpen() const {
+#ifdef KVDB_POSITIONAL_IO
+			return fd >= 0;
+#elif defined(KVDB_WIN32_IO)
+			return handle != INVALID_HANDLE_VALUE;
+#else
+			return bIsOpen;
+#endif
 		}
 
-		void expandValueData(const TValueData& valueDataSrc, TValueData& valueDataNew) {
-			valueDataNew.resize(reservedValueSize);
-			for (uint32 i = 0; i < reservedValueSize; i++){
-				if(i < valueDataSrc.size()){
-					valueDataNew[i] = valueDataSrc[i];	
-				} else {
-					valueDataNew[i] = 0;	
-				}
+		// map whole file read-only. length can be bigger than the file, pages become valid as file grows.
+		// windows can't map past the end of read-only file, mapping is cut to file size there
+		TMappedRegionPtr map(ulong64 length) {
+#ifdef KVDB_POSITIONAL_IO
+			if (fd < 0 || length == 0) return nullptr;
+			void* ptr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+			if (ptr == MAP_FAILED) return nullptr;
+			return std::make_shared<TMappedRegion>((const byte*)ptr, length);
+#elif defined(KVDB_WIN32_IO)
+			length = std::min(length, size());
+			if (handle == INVALID_HANDLE_VALUE || length == 0) return nullptr;
+
+			HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, (DWORD)(length >> 32), (DWORD)length, nullptr);
+			if (mapping == nullptr) return nullptr;
+
+			void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)length);
+			if (ptr == nullptr) {
+				CloseHandle(mapping);
+				return nullptr;
 			}
+
+			return std::make_shared<TMappedRegion>((const byte*)ptr, length, mapping);
+#else
+			return nullptr;
+#endif
 		}
 
-		void newPairFromReserved(const TKeyData& keyData, const TValueData& valueData) {
-			// has reserved key slots
-			TKeyEntryInfo& keyInfo = reservedKeyList.front();
-			TValueData valueDataExp;
-			
-			if(valueData.size() < reservedValueSize){
-				expandValueData(valueData, valueDataExp);
-			} else {
-				valueDataExp = std::move(valueData);
+		ulong64 size() {
+#ifdef KVDB_POSITIONAL_IO
+			struct stat st;
+			if (fd < 0 || fstat(fd, &st) != 0) return 0;
+			return (ulong64)st.st_size;
+#elif defined(KVDB_WIN32_IO)
+			LARGE_INTEGER fileSize;
+			if (handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &fileSize)) return 0;
+			return (ulong64)fileSize.QuadPart;
+#else
+			std::ifstream* handle = acquire();
+			handle->clear();
+			handle->seekg(0, std::ios::end);
+			ulong64 res = (ulong64)handle->tellg();
+			release(handle);
+			return res;
+#endif
+		}
+
+		bool read(ulong64 pos, void* buffer, ulong64 length) {
+#ifdef KVDB_POSITIONAL_IO
+			char* ptr = (char*)buffer;
+			while (length > 0) {
+				ssize_t res = ::pread(fd, ptr, length, (off_t)pos);
+				if (res < 0 && errno == EINTR) continue;
+				if (res <= 0) return false;
+				ptr += res;
+				pos += res;
+				length -= res;
 			}
+			return true;
+#elif defined(KVDB_WIN32_IO)
+			// offset in OVERLAPPED, file pointer of handle is not used
+			char* ptr = (char*)buffer;
+			while (length > 0) {
+				OVERLAPPED overlapped = {};
+				overlapped.Offset = (DWORD)pos;
+				overlapped.OffsetHigh = (DWORD)(pos >> 32);
 
-			filePtr->seekg(0, std::ios::end); // to end-of-file
-			ulong64 endFile = (ulong64)(filePtr->tellp());
-			filePtr->write((char*)valueDataExp.data(), valueDataExp.size());
+				DWORD res = 0;
+				const DWORD chunk = (DWORD)std::min<ulong64>(length, 1ull << 30);
+				if (!ReadFile(handle, ptr, chunk, &res, &overlapped) || res == 0) return false;
+				ptr += res;
+				pos += res;
+				length -= res;
+			}
+			return true;
+#else
+			std::ifstream* handle = acquire();
+			handle->clear();
+			handle->seekg(pos);
+			bool res = (bool)handle->read((char*)buffer, length);
+			release(handle);
+			return res;
+#endif
+		}
+	};
 
-			// fill key data
-			keyInfo().dataLength = valueData.size(); // length
-			keyInfo().initialDataLength = valueDataExp.size(); // length
-			keyInfo().dataPos = endFile;
-			keyInfo().freeKeyData = keyData;
+	//============================================================================
+	// Presence filter
+	//============================================================================
 
-			filePtr->seekg(keyInfo.pos);
-			filePtr << keyInfo();
+	// lock-free bitset of existing keys (3 x int32) inside bounded box. 
+	// exact inside the box, keys outside are unknown
+	class TPresenceFilter {
 
-			// add new pair to table 
-			dataMap.insert({ keyInfo().freeKeyData, keyInfo });
-			reservedKeyList.pop_front();
+	private:
+		int32_t origin[3] = { 0, 0, 0 };
+		ulong64 dim[3] = { 0, 0, 0 };
+		std::unique_ptr<std::atomic<ulong64>[]> bits;
+		ulong64 wordCount = 0;
+
+		bool bitIndex(const TKeyData& keyData, ulong64& index) const {
+			int32_t xyz[3];
+			std::memcpy(xyz, keyData.data(), sizeof(xyz));
+
+			ulong64 offset[3];
+			for (int i = 0; i < 3; i++) {
+				const long long d = (long long)xyz[i] - origin[i];
+				if (d < 0 || (ulong64)d >= dim[i]) return false;
+				offset[i] = (ulong64)d;
+			}
+
+			index = (offset[0] * dim[1] + offset[1]) * dim[2] + offset[2];
+			return true;
 		}
 
-		ulong64 readTable() {
-			ulong64 tablePos = (ulong64)filePtr->tellp();
+	public:
 
-			TTableHeader tableHeader;
-			filePtr >> tableHeader;
+		// not thread safe, only while file is closed. empty box disables filter
+		void setRange(const TKeyData& minKey, const TKeyData& maxKey) {
+			int32_t minXyz[3], maxXyz[3];
+			std::memcpy(minXyz, minKey.data(), sizeof(minXyz));
+			std::memcpy(maxXyz, maxKey.data(), sizeof(maxXyz));
+
+			ulong64 bitCount = 1;
+			for (int i = 0; i < 3; i++) {
+				origin[i] = minXyz[i];
+				dim[i] = (maxXyz[i] >= minXyz[i]) ? (ulong64)((long long)maxXyz[i] - minXyz[i] + 1) : 0;
+				bitCount *= dim[i];
+			}
 
-			for (unsigned int i = 0; i < tableHeader.recordCount; i++) {
-				ulong64 pos = (ulong64)filePtr->tellp();
+			wordCount = (bitCount + 63) / 64;
+			bits.reset((wordCount > 0) ? new std::atomic<ulong64>[wordCount] : nullptr);
+			clear();
+		}
 
-				TKeyEntry keyEntry;
-				filePtr >> keyEntry;
+		void clear() {
+			for (ulong64 i = 0; i < wordCount; i++) bits[i].store(0, std::memory_order_relaxed);
+		}
 
-				TKeyEntryInfo keyInfo(keyEntry, pos);
+		// 1 - exist, 0 - not exist, -1 - outside of filter range
+		int test(const TKeyData& keyData) const {
+			ulong64 index;
+			if (!bits || !bitIndex(keyData, index)) return -1;
+			return (bits[index >> 6].load(std::memory_order_acquire) >> (index & 63)) & 1;
+		}
 
-				if (keyInfo().dataLength > 0) {
-					dataMap.insert({ keyEntry.freeKeyData, keyInfo });
-				} else {
-					if (keyInfo().initialDataLength == 0) {
-						// reserved key slot
-						reservedKeyList.push_back(keyInfo);
-					} else {
-						// marked as deleted pair
-						deletedKeyList.insert(keyInfo);
-					}
-				}
+		void set(const TKeyData& keyData, bool bExist) {
+			ulong64 index;
+			if (!bits || !bitIndex(keyData, index)) return;
+
+			const ulong64 mask = 1ull << (index & 63);
+			if (bExist) {
+				bits[index >> 6].fetch_or(mask, std::memory_order_release);
+			} else {
+				bits[index >> 6].fetch_and(~mask, std::memory_order_release);
 			}
+		}
+	};
 
-			tableList.push_back(TTableHeaderInfo(tableHeader, tablePos));
-			return tableHeader.nextTable;
+	//============================================================================
+	// LRU cache
+	//============================================================================
+	typedef struct TCacheStats {
+		ulong64 hits = 0;
+		ulong64 misses = 0;
+		ulong64 evictions = 0;
+		ulong64 entries = 0;
+		ulong64 bytes = 0;
+		ulong64 capacity = 0;
+
+		double hitRate() const {
+			return (hits + misses > 0) ? (double)hits / (double)(hits + misses) : 0;
 		}
+	} TCacheStats;
 
-		void createNewTable() {
-			filePtr->seekg(0, std::ios::end); // to end-of-file
-			ulong64 newTablePos = (ulong64)filePtr->tellp();
+	// thread-safe least recently used cache with byte budget. 
+	// holds shared objects: raw value data or decoded values. cached objects must not be modified
+	template <typename K, typename T>
+	class TLruCache {
 
-			// write new table
-			TTableHeader newTable;
-			newTable.recordCount = reservedKeys;
-			newTable.nextTable = 0;
-			filePtr << newTable;
+	public:
+		typedef std::shared_ptr<T> TObjPtr;
 
-			// write reserved keys
-			for (uint32 i = 0; i < reservedKeys; i++) {
-				uint32 newReservedKeyPos = (uint32)filePtr->tellp();
+	private:
+		typedef struct TEntry {
+			K key;
+			TObjPtr objPtr;
+			ulong64 bytes;
+		} TEntry;
 
-				TKeyEntry newReservedKey;
-				filePtr << newReservedKey;
+		// front - most recently used
+		std::list<TEntry> entryList;
+		std::unordered_map<K, typename std::list<TEntry>::iterator> entryMap;
+		mutable std::mutex cacheMutex;
 
-				TKeyEntryInfo keyInfo(newReservedKey, newReservedKeyPos);
-				reservedKeyList.push_back(keyInfo);
-			}
+		std::atomic<ulong64> capacity;
+		ulong64 bytes = 0;
+		ulong64 hits = 0;
+		ulong64 misses = 0;
+		ulong64 evictions = 0;
 
-			// read previous last table 
-			TTableHeaderInfo& lastTable = tableList.back();
-			filePtr->seekg(lastTable.pos);
+		void evict() {
+			while (bytes > capacity && !entryList.empty()) {
+				const TEntry& entry = entryList.back();
+				bytes -= entry.bytes;
+				entryMap.erase(entry.key);
+				entryList.pop_back();
+				evictions++;
+			}
+		}
 
-			// add link to new table
-			lastTable().nextTable = newTablePos;
+	public:
 
-			// rewrite previous last table
-			filePtr << lastTable();
+		TLruCache(ulong64 capacity_ = 0) : capacity(capacity_) { }
 
-			// add new table to internal list
-			tableList.push_back(TTableHeaderInfo(newTable, newTablePos));
+		bool isEnabled() const {
+			return capacity > 0;
 		}
 
-		bool hasReserved() {
-			return reservedKeyList.size() > 0;
+		void setCapacity(ulong64 val) {
+			std::unique_lock<std::mutex> guard(cacheMutex);
+			capacity = val;
+			evict();
 		}
 
-		bool tryWriteToSuitableDeletedPair(const TKeyData& keyData, const TValueData& valueData) {
-			for (auto itr = deletedKeyList.begin(); itr != deletedKeyList.end();) {
-				TKeyEntryInfo keyInfo = *itr;
-				if (keyInfo().initialDataLength >= valueData.size()) {
-					TKeyEntryInfo keyInfo = *itr;
-					keyInfo().freeKeyData = keyData;
-					rewritePair(keyInfo, valueData);
-					dataMap.insert({ keyInfo().freeKeyData, keyInfo });
-					itr = deletedKeyList.erase(itr);
+		TObjPtr get(const K& key) {
+			if (!isEnabled()) return nullptr;
+			std::unique_lock<std::mutex> guard(cacheMutex);
 
-					return true;
-				} else {
-					++itr;
-				}
+			auto got = entryMap.find(key);
+			if (got == entryMap.end()) {
+				misses++;
+				return nullptr;
 			}
 
-			return false;
+			hits++;
+			entryList.splice(entryList.begin(), entryList, got->second);
+			return got->second->objPtr;
 		}
 
-		void addNew(const TKeyData& keyData, const TValueData& valueData) {
-			if (valueData.size() == 0) {
-				return;
-			}
+		// without touching counters and order
+		bool contains(const K& key) const {
+			if (!isEnabled()) return false;
+			std::unique_lock<std::mutex> guard(cacheMutex);
+			return entryMap.find(key) != entryMap.end();
+		}
 
-			if (!tryWriteToSuitableDeletedPair(keyData, valueData)) {
-				if (hasReserved()) {
-					newPairFromReserved(keyData, valueData);
-				} else {
-					createNewTable();
-					newPairFromReserved(keyData, valueData);
-				}
+		void put(const K& key, TObjPtr objPtr, ulong64 objBytes) {
+			if (!isEnabled() || objPtr == nullptr) return;
+			std::unique_lock<std::mutex> guard(cacheMutex);
+
+			auto got = entryMap.find(key);
+			if (got != entryMap.end()) {
+				bytes -= got->second->bytes;
+				entryList.erase(got->second);
+				entryMap.erase(got);
 			}
+
+			if (objBytes > capacity) return;
+
+			entryList.push_front({ key, objPtr, objBytes });
+			entryMap.insert({ key, entryList.begin() });
+			bytes += objBytes;
+			evict();
 		}
 
-		void change(const TKeyData& keyData, const TValueData& valueData) {
-			TKeyEntryInfo keyInfo = dataMap[keyData];
-			if (valueData.size() > 0) {
-				if (keyInfo().initialDataLength >= valueData.size()) {
-					rewritePair(keyInfo, valueData);
-				} else {
-					//remove old and create new
-					earsePair(keyInfo);
-					addNew(keyData, valueData);
-				}
-			} else {
-				// erase
-				earsePair(keyInfo);
+		void erase(const K& key) {
+			if (!isEnabled()) return;
+			std::unique_lock<std::mutex> guard(cacheMutex);
+
+			auto got = entryMap.find(key);
+			if (got != entryMap.end()) {
+				bytes -= got->second->bytes;
+				entryList.erase(got->second);
+				entryMap.erase(got);
 			}
 		}
 
+		void clear() {
+			std::unique_lock<std::mutex> guard(cacheMutex);
+			entryList.clear();
+			entryMap.clear();
+			bytes = 0;
+		}
+
+		TCacheStats stats() const {
+			std::unique_lock<std::mutex> guard(cacheMutex);
+			TCacheStats res;
+			res.hits = hits;
+			res.misses = misses;
+			res.evictions = evictions;
+			res.entries = entryMap.size();
+			res.bytes = bytes;
+			res.capacity = capacity;
+			return res;
+		}
+	};
+
+	//============================================================================
+	// File position
+	//============================================================================
+	template <typename T>
+	class TPosWrapper {
+
+	private:
+		T objT;
+
+	public:
+		ulong64 pos;
+
+		TPosWrapper() {};
+
+		TPosWrapper(T t, ulong64 p) : objT(t), pos(p) {};
+
+		const T& operator()() const { return objT; }
+
+		T& operator()() { return objT; }
+
+		T* operator->() { return &objT; }
+	};
+
+	//============================================================================
+	// File header
+	//============================================================================
+	typedef struct TFileHeader {
+		uint32 version = KVDB_FILE_VERSION;
+		uint32 keySize = 0;
+		ulong64 timestamp = 0;
+		uint32  endOfHeaderOffset = 0;
+		uint32 generation = 0; // version 2. increased on first change after open or checkpoint
+	} TFileHeader;
+
+	inline ulong64 fileTimestamp() {
+		return (ulong64)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	inline std::ostream* operator << (std::ostream* os, const TFileHeader& obj) {
+		write(os, obj);
+		return os;
+	}
+
+	inline std::istream* operator >> (std::istream* is, TFileHeader& obj) {
+		read(is, obj);
+		return is;
+	}
+
+	//============================================================================
+	// Table header
+	//============================================================================
+	typedef struct TTableHeader {
+		ulong64 recordCount = 0;
+		ulong64 nextTable = 0;
+	} TTableHeader;
+
+	typedef TPosWrapper<TTableHeader> TTableHeaderInfo;
+
+	inline std::ostream* operator << (std::ostream* os, const TTableHeader& obj) {
+		write(os, obj);
+		return os;
+	}
+
+	inline std::istream* operator >> (std::istream* is, TTableHeader& obj) {
+		read(is, obj);
+		return is;
+	}
+
+	//============================================================================
+	// Key Entry
+	//============================================================================
+
+	// dataLength > 0, initialDataLength > 0 - live pair owning its value slot
+	// dataLength > 0, initialDataLength == 0 - live pair sharing value slot of other pair (version 3)
+	// dataLength == 0, initialDataLength > 0 - deleted pair, slot is free
+	// dataLength == 0, initialDataLength == 0 - reserved key slot
+	// dataLength & KVDB_INLINE_FLAG - live pair with value bytes in dataPos and initialDataLength, no value slot (version 4)
+	typedef struct TKeyEntry {
+		ulong64 dataPos = 0;
+		ulong64 dataLength = 0;
+		ulong64 initialDataLength = 0;
+
+		TKeyData freeKeyData;
+	} TKeyEntry;
+
+	static_assert(KVDB_INLINE_MAX_SIZE == sizeof(ulong64) * 2, "inline value takes dataPos and initialDataLength");
+
+	inline bool isInlineEntry(const TKeyEntry& e) {
+		return (e.dataLength & KVDB_INLINE_FLAG) != 0;
+	}
+
+	// value size of live pair
+	inline ulong64 valueLength(const TKeyEntry& e) {
+		return e.dataLength & ~KVDB_INLINE_FLAG;
+	}
+
+	inline void setInlineValue(TKeyEntry& e, const byte* data, ulong64 length) {
+		byte bytes[KVDB_INLINE_MAX_SIZE] = {};
+		std::memcpy(bytes, data, length);
+		std::memcpy(&e.dataPos, bytes, sizeof(e.dataPos));
+		std::memcpy(&e.initialDataLength, bytes + sizeof(e.dataPos), sizeof(e.initialDataLength));
+		e.dataLength = length | KVDB_INLINE_FLAG;
+	}
+
+	inline void getInlineValue(const TKeyEntry& e, byte* data) {
+		byte bytes[KVDB_INLINE_MAX_SIZE];
+		std::memcpy(bytes, &e.dataPos, sizeof(e.dataPos));
+		std::memcpy(bytes + sizeof(e.dataPos), &e.initialDataLength, sizeof(e.initialDataLength));
+		std::memcpy(data, bytes, valueLength(e));
+	}
+
+	typedef TPosWrapper<TKeyEntry> TKeyEntryInfo;
+
+	//============================================================================
+	// Key index
+	//============================================================================
+
+	// live pairs by key. entries are stored densely, key is taken from the entry itself.
+	// probe slots of open addressing table (linear probing) are 8 bytes: 32 high bits of key hash 
+	// and entry index + 1, 0 - empty slot. home slot is derived from the hash bits kept in slot,
+	// so erase shifts slots back without touching entries.
+	// insert() and erase() move entries, pointers returned by find() are valid until then
+	class TKeyIndex {
+
+	private:
+
+		std::vector<ulong64> slotList;
+		std::vector<TKeyEntryInfo> entryList;
+		size_t mask = 0;
+
+		static uint32 tagOf(const TKeyData& keyData) {
+			return (uint32)((ulong64)std::hash<TKeyData>{}(keyData) >> 32);
+		}
+
+		// slot holding key or empty slot where it would go
+		size_t slotOf(const TKeyData& keyData) const {
+			const uint32 tag = tagOf(keyData);
+			size_t i = tag & mask;
+
+			while (slotList[i] != 0) {
+				if ((uint32)(slotList[i] >> 32) == tag && entryList[(uint32)slotList[i] - 1]().freeKeyData == keyData) break;
+				i = (i + 1) & mask;
+			}
+
+			return i;
+		}
+
+		void rehash(size_t capacity) {
+			slotList.assign(capacity, 0);
+			mask = capacity - 1;
+
+			for (size_t index = 0; index < entryList.size(); index++) {
+				const uint32 tag = tagOf(entryList[index]().freeKeyData);
+				size_t i = tag & mask;
+				while (slotList[i] != 0) i = (i + 1) & mask;
+				slotList[i] = ((ulong64)tag << 32) | (index + 1);
+			}
+		}
+
+	public:
+
+		typedef std::vector<TKeyEntryInfo>::iterator iterator;
+
+		iterator begin() {
+			return entryList.begin();
+		}
+
+		iterator end() {
+			return entryList.end();
+		}
+
+		size_t size() const {
+			return entryList.size();
+		}
+
+		void clear() {
+			std::vector<ulong64>().swap(slotList);
+			std::vector<TKeyEntryInfo>().swap(entryList);
+			mask = 0;
+		}
+
+		// raw arrays for index snapshot
+		const std::vector<ulong64>& slots() const {
+			return slotList;
+		}
+
+		const std::vector<TKeyEntryInfo>& entries() const {
+			return entryList;
+		}
+
+		// saved slots are valid only for the same key hash and entry layout
+		static ulong64 layoutCheck() {
+			TKeyData keyData = {};
+			for (size_t i = 0; i < keyData.size(); i++) keyData[i] = (byte)(i * 37 + 1);
+			return ((ulong64)tagOf(keyData) << 32) | (uint32)sizeof(TKeyEntryInfo);
+		}
+
+		// take arrays saved from slots() and entries() without inserting keys one by one.
+		// false if they don't fit together, index is left unchanged then
+		bool assign(std::vector<ulong64>& slots, std::vector<TKeyEntryInfo>& entries) {
+			const size_t slotCount = slots.size();
+			if ((slotCount & (slotCount - 1)) != 0 || slotCount * 3 < entries.size() * 4) return false;
+			if (slotCount == 0 && !entries.empty()) return false;
+
+			// every entry has a slot. tags are not checked against keys, that costs more than the rest of the load
+			size_t usedCount = 0;
+			for (const ulong64 slot : slots) {
+				if (slot == 0) continue;
+				if ((uint32)slot > entries.size()) return false;
+				usedCount++;
+			}
+
+			if (usedCount != entries.size()) return false;
+
+			std::swap(slotList, slots);
+			std::swap(entryList, entries);
+			mask = (slotCount > 0) ? slotCount - 1 : 0;
+			return true;
+		}
+
+		// load factor stays under 3/4
+		void reserve(size_t keyCount) {
+			if (entryList.capacity() < keyCount) {
+				entryList.reserve(std::max(keyCount, entryList.capacity() * 2));
+			}
+
+			size_t capacity = 16;
+			while (capacity * 3 < keyCount * 4) capacity <<= 1;
+			if (capacity > slotList.size()) rehash(capacity);
+		}
+
+		TKeyEntryInfo* find(const TKeyData& keyData) {
+			if (entryList.empty()) return nullptr;
+			const ulong64 slot = slotList[slotOf(keyData)];
+			return (slot != 0) ? &entryList[(uint32)slot - 1] : nullptr;
+		}
+
+		const TKeyEntryInfo* find(const TKeyData& keyData) const {
+			if (entryList.empty()) return nullptr;
+			const ulong64 slot = slotList[slotOf(keyData)];
+			return (slot != 0) ? &entryList[(uint32)slot - 1] : nullptr;
+		}
+
+		bool contains(const TKeyData& keyData) const {
+			return find(keyData) != nullptr;
+		}
+
+		// insert or replace entry of key keyInfo().freeKeyData
+		void insert(const TKeyEntryInfo& keyInfo) {
+			TKeyEntryInfo* oldInfo = find(keyInfo().freeKeyData);
+			if (oldInfo != nullptr) {
+				*oldInfo = keyInfo;
+				return;
+			}
+
+			reserve(entryList.size() + 1);
+			const size_t i = slotOf(keyInfo().freeKeyData);
+			entryList.push_back(keyInfo);
+			slotList[i] = ((ulong64)tagOf(keyInfo().freeKeyData) << 32) | entryList.size();
+		}
+
+		bool erase(const TKeyData& keyData) {
+			if (entryList.empty()) return false;
+
+			size_t i = slotOf(keyData);
+			if (slotList[i] == 0) return false;
+			const size_t index = (uint32)slotList[i] - 1;
+
+			// backward shift: slot can fill the hole if its home is not in cyclic range (i, j]
+			for (size_t j = (i + 1) & mask; slotList[j] != 0; j = (j + 1) & mask) {
+				const size_t home = (size_t)(slotList[j] >> 32) & mask;
+				const bool bInRange = (i < j) ? (home > i && home <= j) : (home > i || home <= j);
+				if (!bInRange) {
+					slotList[i] = slotList[j];
+					i = j;
+				}
+			}
+
+			slotList[i] = 0;
+
+			// last entry fills the gap in entry array
+			const size_t last = entryList.size() - 1;
+			if (index != last) {
+				const ulong64 lastTag = tagOf(entryList[last]().freeKeyData);
+				size_t k = lastTag & mask;
+				while ((uint32)slotList[k] != last + 1) k = (k + 1) & mask;
+
+				slotList[k] = (lastTag << 32) | (index + 1);
+				entryList[index] = entryList[last];
+			}
+
+			entryList.pop_back();
+			return true;
+		}
+	};
+
+	inline std::ostream* operator << (std::ostream* os, const TKeyEntry& obj) {
+		write(os, obj);
+		return os;
+	}
+
+	inline std::istream* operator >> (std::istream* is, TKeyEntry& obj) {
+		read(is, obj);
+		return is;
+	}
+
+	//============================================================================
+	// Write batch result
+	//============================================================================
+	typedef struct TWriteBatchResult {
+		ulong64 putCount = 0;
+		ulong64 eraseCount = 0;
+		ulong64 appendedBytes = 0;
+		ulong64 rewrittenBytes = 0;
+		ulong64 keyEntryCount = 0;
+		// puts which outgrew slot of the key and moved
+		ulong64 relocatedCount = 0;
+		double commitTimeMs = 0;
+	} TWriteBatchResult;
+
+	//============================================================================
+	// Index snapshot
+	//============================================================================
+
+	// sidecar file with whole key index. followed by raw table infos, probe slots and live entries
+	// of key index, then reserved and deleted entries. valid only for the same file generation, timestamp and size
+	typedef struct TIndexSnapshotHeader {
+		uint32 magic = KVDB_INDEX_MAGIC;
+		uint32 generation = 0;
+		ulong64 timestamp = 0;
+		ulong64 fileSize = 0;
+		ulong64 tableCount = 0;
+		ulong64 slotCount = 0;
+		ulong64 liveCount = 0;
+		ulong64 entryCount = 0; // live entries included
+		ulong64 layoutCheck = 0;
+	} TIndexSnapshotHeader;
+
+	//============================================================================
+	// Write-behind queue statistics
+	//============================================================================
+	typedef struct TWriteBehindStats {
+		// waiting for writer and being written now
+		ulong64 queueKeys = 0;
+		ulong64 queueBytes = 0;
+
+		ulong64 drainedKeys = 0;
+		ulong64 drainedBytes = 0;
+		double drainTimeMs = 0;
+
+		// writer throughput, bytes per second
+		double drainRate() const {
+			return (drainTimeMs > 0) ? (double)drainedBytes / (drainTimeMs / 1000) : 0;
+		}
+	} TWriteBehindStats;
+
+	//============================================================================
+	// Space usage
+	//============================================================================
+	typedef struct TSpaceUsage {
+		ulong64 fileSize = 0;
+
+		// value data of live pairs
+		ulong64 liveBytes = 0;
+
+		// unused tail of live pair slots
+		ulong64 slackBytes = 0;
+
+		// slots of deleted pairs
+		ulong64 freeBytes = 0;
+		ulong64 freeSlotCount = 0;
+
+		// value data of pairs sharing slot of other pair, not stored again
+		ulong64 sharedBytes = 0;
+		ulong64 sharedKeyCount = 0;
+
+		// value data stored inside key entries
+		ulong64 inlineBytes = 0;
+		ulong64 inlineKeyCount = 0;
+
+		ulong64 wastedBytes() const {
+			return slackBytes + freeBytes;
+		}
+	} TSpaceUsage;
+
+	//============================================================================
+	// Statistics
+	//============================================================================
+
+	// power of two buckets: bucket 0 - zero, bucket i - [2^(i-1), 2^i)
+	#define KVDB_HISTOGRAM_SIZE 40
+
+	typedef struct THistogram {
+		ulong64 count = 0;
+		ulong64 sum = 0;
+		std::array<ulong64, KVDB_HISTOGRAM_SIZE> buckets = {};
+
+		static int bucketIndex(ulong64 val) {
+			int index = 0;
+			while (val > 0 && index < KVDB_HISTOGRAM_SIZE - 1) {
+				val >>= 1;
+				index++;
+			}
+
+			return index;
+		}
+
+		void add(ulong64 val) {
+			count++;
+			sum += val;
+			buckets[bucketIndex(val)]++;
+		}
+
+		double mean() const {
+			return (count > 0) ? (double)sum / (double)count : 0;
+		}
+
+		// upper bound of bucket reaching given fraction of samples
+		ulong64 percentile(double fraction) const {
+			const double target = fraction * (double)count;
+			ulong64 acc = 0;
+			for (int i = 0; i < KVDB_HISTOGRAM_SIZE; i++) {
+				acc += buckets[i];
+				if (acc > 0 && (double)acc >= target) return (i == 0) ? 0 : ((ulong64)1 << i) - 1;
+			}
+
+			return 0;
+		}
+	} THistogram;
+
+	// histogram updated from many threads without lock
+	class TAtomicHistogram {
+
+	private:
+
+		std::atomic<ulong64> count{ 0 };
+		std::atomic<ulong64> sum{ 0 };
+		std::array<std::atomic<ulong64>, KVDB_HISTOGRAM_SIZE> buckets{};
+
+	public:
+
+		void add(ulong64 val) {
+			count.fetch_add(1, std::memory_order_relaxed);
+			sum.fetch_add(val, std::memory_order_relaxed);
+			buckets[THistogram::bucketIndex(val)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		THistogram snapshot() const {
+			THistogram res;
+			res.count = count.load(std::memory_order_relaxed);
+			res.sum = sum.load(std::memory_order_relaxed);
+			for (int i = 0; i < KVDB_HISTOGRAM_SIZE; i++) {
+				res.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+			}
+
+			return res;
+		}
+
+		void reset() {
+			count = 0;
+			sum = 0;
+			for (auto& bucket : buckets) bucket = 0;
+		}
+	};
+
+	// adds lifetime of scope in nanoseconds to histogram
+	class TScopeTimer {
+
+	private:
+
+		TAtomicHistogram& histogram;
+		const std::chrono::steady_clock::time_point start;
+
 	public:
 
-		KvFile() {
-			assert(sizeof(K) <= KVDB_KEY_SIZE);
+		TScopeTimer(TAtomicHistogram& h) : histogram(h), start(std::chrono::steady_clock::now()) { }
+
+		~TScopeTimer() {
+			histogram.add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+	};
+
+	typedef struct TFileStats {
+		TSpaceUsage space;
+
+		ulong64 keyCount = 0;
+
+		// free key entries, new keys go there without table growth
+		ulong64 reservedKeyCount = 0;
+
+		// length of key table chain
+		ulong64 tableCount = 0;
+
+		// keys relocated since open, they get adaptive slack
+		ulong64 hotKeyCount = 0;
+
+		// bytes, one sample per stored key
+		THistogram valueSize;
+
+		// values served by file or value cache
+		ulong64 readKeys = 0;
+		ulong64 readBytes = 0;
+
+		ulong64 writtenKeys = 0;
+		ulong64 writtenBytes = 0;
+
+		// nanoseconds. read - per loadData(), loadView() or loadMany() call, write - per commit
+		THistogram readLatency;
+		THistogram writeLatency;
+
+		// nanoseconds, contended lock acquisitions only
+		THistogram readLockWait;
+		THistogram writeLockWait;
+
+		TCacheStats valueCache;
+		TWriteBehindStats writeBehind;
+
+		std::string toJson() const {
+			std::string json = "{";
+			bool bFirst = true;
+
+			auto key = [&](const char* name) {
+				if (!bFirst) json += ",";
+				bFirst = false;
+				json += "\"";
+				json += name;
+				json += "\":";
+			};
+
+			auto num = [&](const char* name, ulong64 val) {
+				key(name);
+				json += std::to_string(val);
+			};
+
+			auto real = [&](const char* name, double val) {
+				key(name);
+				char buf[32];
+				snprintf(buf, sizeof(buf), "%.3f", val);
+				json += buf;
+			};
+
+			auto histogram = [&](const char* name, const THistogram& h) {
+				key(name);
+				json += "{\"count\":" + std::to_string(h.count);
+				json += ",\"sum\":" + std::to_string(h.sum);
+				json += ",\"p50\":" + std::to_string(h.percentile(0.5));
+				json += ",\"p99\":" + std::to_string(h.percentile(0.99));
+				json += ",\"buckets\":[";
+
+				// trailing empty buckets are omitted
+				int last = KVDB_HISTOGRAM_SIZE - 1;
+				while (last >= 0 && h.buckets[last] == 0) last--;
+				for (int i = 0; i <= last; i++) {
+					if (i > 0) json += ",";
+					json += std::to_string(h.buckets[i]);
+				}
+
+				json += "]}";
+			};
+
+			num("fileSize", space.fileSize);
+			num("liveBytes", space.liveBytes);
+			num("deadBytes", space.wastedBytes());
+			num("slackBytes", space.slackBytes);
+			num("freeBytes", space.freeBytes);
+			num("freeSlotCount", space.freeSlotCount);
+			num("sharedBytes", space.sharedBytes);
+			num("sharedKeyCount", space.sharedKeyCount);
+			num("inlineBytes", space.inlineBytes);
+			num("inlineKeyCount", space.inlineKeyCount);
+			num("keyCount", keyCount);
+			num("reservedKeyCount", reservedKeyCount);
+			num("tableCount", tableCount);
+			num("hotKeyCount", hotKeyCount);
+			histogram("valueSize", valueSize);
+			num("readKeys", readKeys);
+			num("readBytes", readBytes);
+			num("writtenKeys", writtenKeys);
+			num("writtenBytes", writtenBytes);
+			histogram("readLatencyNs", readLatency);
+			histogram("writeLatencyNs", writeLatency);
+			histogram("readLockWaitNs", readLockWait);
+			histogram("writeLockWaitNs", writeLockWait);
+			num("valueCacheHits", valueCache.hits);
+			num("valueCacheMisses", valueCache.misses);
+			num("valueCacheBytes", valueCache.bytes);
+			num("writeBehindQueueKeys", writeBehind.queueKeys);
+			num("writeBehindQueueBytes", writeBehind.queueBytes);
+			real("writeBehindDrainRate", writeBehind.drainRate());
+
+			json += "}";
+			return json;
+		}
+	} TFileStats;
+
+	//============================================================================
+	// Compaction
+	//============================================================================
+	typedef struct TCompactionBudget {
+		// disk read/write rate limit. 0 - unlimited
+		ulong64 bytesPerSecond = 0;
+
+		// value data copied under one shared lock
+		ulong64 stepBytes = 4 * 1024 * 1024;
+
+		// checked between steps
+		std::function<bool()> isCancelled = nullptr;
+
+		// how long the swap waits for open snapshots to be released
+		ulong64 snapshotWaitMs = 5000;
+	} TCompactionBudget;
+
+	typedef struct TCompactionResult {
+		bool bSuccess = false;
+		ulong64 keyCount = 0;
+		ulong64 recopiedKeyCount = 0;
+		ulong64 oldFileSize = 0;
+		ulong64 newFileSize = 0;
+		double timeMs = 0;
+		// cancelled because snapshots were not released in time
+		bool bSnapshotTimeout = false;
+	} TCompactionResult;
+
+	template <typename K, typename V>
+	class KvFileBuilder;
+
+	template <typename K>
+	class KvContainer;
+
+	//============================================================================
+	// File db
+	//============================================================================
+	template <typename K, typename V>
+	class KvFile {
+
+	private:
+
+		TKeyIndex dataMap;
+		std::string fileName;
+		std::fstream* filePtr = nullptr;
+		TFileHeader fileHeader;
+		TReadFile readFile;
+		std::list<TKeyEntryInfo> reservedKeyList;
+		// deleted pairs by slot length, for best-fit reuse
+		std::multimap<ulong64, TKeyEntryInfo> deletedKeyMap;
+		std::list<TTableHeaderInfo> tableList;
+		// shared for lookups and reads, exclusive for index and file mutation
+		mutable std::shared_timed_mutex fileSharedMutex;
+		
+		uint32 reservedKeys = KVDB_RESERVED_TABLE_SIZE;
+		uint32 reservedValueSize = 0;
+
+		// values up to this size are kept in key entry, found with the key and read without file access
+		uint32 inlineValueSize = KVDB_INLINE_MAX_SIZE;
+
+		// keys which outgrew their slot since open, by relocation count. 
+		// hot keys get slack growing with each relocation, other keys are packed tightly
+		bool bAdaptiveSlack = true;
+		std::unordered_map<TKeyData, uint32> relocationMap;
+
+		bool bMemoryMapped = false;
+		TMappedRegionPtr mappedRegion;
+
+		// one compaction at a time
+		std::mutex compactionMutex;
+
+		// keys changed while compaction is running. guarded by fileSharedMutex:
+		// writers modify it under exclusive lock, compaction under shared lock 
+		std::unique_ptr<std::unordered_set<TKeyData>> compactionChangedKeys;
+
+		// file changed since open or last index snapshot
+		bool bIndexChanged = false;
+		bool bIndexFromSnapshot = false;
+		// snapshot file on disk matches index, close() doesn't rewrite it
+		bool bIndexSnapshotSaved = false;
+
+		// answers isExist without lock. updated after index change is complete,
+		// so relocated pair never looks missing
+		TPresenceFilter presenceFilter;
+
+		// existing keys in morton order for box queries. sorted on the first query after open or 
+		// after too many changes, keys added in between are kept aside, erased keys are skipped by lookup
+		std::vector<std::pair<ulong64, TKeyData>> mortonIndex;
+		std::unordered_set<TKeyData> mortonAddedSet;
+		size_t mortonErasedCount = 0;
+		// set under mortonMutex by the first query holding shared lock, reset under exclusive lock
+		std::atomic<bool> bMortonIndexValid{ false };
+		std::mutex mortonMutex;
+
+		// raw value data, disabled by default. 
+		// filled under shared lock and invalidated under exclusive lock, so it never holds stale data
+		TLruCache<TKeyData, TValueData> valueCache;
+
+		// value slot which other pairs may point to
+		typedef struct TSharedSlot {
+			ulong64 hash = 0;
+			ulong64 length = 0;
+			std::unordered_set<TKeyData> keySet; // pairs pointing to slot, slot owner included
+		} TSharedSlot;
+
+		// identical small values are stored once. slots are tracked for deduplicated values
+		// written since open and for all slots already shared in file
+		bool bDeduplication = false;
+		std::unordered_map<ulong64, TSharedSlot> sharedSlotMap; // by data position
+		std::unordered_map<ulong64, ulong64> contentMap; // content hash -> data position
+
+		// write-behind queue: pending - waiting for writer thread, inflight - being written now.
+		// reads look here first. nullptr value - erase
+		std::atomic<bool> bWriteBehind{ false };
+		std::thread writerThread;
+		std::mutex pendingMutex;
+		std::condition_variable pendingCondition;
+		std::unordered_map<TKeyData, TValueDataPtr> pendingMap;
+		std::unordered_map<TKeyData, TValueDataPtr> inflightMap;
+		std::atomic<size_t> overlaySize{ 0 };
+		ulong64 pendingBytes = 0;
+		ulong64 inflightBytes = 0;
+		bool bWriterStop = false;
+		TWriteBehindStats writeBehindStats;
+
+		// serializes writers. value data of a batch is written under shared lock, so loads keep going,
+		// index changes are published under exclusive lock. lock order: writerMutex, fileSharedMutex
+		std::mutex writerMutex;
+
+		// pinned index version of read snapshot
+		typedef struct TSnapshotState {
+			ulong64 version = 0;
+			// entries of keys changed after snapshot, before the first change. dataLength == 0 - key did not exist
+			std::unordered_map<TKeyData, TKeyEntry> undoMap;
+			// write-behind queue at snapshot time
+			std::unordered_map<TKeyData, TValueDataPtr> overlayMap;
+		} TSnapshotState;
+
+		std::mutex snapshotMutex;
+		std::list<std::weak_ptr<TSnapshotState>> snapshotList;
+		// published index version, incremented by each commit
+		ulong64 commitVersion = 0;
+		// set for commit while any snapshot or mapped view is alive: no in-place rewrites, freed slots are retired
+		bool bSnapshotPinned = false;
+		// raised by compaction for the file swap, new snapshots wait until it is lowered
+		bool bSnapshotBarrier = false;
+		std::condition_variable snapshotCondition;
+
+		// backing memory of mapped views and index version they were read from. views read at the same version
+		// from the same mapping share one guard, its use count keeps slots they point to from being rewritten or reused
+		typedef struct TViewGuard {
+			TMappedRegionPtr region;
+			ulong64 version = 0;
+		} TViewGuard;
+
+		// guarded by snapshotMutex
+		std::list<std::weak_ptr<TViewGuard>> viewGuardList;
+
+		// slots freed while snapshots were alive, by commit version. reused when no older snapshot is left
+		std::list<std::pair<ulong64, TKeyEntryInfo>> retiredList;
+
+		// statistics, updated without lock
+		std::atomic<ulong64> readKeyCount{ 0 };
+		std::atomic<ulong64> readByteCount{ 0 };
+		std::atomic<ulong64> writtenKeyCount{ 0 };
+		std::atomic<ulong64> writtenByteCount{ 0 };
+		TAtomicHistogram readLatency;
+		TAtomicHistogram writeLatency;
+		TAtomicHistogram readLockWait;
+		TAtomicHistogram writeLockWait;
+
+	private:
+
+		// uncontended lock costs no clock reads
+		std::shared_lock<std::shared_timed_mutex> sharedLock() {
+			std::shared_lock<std::shared_timed_mutex> guard(fileSharedMutex, std::try_to_lock);
+			if (!guard.owns_lock()) {
+				TScopeTimer timer(readLockWait);
+				guard.lock();
+			}
+
+			return guard;
+		}
+
+		std::unique_lock<std::shared_timed_mutex> exclusiveLock() {
+			std::unique_lock<std::shared_timed_mutex> guard(fileSharedMutex, std::try_to_lock);
+			if (!guard.owns_lock()) {
+				TScopeTimer timer(writeLockWait);
+				guard.lock();
+			}
+
+			return guard;
+		}
+
+		void countRead(ulong64 bytes) {
+			readKeyCount.fetch_add(1, std::memory_order_relaxed);
+			readByteCount.fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		void markChanged(const TKeyData& keyData) {
+			if (compactionChangedKeys) {
+				compactionChangedKeys->insert(keyData);
+			}
+
+			const bool bExist = dataMap.contains(keyData);
+			presenceFilter.set(keyData, bExist);
+			valueCache.erase(keyData);
+
+			if (!bMortonIndexValid) return;
+
+			if (bExist) {
+				if (!std::binary_search(mortonIndex.begin(), mortonIndex.end(), std::make_pair(mortonCode(keyData), keyData))) {
+					mortonAddedSet.insert(keyData);
+				}
+			} else if (mortonAddedSet.erase(keyData) == 0) {
+				mortonErasedCount++;
+			}
+
+			if (mortonAddedSet.size() + mortonErasedCount > mortonIndex.size() / 8 + 1024) {
+				invalidateMortonIndex();
+			}
+		}
+
+		// expects exclusive lock
+		void invalidateMortonIndex() {
+			bMortonIndexValid = false;
+			mortonIndex.clear();
+			mortonAddedSet.clear();
+			mortonErasedCount = 0;
+		}
+
+		// expects lock. readers build it once, writers change it only under exclusive lock
+		void buildMortonIndex() {
+			if (bMortonIndexValid.load(std::memory_order_acquire)) return;
+
+			std::lock_guard<std::mutex> guard(mortonMutex);
+			if (bMortonIndexValid.load(std::memory_order_relaxed)) return;
+
+			mortonIndex.clear();
+			mortonIndex.reserve(dataMap.size());
+			for (const auto& keyInfo : dataMap) {
+				mortonIndex.push_back({ mortonCode(keyInfo().freeKeyData), keyInfo().freeKeyData });
+			}
+
+			std::sort(mortonIndex.begin(), mortonIndex.end());
+			mortonAddedSet.clear();
+			mortonErasedCount = 0;
+			bMortonIndexValid.store(true, std::memory_order_release);
+		}
+
+		// existing keys inside box including write-behind queue.
+		// queue is locked during index walk, so writer can't retire queued keys in between
+		void collectInBox(const K& minKey, const K& maxKey, std::vector<TKeyData>& keyList) {
+			std::unique_lock<std::mutex> pendingGuard(pendingMutex, std::defer_lock);
+			if (overlaySize > 0) pendingGuard.lock();
+
+			{
+				auto guard = sharedLock();
+				visitBox(minKey, maxKey, [&](const TKeyData& keyData) {
+					keyList.push_back(keyData);
+				});
+			}
+
+			if (!pendingGuard.owns_lock() || (pendingMap.empty() && inflightMap.empty())) return;
+
+			int32_t minXyz[3], maxXyz[3];
+			std::memcpy(minXyz, toKeyData(minKey).data(), sizeof(minXyz));
+			std::memcpy(maxXyz, toKeyData(maxKey).data(), sizeof(maxXyz));
+
+			std::unordered_set<TKeyData> keySet(keyList.begin(), keyList.end());
+			for (const auto* queueMap : { &inflightMap, &pendingMap }) {
+				for (const auto& itm : *queueMap) {
+					if (!isKeyInBox(itm.first, minXyz, maxXyz)) continue;
+
+					if (itm.second) {
+						keySet.insert(itm.first);
+					} else {
+						keySet.erase(itm.first);
+					}
+				}
+			}
+
+			keyList.assign(keySet.begin(), keySet.end());
+		}
+
+		// visit existing keys inside box in morton order. expects lock
+		template <typename F>
+		void visitBox(const K& minKey, const K& maxKey, F func) {
+			const TKeyData minKeyData = toKeyData(minKey);
+			const TKeyData maxKeyData = toKeyData(maxKey);
+
+			int32_t minXyz[3], maxXyz[3];
+			std::memcpy(minXyz, minKeyData.data(), sizeof(minXyz));
+			std::memcpy(maxXyz, maxKeyData.data(), sizeof(maxXyz));
+
+			const ulong64 zmin = mortonCode(minKeyData);
+			const ulong64 zmax = mortonCode(maxKeyData);
+			if (zmin > zmax) return;
+
+			buildMortonIndex();
+
+			// keys added after sort are merged in by code
+			std::vector<std::pair<ulong64, TKeyData>> addedList;
+			for (const TKeyData& keyData : mortonAddedSet) {
+				if (isKeyInBox(keyData, minXyz, maxXyz)) addedList.push_back({ mortonCode(keyData), keyData });
+			}
+
+			std::sort(addedList.begin(), addedList.end());
+			auto addedItr = addedList.begin();
+
+			auto lowerBound = [&](ulong64 code) {
+				return std::lower_bound(mortonIndex.begin(), mortonIndex.end(), std::make_pair(code, TKeyData()));
+			};
+
+			auto itr = lowerBound(zmin);
+			while (itr != mortonIndex.end() && itr->first <= zmax) {
+				if (isKeyInBox(itr->second, minXyz, maxXyz)) {
+					for (; addedItr != addedList.end() && *addedItr < *itr; ++addedItr) func(addedItr->second);
+					if (mortonErasedCount == 0 || dataMap.contains(itr->second)) func(itr->second);
+					++itr;
+				} else {
+					// jump over the part of z-curve outside of the box
+					const ulong64 next = mortonBigMin(itr->first, zmin, zmax);
+					if (next <= itr->first) {
+						++itr;
+					} else {
+						itr = lowerBound(next);
+					}
+				}
+			}
+
+			for (; addedItr != addedList.end(); ++addedItr) func(addedItr->second);
+		}
+
+		// first change after open or checkpoint makes index snapshot stale
+		void beginChange() {
+			if (bIndexChanged) return;
+
+			fileHeader.version = KVDB_FILE_VERSION;
+			fileHeader.generation++;
+			writeFileHeader();
+			bIndexChanged = true;
+			bIndexSnapshotSaved = false;
+		}
+
+		void writeFileHeader() {
+			filePtr->seekp(0);
+			filePtr << fileHeader;
+			filePtr->flush();
+		}
+
+		ulong64 fileSize() {
+			filePtr->flush();
+			filePtr->seekg(0, std::ios::end);
+			return (ulong64)filePtr->tellg();
+		}
+
+		std::string indexSnapshotFileName() const {
+			return fileName + ".idx";
+		}
+
+		void readIndex() {
+			filePtr->clear();
+			filePtr->seekg(0);
+			filePtr >> fileHeader;
+
+			if (fileHeader.version < 2) {
+				fileHeader.generation = 0; // not used in version 1
+			}
+
+			bIndexChanged = false;
+			bIndexFromSnapshot = readIndexSnapshot();
+			bIndexSnapshotSaved = bIndexFromSnapshot;
+
+			if (!bIndexFromSnapshot) {
+				filePtr->clear();
+				filePtr->seekg((fileHeader.endOfHeaderOffset > 0) ? fileHeader.endOfHeaderOffset : sizeof(TFileHeader));
+
+				ulong64 nextTablePos = readTable();
+				while (nextTablePos > 0) {
+					filePtr->seekg(nextTablePos);
+					nextTablePos = readTable();
+				}
+			}
+
+			readSharedSlots();
+		}
+
+		// slots shared by several pairs. only they are hashed on open, other values are hashed when written again
+		void readSharedSlots() {
+			std::unordered_set<ulong64> sharedPosSet;
+			for (const auto& keyInfo : dataMap) {
+				if (keyInfo().initialDataLength == 0 && !isInlineEntry(keyInfo())) {
+					sharedPosSet.insert(keyInfo().dataPos);
+				}
+			}
+
+			if (sharedPosSet.empty()) return;
+
+			std::unordered_set<ulong64> ownedPosSet;
+			std::map<ulong64, TKeyEntry> repairedKeyMap;
+			for (auto& keyInfo : dataMap) {
+				TKeyEntry& e = keyInfo();
+				if (isInlineEntry(e) || sharedPosSet.count(e.dataPos) == 0) continue;
+
+				TSharedSlot& slot = sharedSlotMap[e.dataPos];
+				slot.length = e.dataLength;
+				slot.keySet.insert(e.freeKeyData);
+
+				if (e.initialDataLength > 0) {
+					ownedPosSet.insert(e.dataPos);
+				}
+			}
+
+			for (auto& itm : sharedSlotMap) {
+				TValueData slotData(itm.second.length);
+				filePtr->clear();
+				filePtr->seekg(itm.first);
+				filePtr->read((char*)slotData.data(), slotData.size());
+
+				itm.second.hash = contentHash(slotData.data(), slotData.size());
+				contentMap.insert({ itm.second.hash, itm.first });
+
+				// owner was lost, slot is at least as long as value
+				if (ownedPosSet.count(itm.first) == 0) {
+					TKeyEntryInfo& heirInfo = *dataMap.find(*itm.second.keySet.begin());
+					heirInfo().initialDataLength = itm.second.length;
+					repairedKeyMap[heirInfo.pos] = heirInfo();
+				}
+			}
+
+			if (repairedKeyMap.empty()) return;
+
+			// so the slot is not left without owner in file, and index snapshot is saved again
+			beginChange();
+			writeKeyEntries(repairedKeyMap);
+			filePtr->flush();
+		}
+
+		// load key index as it was saved, without table walk and inserting keys. 
+		// false if there is no snapshot or it is stale
+		bool readIndexSnapshot() {
+			if (fileHeader.version < 2) return false;
+
+			std::ifstream inFile(indexSnapshotFileName(), std::ios::in | std::ios::binary | std::ios::ate);
+			if (!inFile) return false;
+
+			const ulong64 snapshotSize = (ulong64)inFile.tellg();
+			if (snapshotSize < sizeof(TIndexSnapshotHeader)) return false;
+
+			TIndexSnapshotHeader snapshotHeader;
+			inFile.seekg(0);
+			if (!inFile.read((char*)&snapshotHeader, sizeof(snapshotHeader))) return false;
+
+			if (snapshotHeader.magic != KVDB_INDEX_MAGIC || snapshotHeader.generation != fileHeader.generation ||
+				snapshotHeader.timestamp != fileHeader.timestamp || snapshotHeader.fileSize != fileSize() ||
+				snapshotHeader.layoutCheck != TKeyIndex::layoutCheck()) {
+				return false;
+			}
+
+			if (snapshotHeader.tableCount == 0 || snapshotHeader.liveCount > snapshotHeader.entryCount) return false;
+			if (snapshotSize != sizeof(TIndexSnapshotHeader) + snapshotHeader.tableCount * sizeof(TTableHeaderInfo) +
+				snapshotHeader.slotCount * sizeof(ulong64) + snapshotHeader.entryCount * sizeof(TKeyEntryInfo)) {
+				return false;
+			}
+
+			std::vector<TTableHeaderInfo> tables(snapshotHeader.tableCount);
+			std::vector<ulong64> slots(snapshotHeader.slotCount);
+			std::vector<TKeyEntryInfo> liveEntries(snapshotHeader.liveCount);
+			std::vector<TKeyEntryInfo> otherEntries(snapshotHeader.entryCount - snapshotHeader.liveCount);
+
+			inFile.read((char*)tables.data(), tables.size() * sizeof(TTableHeaderInfo));
+			inFile.read((char*)slots.data(), slots.size() * sizeof(ulong64));
+			inFile.read((char*)liveEntries.data(), liveEntries.size() * sizeof(TKeyEntryInfo));
+			inFile.read((char*)otherEntries.data(), otherEntries.size() * sizeof(TKeyEntryInfo));
+			if (!inFile) return false;
+
+			ulong64 recordCount = 0;
+			for (const auto& tableInfo : tables) {
+				recordCount += tableInfo().recordCount;
+			}
+
+			if (recordCount != snapshotHeader.entryCount) return false;
+			for (const auto& keyInfo : liveEntries) {
+				if (keyInfo().dataLength == 0) return false;
+			}
+
+			if (!dataMap.assign(slots, liveEntries)) return false;
+
+			tableList.assign(tables.begin(), tables.end());
+			for (const auto& keyInfo : dataMap) {
+				presenceFilter.set(keyInfo().freeKeyData, true);
+			}
+
+			for (const auto& keyInfo : otherEntries) {
+				addKeyEntry(keyInfo);
+			}
+
+			return true;
+		}
+
+		bool writeIndexSnapshot() {
+			if (fileHeader.version < 2) {
+				fileHeader.version = KVDB_FILE_VERSION;
+				writeFileHeader();
+			}
+
+			TIndexSnapshotHeader snapshotHeader;
+			snapshotHeader.generation = fileHeader.generation;
+			snapshotHeader.timestamp = fileHeader.timestamp;
+			snapshotHeader.fileSize = fileSize();
+			snapshotHeader.tableCount = tableList.size();
+			snapshotHeader.slotCount = dataMap.slots().size();
+			snapshotHeader.liveCount = dataMap.size();
+			snapshotHeader.layoutCheck = TKeyIndex::layoutCheck();
+			snapshotHeader.entryCount = dataMap.size() + reservedKeyList.size() + deletedKeyMap.size() + retiredList.size();
+
+			std::vector<byte> buffer;
+			buffer.reserve(sizeof(snapshotHeader) + snapshotHeader.tableCount * sizeof(TTableHeaderInfo) +
+				snapshotHeader.slotCount * sizeof(ulong64) + snapshotHeader.entryCount * sizeof(TKeyEntryInfo));
+
+			auto append = [&](const void* ptr, size_t length) {
+				buffer.insert(buffer.end(), (const byte*)ptr, (const byte*)ptr + length);
+			};
+
+			append(&snapshotHeader, sizeof(snapshotHeader));
+			for (const auto& tableInfo : tableList) append(&tableInfo, sizeof(tableInfo));
+			append(dataMap.slots().data(), dataMap.slots().size() * sizeof(ulong64));
+			append(dataMap.entries().data(), dataMap.entries().size() * sizeof(TKeyEntryInfo));
+			for (const auto& keyInfo : reservedKeyList) append(&keyInfo, sizeof(keyInfo));
+			for (const auto& itm : deletedKeyMap) append(&itm.second, sizeof(TKeyEntryInfo));
+			// freed slots still read by snapshots are deleted pairs in file
+			for (const auto& itm : retiredList) append(&itm.second, sizeof(TKeyEntryInfo));
+
+			const std::string tempFileName = indexSnapshotFileName() + ".tmp";
+			std::ofstream outFile(tempFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!outFile) return false;
+
+			outFile.write((char*)buffer.data(), buffer.size());
+			outFile.close();
+			if (!outFile.fail()) syncFile(tempFileName);
+			if (outFile.fail() || !replaceFile(tempFileName, indexSnapshotFileName())) {
+				std::remove(tempFileName.c_str());
+				return false;
+			}
+
+			bIndexChanged = false;
+			bIndexSnapshotSaved = true;
+			return true;
+		}
+
+		static TValueDataPtr inlineValue(const TKeyEntry& e) {
+			TValueDataPtr dataPtr = TValueDataPtr(new TValueData(valueLength(e)));
+			getInlineValue(e, dataPtr->data());
+			return dataPtr;
+		}
+
+		// read value data through value cache. expects lock
+		TValueDataPtr readValue(const TKeyData& keyData, const TKeyEntry& e) {
+			if (isInlineEntry(e)) {
+				countRead(valueLength(e));
+				return inlineValue(e);
+			}
+
+			TValueDataPtr dataPtr = valueCache.get(keyData);
+			if (dataPtr) {
+				countRead(e.dataLength);
+				return dataPtr;
+			}
+
+			dataPtr = TValueDataPtr(new TValueData);
+			dataPtr->resize(e.dataLength);
+
+			// positional read, many readers can be here at the same time
+			if (!readFile.read(e.dataPos, dataPtr->data(), e.dataLength)) return nullptr;
+
+			valueCache.put(keyData, dataPtr, e.dataLength);
+			countRead(e.dataLength);
+			return dataPtr;
+		}
+
+		void clearIndex() {
+			dataMap.clear();
+			invalidateMortonIndex();
+			sharedSlotMap.clear();
+			contentMap.clear();
+			reservedKeyList.clear();
+			deletedKeyMap.clear();
+			tableList.clear();
+			retiredList.clear();
+		}
+
+		// index loaded by other instance from the same file. old index goes to other instance,
+		// so it is freed outside of lock. expects lock
+		void takeIndex(KvFile& other) {
+			fileHeader = other.fileHeader;
+			std::swap(dataMap, other.dataMap);
+			invalidateMortonIndex();
+			std::swap(sharedSlotMap, other.sharedSlotMap);
+			std::swap(contentMap, other.contentMap);
+			std::swap(reservedKeyList, other.reservedKeyList);
+			std::swap(deletedKeyMap, other.deletedKeyMap);
+			std::swap(tableList, other.tableList);
+			std::swap(retiredList, other.retiredList);
+			other.retiredList.clear();
+
+			bIndexChanged = false;
+			bIndexFromSnapshot = false;
+			bIndexSnapshotSaved = false;
+		}
+
+		void cancelCompaction(const std::string& tempFileName) {
+			auto guard = exclusiveLock();
+			compactionChangedKeys.reset();
+			std::remove(tempFileName.c_str());
+		}
+
+		// remap if the file grew over the mapped window. old region stays alive while views use it
+		void updateMapping() {
+			if (!bMemoryMapped) return;
+
+			const ulong64 fileSize = readFile.size();
+			if (mappedRegion && mappedRegion->size() >= fileSize) return;
+
+			const ulong64 mapSize = ((fileSize + fileSize / 2) / KVDB_MMAP_GRANULARITY + 1) * KVDB_MMAP_GRANULARITY;
+			mappedRegion = readFile.map(mapSize);
+		}
+
+		std::shared_ptr<V> valueFromData(TValueDataPtr dataPtr) {
+			if (dataPtr == nullptr) return nullptr;
+
+            if (std::is_same<V, TValueData>::value) { //constexpr
+				return std::static_pointer_cast<TValueData>(dataPtr);
+			} else {
+				V* temp = new V();
+				memcpy(temp, dataPtr->data(), dataPtr->size());
+				return std::shared_ptr<V>(temp);
+			}
+		}
+
+		static TKeyData toKeyData(const K& key) {
+			TKeyData keyData = {};
+			std::memcpy(keyData.data(), &key, sizeof(K));
+			return keyData;
+		}
+
+		static void toValueData(V value, TValueData& valueData) {
+			if (valueData.size() < sizeof(value)) valueData.resize(sizeof(value));
+			std::memcpy(valueData.data(), &value, sizeof(value));
+		}
+
+		void addKeyEntry(const TKeyEntryInfo& keyInfo) {
+			if (keyInfo().dataLength > 0) {
+				dataMap.insert(keyInfo);
+				presenceFilter.set(keyInfo().freeKeyData, true);
+			} else {
+				if (keyInfo().initialDataLength == 0) {
+					// reserved key slot
+					reservedKeyList.push_back(keyInfo);
+				} else {
+					// marked as deleted pair
+					addDeletedPair(keyInfo);
+				}
+			}
+		}
+
+		ulong64 readTable() {
+			ulong64 tablePos = (ulong64)filePtr->tellp();
+
+			TTableHeader tableHeader;
+			filePtr >> tableHeader;
+
+			// whole table with one read
+			const ulong64 entryPos = (ulong64)filePtr->tellg();
+			std::vector<TKeyEntry> entryList(tableHeader.recordCount);
+			filePtr->read((char*)entryList.data(), entryList.size() * sizeof(TKeyEntry));
+
+			dataMap.reserve(dataMap.size() + entryList.size());
+			for (size_t i = 0; i < entryList.size(); i++) {
+				addKeyEntry(TKeyEntryInfo(entryList[i], entryPos + i * sizeof(TKeyEntry)));
+			}
+
+			tableList.push_back(TTableHeaderInfo(tableHeader, tablePos));
+			return tableHeader.nextTable;
+		}
+
+		void createNewTable() {
+			filePtr->seekg(0, std::ios::end); // to end-of-file
+			ulong64 newTablePos = (ulong64)filePtr->tellp();
+
+			// write new table
+			TTableHeader newTable;
+			newTable.recordCount = reservedKeys;
+			newTable.nextTable = 0;
+			filePtr << newTable;
+
+			// write reserved keys
+			for (uint32 i = 0; i < reservedKeys; i++) {
+				ulong64 newReservedKeyPos = (ulong64)filePtr->tellp();
+
+				TKeyEntry newReservedKey;
+				filePtr << newReservedKey;
+
+				TKeyEntryInfo keyInfo(newReservedKey, newReservedKeyPos);
+				reservedKeyList.push_back(keyInfo);
+			}
+
+			// read previous last table 
+			TTableHeaderInfo& lastTable = tableList.back();
+			filePtr->seekg(lastTable.pos);
+
+			// add link to new table
+			lastTable().nextTable = newTablePos;
+
+			// rewrite previous last table
+			filePtr << lastTable();
+
+			// add new table to internal list
+			tableList.push_back(TTableHeaderInfo(newTable, newTablePos));
+		}
+
+		void addDeletedPair(const TKeyEntryInfo& keyInfo) {
+			deletedKeyMap.insert({ keyInfo().initialDataLength, keyInfo });
+		}
+
+		// freed value slot. alive snapshots may still read it
+		void retireSlot(const TKeyEntryInfo& keyInfo) {
+			if (bSnapshotPinned) {
+				retiredList.push_back({ commitVersion + 1, keyInfo });
+			} else {
+				addDeletedPair(keyInfo);
+			}
+		}
+
+		// oldest version pinned by alive snapshot or mapped view. false if there is none
+		bool oldestSnapshot(ulong64& version) {
+			std::lock_guard<std::mutex> guard(snapshotMutex);
+			bool bFound = false;
+
+			for (auto itr = snapshotList.begin(); itr != snapshotList.end();) {
+				std::shared_ptr<TSnapshotState> state = itr->lock();
+				if (!state) {
+					itr = snapshotList.erase(itr);
+					continue;
+				}
+
+				if (!bFound || state->version < version) version = state->version;
+				bFound = true;
+				++itr;
+			}
+
+			for (auto itr = viewGuardList.begin(); itr != viewGuardList.end();) {
+				std::shared_ptr<TViewGuard> viewGuard = itr->lock();
+				if (!viewGuard) {
+					itr = viewGuardList.erase(itr);
+					continue;
+				}
+
+				if (!bFound || viewGuard->version < version) version = viewGuard->version;
+				bFound = true;
+				++itr;
+			}
+
+			return bFound;
+		}
+
+		bool hasSnapshots() {
+			ulong64 version = 0;
+			return oldestSnapshot(version);
+		}
+
+		// snapshots reading by index entries. mapped views don't count
+		bool hasEntrySnapshots() {
+			std::lock_guard<std::mutex> guard(snapshotMutex);
+			for (const auto& weakState : snapshotList) {
+				if (!weakState.expired()) return true;
+			}
+
+			return false;
+		}
+
+		void setSnapshotBarrier(bool val) {
+			{
+				std::lock_guard<std::mutex> guard(snapshotMutex);
+				bSnapshotBarrier = val;
+			}
+
+			if (!val) snapshotCondition.notify_all();
+		}
+
+		// wait until snapshots reading by index entries are released. false on timeout or cancel
+		bool waitEntrySnapshots(const TCompactionBudget& budget) {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budget.snapshotWaitMs);
+			while (hasEntrySnapshots()) {
+				if (std::chrono::steady_clock::now() >= deadline) return false;
+				if (budget.isCancelled && budget.isCancelled()) return false;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+
+			return true;
+		}
+
+		// false if compaction is swapping the file
+		bool registerSnapshot(const std::shared_ptr<TSnapshotState>& state) {
+			std::lock_guard<std::mutex> guard(snapshotMutex);
+			if (bSnapshotBarrier) return false;
+
+			snapshotList.remove_if([](const std::weak_ptr<TSnapshotState>& weakState) { return weakState.expired(); });
+			snapshotList.push_back(state);
+			return true;
+		}
+
+		// guard for views into current mapping, read at index version. commit waits for exclusive lock, 
+		// so pin is in place before the index can change. expects lock
+		std::shared_ptr<const void> pinMappedViews(ulong64 version) {
+			std::lock_guard<std::mutex> guard(snapshotMutex);
+
+			for (auto itr = viewGuardList.rbegin(); itr != viewGuardList.rend(); ++itr) {
+				std::shared_ptr<TViewGuard> viewGuard = itr->lock();
+				if (viewGuard && viewGuard->version == version && viewGuard->region == mappedRegion) return viewGuard;
+			}
+
+			viewGuardList.remove_if([](const std::weak_ptr<TViewGuard>& weakGuard) { return weakGuard.expired(); });
+
+			std::shared_ptr<TViewGuard> viewGuard = std::make_shared<TViewGuard>();
+			viewGuard->region = mappedRegion;
+			viewGuard->version = version;
+			viewGuardList.push_back(viewGuard);
+			return viewGuard;
+		}
+
+		// retired slots which no alive snapshot can read become free. expects writerMutex
+		void reclaimRetired() {
+			if (retiredList.empty()) return;
+
+			ulong64 oldest = 0;
+			const bool bPinned = oldestSnapshot(oldest);
+
+			for (auto itr = retiredList.begin(); itr != retiredList.end();) {
+				if (!bPinned || itr->first <= oldest) {
+					addDeletedPair(itr->second);
+					itr = retiredList.erase(itr);
+				} else {
+					++itr;
+				}
+			}
+		}
+
+		// take smallest deleted pair with enough space
+		bool takeSuitableDeletedPair(ulong64 length, TKeyEntryInfo& keyInfo) {
+			auto itr = deletedKeyMap.lower_bound(length);
+			if (itr == deletedKeyMap.end()) return false;
+
+			keyInfo = itr->second;
+			deletedKeyMap.erase(itr);
+			return true;
+		}
+
+		// value slot size for key. expects lock
+		ulong64 slotLengthFor(const TKeyData& keyData, ulong64 length) const {
+			ulong64 slack = 0;
+
+			if (bAdaptiveSlack) {
+				auto got = relocationMap.find(keyData);
+				if (got != relocationMap.end()) {
+					const uint32 shift = KVDB_SLACK_MAX_SHIFT - std::min<uint32>(got->second - 1, KVDB_SLACK_MAX_SHIFT);
+					slack = std::min<ulong64>(length >> shift, KVDB_SLACK_MAX_SIZE);
+				}
+			}
+
+			return std::max<ulong64>(length + slack, reservedValueSize);
+		}
+
+		// value may be rewritten into its own slot if it fits and fills at least half of it, 
+		// much smaller values move to a better fitting slot and free the large one
+		bool fitsInPlace(const TKeyEntry& e, ulong64 length) const {
+			return e.initialDataLength >= length && e.initialDataLength - length <= std::max<ulong64>(length, reservedValueSize);
+		}
+
+		bool isInlineCandidate(const TValueData& valueData) const {
+			return valueData.size() > 0 && valueData.size() <= inlineValueSize;
+		}
+
+		bool isDedupCandidate(const TValueData& valueData) const {
+			return bDeduplication && !isInlineCandidate(valueData) && valueData.size() > 0 && valueData.size() <= KVDB_DEDUP_MAX_SIZE;
+		}
+
+		bool isSharedSlot(ulong64 dataPos) const {
+			auto got = sharedSlotMap.find(dataPos);
+			return got != sharedSlotMap.end() && got->second.keySet.size() > 1;
+		}
+
+		// slot with the same value. expects lock
+		bool findSharedSlot(ulong64 hash, const TValueData& valueData, ulong64& dataPos) {
+			auto got = contentMap.find(hash);
+			if (got == contentMap.end()) return false;
+
+			const TSharedSlot& slot = sharedSlotMap[got->second];
+			if (slot.length != valueData.size()) return false;
+
+			TValueData slotData(slot.length);
+			if (!readFile.read(got->second, slotData.data(), slotData.size()) || slotData != valueData) return false;
+
+			dataPos = got->second;
+			return true;
+		}
+
+		void registerSharedSlot(const TKeyEntry& e, ulong64 hash) {
+			TSharedSlot& slot = sharedSlotMap[e.dataPos];
+			slot.hash = hash;
+			slot.length = e.dataLength;
+			slot.keySet.insert(e.freeKeyData);
+			contentMap.insert({ hash, e.dataPos }); // first slot with this value wins
+		}
+
+		void unregisterSharedSlot(ulong64 dataPos) {
+			auto got = sharedSlotMap.find(dataPos);
+			if (got == sharedSlotMap.end()) return;
+
+			auto content = contentMap.find(got->second.hash);
+			if (content != contentMap.end() && content->second == dataPos) {
+				contentMap.erase(content);
+			}
+
+			sharedSlotMap.erase(got);
+		}
+
+		// new pair pointing to existing value slot
+		void addSharedPair(const TKeyData& keyData, ulong64 dataPos, std::map<ulong64, TKeyEntry>& dirtyKeyMap) {
+			if (reservedKeyList.empty()) {
+				createNewTable();
+			}
+
+			TKeyEntryInfo keyInfo = reservedKeyList.front();
+			reservedKeyList.pop_front();
+
+			TSharedSlot& slot = sharedSlotMap[dataPos];
+			slot.keySet.insert(keyData);
+
+			keyInfo().dataPos = dataPos;
+			keyInfo().dataLength = slot.length;
+			keyInfo().initialDataLength = 0;
+			keyInfo().freeKeyData = keyData;
+
+			dataMap.insert(keyInfo);
+			dirtyKeyMap[keyInfo.pos] = keyInfo();
+		}
+
+		// remove pair. slot still used by other pairs is handed over to one of them,
+		// key entry goes back to reserved slots
+		void releasePair(TKeyEntryInfo keyInfo, std::map<ulong64, TKeyEntry>& dirtyKeyMap) {
+			const TKeyData keyData = keyInfo().freeKeyData;
+			dataMap.erase(keyData);
+
+			if (isInlineEntry(keyInfo())) {
+				// no value slot, snapshots keep the whole entry
+				TKeyEntryInfo freeInfo(TKeyEntry(), keyInfo.pos);
+				dirtyKeyMap[freeInfo.pos] = freeInfo();
+				reservedKeyList.push_back(freeInfo);
+				return;
+			}
+
+			TSharedSlot* slotPtr = nullptr;
+			auto got = sharedSlotMap.find(keyInfo().dataPos);
+			if (got != sharedSlotMap.end()) {
+				got->second.keySet.erase(keyData);
+				if (got->second.keySet.empty()) {
+					unregisterSharedSlot(keyInfo().dataPos);
+				} else {
+					slotPtr = &got->second;
+				}
+			}
+
+			if (slotPtr == nullptr && keyInfo().initialDataLength > 0) {
+				// last pair of slot
+				keyInfo().dataLength = 0;
+				dirtyKeyMap[keyInfo.pos] = keyInfo();
+				retireSlot(keyInfo);
+				return;
+			}
+
+			if (slotPtr != nullptr && keyInfo().initialDataLength > 0) {
+				TKeyEntryInfo& heirInfo = *dataMap.find(*slotPtr->keySet.begin());
+				heirInfo().initialDataLength = keyInfo().initialDataLength;
+				dirtyKeyMap[heirInfo.pos] = heirInfo();
+			}
+
+			TKeyEntryInfo freeInfo(TKeyEntry(), keyInfo.pos);
+			dirtyKeyMap[freeInfo.pos] = freeInfo();
+			reservedKeyList.push_back(freeInfo);
+		}
+
+		// key and value to put, empty value - erase
+		typedef std::pair<TKeyData, const TValueData*> TOpRef;
+
+		// pending write of key. false if key is not in queue, otherwise new value or nullptr if erased
+		bool findPending(const TKeyData& keyData, TValueDataPtr& dataPtr) {
+			if (overlaySize == 0) return false;
+			std::unique_lock<std::mutex> guard(pendingMutex);
+
+			auto got = pendingMap.find(keyData);
+			if (got != pendingMap.end()) {
+				dataPtr = got->second;
+				return true;
+			}
+
+			got = inflightMap.find(keyData);
+			if (got != inflightMap.end()) {
+				dataPtr = got->second;
+				return true;
+			}
+
+			return false;
+		}
+
+		// expects pendingMutex
+		void putPending(const TKeyData& keyData, TValueDataPtr dataPtr) {
+			auto got = pendingMap.find(keyData);
+			if (got != pendingMap.end() && got->second) {
+				pendingBytes -= got->second->size();
+			}
+
+			if (dataPtr) {
+				pendingBytes += dataPtr->size();
+			}
+
+			pendingMap[keyData] = dataPtr;
+			overlaySize = pendingMap.size() + inflightMap.size();
+		}
+
+		// expects pendingMutex
+		void waitQueueSpace(std::unique_lock<std::mutex>& guard) {
+			pendingCondition.wait(guard, [&]() { return pendingBytes < KVDB_WRITE_BEHIND_MAX_BYTES || bWriterStop; });
+		}
+
+		TWriteBatchResult enqueue(const std::vector<TOpRef>& opList) {
+			TWriteBatchResult result;
+			const auto start = std::chrono::steady_clock::now();
+
+			{
+				std::unique_lock<std::mutex> guard(pendingMutex);
+				waitQueueSpace(guard);
+
+				for (const auto& op : opList) {
+					if (op.second->size() > 0) {
+						putPending(op.first, std::make_shared<TValueData>(*op.second));
+						result.putCount++;
+					} else {
+						putPending(op.first, nullptr);
+						result.eraseCount++;
+					}
+				}
+			}
+
+			pendingCondition.notify_all();
+			result.commitTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return result;
+		}
+
+		// drain whole queue at once as one batch, so values go out in file order
+		void writerLoop() {
+			static const TValueData emptyValue;
+			std::unique_lock<std::mutex> guard(pendingMutex);
+
+			while (true) {
+				pendingCondition.wait(guard, [&]() { return !pendingMap.empty() || bWriterStop; });
+				if (pendingMap.empty()) break; // stopped and drained
+
+				inflightMap.swap(pendingMap);
+				inflightBytes = pendingBytes;
+				pendingBytes = 0;
+				guard.unlock();
+				pendingCondition.notify_all();
+
+				// inflight map is not modified until lock, readers may look into it meanwhile
+				std::vector<TOpRef> opList;
+				opList.reserve(inflightMap.size());
+				for (const auto& itm : inflightMap) {
+					opList.push_back({ itm.first, (itm.second) ? itm.second.get() : &emptyValue });
+				}
+
+				const TWriteBatchResult result = commitOps(opList);
+
+				guard.lock();
+				writeBehindStats.drainedKeys += opList.size();
+				writeBehindStats.drainedBytes += inflightBytes;
+				writeBehindStats.drainTimeMs += result.commitTimeMs;
+				inflightMap.clear();
+				inflightBytes = 0;
+				overlaySize = pendingMap.size();
+				pendingCondition.notify_all();
+			}
+		}
+
+		void stopWriter() {
+			if (!bWriteBehind) return;
+
+			{
+				std::unique_lock<std::mutex> guard(pendingMutex);
+				bWriterStop = true;
+			}
+
+			pendingCondition.notify_all();
+			writerThread.join();
+			bWriteBehind = false;
+		}
+
+		// keep entries of changed keys for alive snapshots. expects exclusive lock
+		void preserveForSnapshots(const std::vector<TOpRef>& opList) {
+			std::lock_guard<std::mutex> guard(snapshotMutex);
+
+			for (const auto& weakState : snapshotList) {
+				std::shared_ptr<TSnapshotState> state = weakState.lock();
+				if (!state) continue;
+
+				for (const auto& op : opList) {
+					const TKeyEntryInfo* keyInfo = dataMap.find(op.first);
+					state->undoMap.insert({ op.first, (keyInfo != nullptr) ? (*keyInfo)() : TKeyEntry() });
+				}
+			}
+		}
+
+		// value written before index is locked
+		typedef struct TPreparedValue {
+			// deleted pair whose slot was taken, or reserved key entry to be taken at publish
+			TKeyEntryInfo keyInfo;
+			bool bDeletedSlot = false;
+		} TPreparedValue;
+
+		// values which don't fit their current slot go to free slots or to the end of file,
+		// if bPinned all of them do (copy-on-write). values already in preparedMap are skipped.
+		// nobody reads there until new index is published, so it runs under shared lock. 
+		// inline values, small deduplicated values and in-place rewrites are left for publish. expects writerMutex
+		void prepareValues(const std::vector<TOpRef>& opList, std::unordered_map<TKeyData, TPreparedValue>& preparedMap, TWriteBatchResult& result, bool bPinned) {
+			reclaimRetired();
+
+			std::vector<std::pair<ulong64, const TValueData*>> rewriteList; // by data position
+			TValueData appendData;
+
+			filePtr->seekp(0, std::ios::end);
+			const ulong64 appendPos = (ulong64)filePtr->tellp();
+
+			for (const auto& op : opList) {
+				const TKeyData& keyData = op.first;
+				const TValueData& valueData = *op.second;
+
+				if (valueData.size() == 0) {
+					relocationMap.erase(keyData);
+					continue;
+				}
+
+				if (isInlineCandidate(valueData) || isDedupCandidate(valueData) || preparedMap.count(keyData) > 0) continue;
+
+				const TKeyEntryInfo* oldInfo = dataMap.find(keyData);
+				if (oldInfo != nullptr && !isInlineEntry((*oldInfo)())) {
+					const TKeyEntry& e = (*oldInfo)();
+					if (fitsInPlace(e, valueData.size()) && !bPinned && !isSharedSlot(e.dataPos)) continue;
+
+					if (e.initialDataLength < valueData.size()) {
+						uint32& relocations = relocationMap[keyData];
+						relocations = std::min<uint32>(relocations + 1, KVDB_SLACK_MAX_SHIFT + 1);
+						result.relocatedCount++;
+					}
+				}
+
+				const ulong64 length = slotLengthFor(keyData, valueData.size());
+				TPreparedValue prepared;
+
+				if (takeSuitableDeletedPair(length, prepared.keyInfo)) {
+					prepared.bDeletedSlot = true;
+					rewriteList.push_back({ prepared.keyInfo().dataPos, &valueData });
+				} else {
+					prepared.keyInfo().dataPos = appendPos + appendData.size();
+					prepared.keyInfo().initialDataLength = length;
+					appendData.insert(appendData.end(), valueData.begin(), valueData.end());
+					appendData.resize(appendData.size() + (length - valueData.size()), 0);
+				}
+
+				preparedMap.insert({ keyData, prepared });
+			}
+
+			std::sort(rewriteList.begin(), rewriteList.end(), [](const std::pair<ulong64, const TValueData*>& lhs, const std::pair<ulong64, const TValueData*>& rhs) {
+				return lhs.first < rhs.first;
+			});
+
+			for (const auto& itm : rewriteList) {
+				filePtr->seekp(itm.first);
+				filePtr->write((char*)itm.second->data(), itm.second->size());
+				result.rewrittenBytes += itm.second->size();
+			}
+
+			if (appendData.size() > 0) {
+				filePtr->seekp(appendPos);
+				filePtr->write((char*)appendData.data(), appendData.size());
+				result.appendedBytes += appendData.size();
+			}
+
+			filePtr->flush();
+		}
+
+		TWriteBatchResult commitOps(const std::vector<TOpRef>& opList) {
+			TWriteBatchResult result;
+			if (!isOpen() || opList.empty()) return result;
+
+			const auto start = std::chrono::steady_clock::now();
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+
+			std::unordered_map<TKeyData, TPreparedValue> preparedMap;
+			const bool bPreparedPinned = hasSnapshots();
+			{
+				auto sharedGuard = sharedLock();
+				prepareValues(opList, preparedMap, result, bPreparedPinned);
+			}
+
+			auto guard = exclusiveLock();
+			bSnapshotPinned = hasSnapshots();
+
+			if (bSnapshotPinned && !bPreparedPinned) {
+				// pinned meanwhile. values left for in-place rewrite go copy-on-write too, still under shared lock
+				guard.unlock();
+				{
+					auto sharedGuard = sharedLock();
+					prepareValues(opList, preparedMap, result, true);
+				}
+
+				guard = exclusiveLock();
+				bSnapshotPinned = hasSnapshots();
+			}
+			if (bSnapshotPinned) preserveForSnapshots(opList);
+			beginChange();
+
+			std::map<ulong64, TKeyEntry> dirtyKeyMap; // by key entry position
+			std::vector<std::pair<ulong64, const TValueData*>> rewriteList; // by data position
+			std::vector<std::pair<const TOpRef*, ulong64>> appendList; // op, slot length
+			std::vector<std::pair<const TOpRef*, const TPreparedValue*>> preparedList; // already written, need key entry
+			std::vector<const TOpRef*> inlineList; // value goes into new key entry
+
+			// deduplicated values written by this batch, slots are known at the end
+			std::vector<std::pair<TKeyData, ulong64>> newSlotList; // key, hash
+			std::unordered_map<ulong64, const TOpRef*> newContentMap; // hash -> first op with this value
+			std::vector<std::pair<TKeyData, TKeyData>> newSharedList; // key, key of first op with the same value
+
+			for (const auto& op : opList) {
+				const TKeyData& keyData = op.first;
+				const TValueData& valueData = *op.second;
+
+				if (valueData.size() > 0) {
+					result.putCount++;
+				} else {
+					result.eraseCount++;
+				}
+
+				const bool bInline = isInlineCandidate(valueData);
+				const bool bDedup = isDedupCandidate(valueData);
+				const ulong64 hash = (bDedup) ? contentHash(valueData.data(), valueData.size()) : 0;
+				ulong64 sharedPos = 0;
+				const bool bShared = bDedup && findSharedSlot(hash, valueData, sharedPos);
+
+				TKeyEntryInfo* oldInfo = dataMap.find(keyData);
+				if (oldInfo != nullptr) {
+					TKeyEntryInfo keyInfo = *oldInfo;
+					const bool bOldInline = isInlineEntry(keyInfo());
+
+					if (bInline && bOldInline) {
+						// snapshots keep copy of the old entry, so it is always changed in place
+						setInlineValue(keyInfo(), valueData.data(), valueData.size());
+						*oldInfo = keyInfo;
+						dirtyKeyMap[keyInfo.pos] = keyInfo();
+						continue;
+					}
+
+					if (bShared && !bOldInline && keyInfo().dataPos == sharedPos) continue; // same value
+
+					const bool bPrepared = preparedMap.find(keyData) != preparedMap.end();
+					if (!bShared && !bInline && !bOldInline && !bPrepared && !bSnapshotPinned && valueData.size() > 0 && fitsInPlace(keyInfo(), valueData.size()) && !isSharedSlot(keyInfo().dataPos)) {
+						// fits old place
+						unregisterSharedSlot(keyInfo().dataPos);
+						keyInfo().dataLength = valueData.size();
+						*oldInfo = keyInfo;
+						rewriteList.push_back({ keyInfo().dataPos, &valueData });
+						dirtyKeyMap[keyInfo.pos] = keyInfo();
+
+						if (bDedup && newContentMap.insert({ hash, &op }).second) {
+							newSlotList.push_back({ keyData, hash });
+						}
+
+						continue;
+					}
+
+					// remove old pair
+					releasePair(keyInfo, dirtyKeyMap);
+				}
+
+				if (valueData.size() == 0) continue;
+
+				if (bInline) {
+					inlineList.push_back(&op);
+					continue;
+				}
+
+				auto prepared = preparedMap.find(keyData);
+				if (prepared != preparedMap.end()) {
+					if (prepared->second.bDeletedSlot) {
+						TKeyEntryInfo keyInfo = prepared->second.keyInfo;
+						keyInfo().freeKeyData = keyData;
+						keyInfo().dataLength = valueData.size();
+						dataMap.insert(keyInfo);
+						dirtyKeyMap[keyInfo.pos] = keyInfo();
+					} else {
+						preparedList.push_back({ &op, &prepared->second });
+					}
+
+					continue;
+				}
+
+				if (bShared) {
+					addSharedPair(keyData, sharedPos, dirtyKeyMap);
+					continue;
+				}
+
+				if (bDedup) {
+					auto first = newContentMap.find(hash);
+					if (first != newContentMap.end() && *first->second->second == valueData) {
+						newSharedList.push_back({ keyData, first->second->first });
+						continue;
+					}
+
+					if (first == newContentMap.end()) {
+						newContentMap.insert({ hash, &op });
+						newSlotList.push_back({ keyData, hash });
+					}
+				}
+
+				// shared slots are never rewritten in place, slack would be lost there
+				const ulong64 length = (bDedup) ? valueData.size() : slotLengthFor(keyData, valueData.size());
+
+				TKeyEntryInfo keyInfo;
+				if (takeSuitableDeletedPair(length, keyInfo)) {
+					keyInfo().freeKeyData = keyData;
+					keyInfo().dataLength = valueData.size();
+					dataMap.insert(keyInfo);
+					rewriteList.push_back({ keyInfo().dataPos, &valueData });
+					dirtyKeyMap[keyInfo.pos] = keyInfo();
+				} else {
+					appendList.push_back({ &op, length });
+				}
+			}
+
+			// new tables first, so appended values stay contiguous
+			while (reservedKeyList.size() < appendList.size() + preparedList.size() + inlineList.size() + newSharedList.size()) {
+				createNewTable();
+			}
+
+			filePtr->seekp(0, std::ios::end);
+			const ulong64 appendPos = (ulong64)filePtr->tellp();
+			TValueData appendData;
+
+			for (const auto& itm : appendList) {
+				const TOpRef* op = itm.first;
+				const TValueData& valueData = *op->second;
+				const ulong64 slotLength = itm.second;
+
+				TKeyEntryInfo keyInfo = reservedKeyList.front();
+				reservedKeyList.pop_front();
+
+				keyInfo().dataPos = appendPos + appendData.size();
+				keyInfo().dataLength = valueData.size();
+				keyInfo().initialDataLength = slotLength;
+				keyInfo().freeKeyData = op->first;
+
+				appendData.insert(appendData.end(), valueData.begin(), valueData.end());
+				appendData.resize(appendData.size() + (slotLength - valueData.size()), 0);
+
+				dataMap.insert(keyInfo);
+				dirtyKeyMap[keyInfo.pos] = keyInfo();
+			}
+
+			for (const auto& itm : preparedList) {
+				TKeyEntryInfo keyInfo = reservedKeyList.front();
+				reservedKeyList.pop_front();
+
+				keyInfo().dataPos = itm.second->keyInfo().dataPos;
+				keyInfo().dataLength = itm.first->second->size();
+				keyInfo().initialDataLength = itm.second->keyInfo().initialDataLength;
+				keyInfo().freeKeyData = itm.first->first;
+
+				dataMap.insert(keyInfo);
+				dirtyKeyMap[keyInfo.pos] = keyInfo();
+			}
+
+			for (const TOpRef* op : inlineList) {
+				TKeyEntryInfo keyInfo = reservedKeyList.front();
+				reservedKeyList.pop_front();
+
+				setInlineValue(keyInfo(), op->second->data(), op->second->size());
+				keyInfo().freeKeyData = op->first;
+
+				dataMap.insert(keyInfo);
+				dirtyKeyMap[keyInfo.pos] = keyInfo();
+			}
+
+			for (const auto& itm : newSlotList) {
+				registerSharedSlot((*dataMap.find(itm.first))(), itm.second);
+			}
+
+			for (const auto& itm : newSharedList) {
+				addSharedPair(itm.first, (*dataMap.find(itm.second))().dataPos, dirtyKeyMap);
+			}
+
+			std::sort(rewriteList.begin(), rewriteList.end(), [](const std::pair<ulong64, const TValueData*>& lhs, const std::pair<ulong64, const TValueData*>& rhs) {
+				return lhs.first < rhs.first;
+			});
+
+			for (const auto& itm : rewriteList) {
+				filePtr->seekp(itm.first);
+				filePtr->write((char*)itm.second->data(), itm.second->size());
+				result.rewrittenBytes += itm.second->size();
+			}
+
+			if (appendData.size() > 0) {
+				filePtr->seekp(appendPos);
+				filePtr->write((char*)appendData.data(), appendData.size());
+				result.appendedBytes += appendData.size();
+			}
+
+			writeKeyEntries(dirtyKeyMap);
+			result.keyEntryCount = dirtyKeyMap.size();
+
+			filePtr->flush(); // make it visible to positional reads
+			updateMapping();
+
+			for (const auto& op : opList) {
+				markChanged(op.first);
+			}
+
+			commitVersion++;
+			bSnapshotPinned = false;
+
+			result.commitTimeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			writtenKeyCount += result.putCount + result.eraseCount;
+			writtenByteCount += result.appendedBytes + result.rewrittenBytes;
+			writeLatency.add((ulong64)(result.commitTimeMs * 1000000));
+			return result;
+		}
+
+		// write key entries in file order. adjacent entries go out with one write call
+		void writeKeyEntries(const std::map<ulong64, TKeyEntry>& keyEntryMap) {
+			std::vector<byte> run;
+			ulong64 runPos = 0;
+
+			auto flushRun = [&]() {
+				if (run.empty()) return;
+				filePtr->seekp(runPos);
+				filePtr->write((char*)run.data(), run.size());
+				run.clear();
+			};
+
+			for (const auto& itm : keyEntryMap) {
+				if (run.empty() || itm.first != runPos + run.size()) {
+					flushRun();
+					runPos = itm.first;
+				}
+
+				const byte* entryPtr = (const byte*)&itm.second;
+				run.insert(run.end(), entryPtr, entryPtr + sizeof(TKeyEntry));
+			}
+
+			flushRun();
+		}
+
+	public:
+
+		// puts and erases collected to be applied at once by commit().
+		// last operation for the same key wins, empty value means erase
+		class WriteBatch {
+			friend class KvFile;
+			friend class KvContainer<K>;
+
+		private:
+			std::vector<std::pair<TKeyData, TValueData>> opList;
+			std::unordered_map<TKeyData, size_t> opIndexMap;
+			ulong64 bytes = 0;
+
+			void set(const TKeyData& keyData, TValueData&& valueData) {
+				bytes += valueData.size();
+				auto got = opIndexMap.find(keyData);
+				if (got == opIndexMap.end()) {
+					opIndexMap.insert({ keyData, opList.size() });
+					opList.push_back({ keyData, std::move(valueData) });
+				} else {
+					TValueData& old = opList[got->second].second;
+					bytes -= old.size();
+					old = std::move(valueData);
+				}
+			}
+
+		public:
+
+			void put(const K& k, const V& v) {
+				TValueData valueData;
+
+				if (std::is_same<V, TValueData>::value) {
+					valueData = static_cast<TValueData>(v);
+				} else {
+					toValueData(v, valueData);
+				}
+
+				set(toKeyData(k), std::move(valueData));
+			}
+
+			void erase(const K& k) {
+				set(toKeyData(k), TValueData());
+			}
+
+			size_t size() const {
+				return opList.size();
+			}
+
+			// value bytes held by the batch
+			ulong64 dataSize() const {
+				return bytes;
+			}
+
+			bool isEmpty() const {
+				return opList.empty();
+			}
+
+			void clear() {
+				opList.clear();
+				opIndexMap.clear();
+				bytes = 0;
+			}
+		};
+
+		KvFile() {
+			assert(sizeof(K) <= KVDB_KEY_SIZE);
+
+			const int32_t minXyz[3] = { -KVDB_PRESENCE_FILTER_XY, -KVDB_PRESENCE_FILTER_XY, -KVDB_PRESENCE_FILTER_Z };
+			const int32_t maxXyz[3] = { KVDB_PRESENCE_FILTER_XY - 1, KVDB_PRESENCE_FILTER_XY - 1, KVDB_PRESENCE_FILTER_Z - 1 };
+
+			TKeyData minKey = {}, maxKey = {};
+			std::memcpy(minKey.data(), minXyz, sizeof(minXyz));
+			std::memcpy(maxKey.data(), maxXyz, sizeof(maxXyz));
+			presenceFilter.setRange(minKey, maxKey);
+		}
+        
+        ~KvFile() {
+			close();
+			stopWriter();
+		}
+		
+		// minimal value slot size
+		void setReservedValueSize(uint32 val){
+			reservedValueSize = val;
+		}
+
+		// extra slot space for keys which keep outgrowing their slot. on by default
+		void setAdaptiveSlack(bool val) {
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = exclusiveLock();
+			bAdaptiveSlack = val;
+		}
+
+		// zero-copy reads through loadView(). returns false if memory mapping is not supported.
+		// on windows mapping covers file size at map time, file growth remaps it
+		bool setMemoryMapped(bool val) {
+#if defined(KVDB_POSITIONAL_IO) || defined(KVDB_WIN32_IO)
+			auto guard = exclusiveLock();
+			bMemoryMapped = val;
+			if (bMemoryMapped) {
+				if (isOpen()) updateMapping();
+			} else {
+				mappedRegion = nullptr;
+			}
+			return true;
+#else
+			return !val;
+#endif
+		}
+
+		void close() {
+			if (!isOpen()) return;
+			flush();
+			if (!bIndexSnapshotSaved) writeIndexSnapshot();
+			filePtr->close();
+			delete filePtr;
+			filePtr = nullptr;
+			readFile.close();
+			mappedRegion = nullptr;
+			clearIndex();
+			presenceFilter.clear();
+			valueCache.clear();
+			relocationMap.clear();
+		}
+
+		bool isOpen() {
+			return filePtr && filePtr->is_open();
+		}
+
+		// save index snapshot for fast open. close() does it too.
+		// writers wait, loads keep going while it is written
+		bool checkpoint() {
+			if (!isOpen()) return false;
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = sharedLock();
+			if (bIndexSnapshotSaved) return true;
+			return writeIndexSnapshot();
+		}
+
+		// save(), erase() and commit() only put values to queue, dedicated writer thread writes them to file.
+		// reads see queued values. turning it off waits for the queue to drain
+		void setWriteBehind(bool val) {
+			if (val == bWriteBehind) return;
+
+			if (val) {
+				{
+					std::unique_lock<std::mutex> guard(pendingMutex);
+					bWriterStop = false;
+				}
+
+				bWriteBehind = true;
+				writerThread = std::thread([this]() { writerLoop(); });
+			} else {
+				stopWriter();
+			}
+		}
+
+		bool isWriteBehind() const {
+			return bWriteBehind;
+		}
+
+		// wait until write-behind queue is written to file
+		void flush() {
+			if (!bWriteBehind) return;
+			std::unique_lock<std::mutex> guard(pendingMutex);
+			pendingCondition.wait(guard, [&]() { return pendingMap.empty() && inflightMap.empty(); });
+		}
+
+		TWriteBehindStats getWriteBehindStats() {
+			std::unique_lock<std::mutex> guard(pendingMutex);
+			TWriteBehindStats stats = writeBehindStats;
+			stats.queueKeys = pendingMap.size() + inflightMap.size();
+			stats.queueBytes = pendingBytes + inflightBytes;
+			return stats;
+		}
+
+		// store identical values up to KVDB_DEDUP_MAX_SIZE once. 
+		// turning it off keeps already shared slots, compaction splits them
+		void setDeduplication(bool val) {
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = exclusiveLock();
+			bDeduplication = val;
+		}
+
+		// values up to this size are stored in key entry and loaded without file access. 
+		// KVDB_INLINE_MAX_SIZE by default, 0 - disabled. applies to values saved later and to compaction
+		void setInlineValueSize(uint32 val) {
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = exclusiveLock();
+			inlineValueSize = std::min<uint32>(val, KVDB_INLINE_MAX_SIZE);
+		}
+
+		// byte budget of raw value data cache. 0 - disabled.
+		// values returned by loadData() and loadMany() are shared with the cache, don't modify them
+		void setValueCacheCapacity(ulong64 bytes) {
+			valueCache.setCapacity(bytes);
+		}
+
+		TCacheStats valueCacheStats() const {
+			return valueCache.stats();
+		}
+
+		// box of keys answered by isExist() without lock. only while file is closed
+		void setPresenceFilterRange(const K& minKey, const K& maxKey) {
+			presenceFilter.setRange(toKeyData(minKey), toKeyData(maxKey));
+		}
+
+		// index was loaded from snapshot on open, without table walk
+		bool isIndexFromSnapshot() const {
+			return bIndexFromSnapshot;
+		}
+
+		bool open(const std::string& file) {
+			filePtr = new std::fstream(file, std::ios::in | std::ios::out | std::ios::binary);
+
+			if (!isOpen()) return false;
+
+			fileName = file;
+			readIndex();
+
+			if (!readFile.open(file)) {
+				close();
+				return false;
+			}
+
+			updateMapping();
+            
+			return true;
+		}
+
+		TSpaceUsage spaceUsage() {
+			if (!isOpen()) return TSpaceUsage();
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = sharedLock();
+			return spaceUsageLocked();
+		}
+
+		// live view of file layout and I/O counters since open or resetStats()
+		TFileStats stats() {
+			TFileStats res;
+			res.valueCache = valueCache.stats();
+			res.writeBehind = getWriteBehindStats();
+			res.readKeys = readKeyCount;
+			res.readBytes = readByteCount;
+			res.writtenKeys = writtenKeyCount;
+			res.writtenBytes = writtenByteCount;
+			res.readLatency = readLatency.snapshot();
+			res.writeLatency = writeLatency.snapshot();
+			res.readLockWait = readLockWait.snapshot();
+			res.writeLockWait = writeLockWait.snapshot();
+
+			if (!isOpen()) return res;
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			auto guard = sharedLock();
+
+			res.space = spaceUsageLocked();
+			res.keyCount = dataMap.size();
+			res.reservedKeyCount = reservedKeyList.size();
+			res.tableCount = tableList.size();
+			res.hotKeyCount = relocationMap.size();
+
+			for (const auto& keyInfo : dataMap) {
+				res.valueSize.add(valueLength(keyInfo()));
+			}
+
+			return res;
+		}
+
+		void resetStats() {
+			readKeyCount = 0;
+			readByteCount = 0;
+			writtenKeyCount = 0;
+			writtenByteCount = 0;
+			readLatency.reset();
+			writeLatency.reset();
+			readLockWait.reset();
+			writeLockWait.reset();
+		}
+
+	private:
+
+		// expects lock
+		TSpaceUsage spaceUsageLocked() {
+			TSpaceUsage usage;
+			usage.fileSize = readFile.size();
+
+			for (const auto& keyInfo : dataMap) {
+				const TKeyEntry& e = keyInfo();
+				if (isInlineEntry(e)) {
+					usage.inlineBytes += valueLength(e);
+					usage.inlineKeyCount++;
+					continue;
+				}
+
+				if (e.initialDataLength == 0) {
+					usage.sharedBytes += e.dataLength;
+					usage.sharedKeyCount++;
+					continue;
+				}
+
+				usage.liveBytes += e.dataLength;
+				usage.slackBytes += e.initialDataLength - e.dataLength;
+			}
+
+			for (const auto& itm : deletedKeyMap) {
+				usage.freeBytes += itm.first;
+			}
+
+			for (const auto& itm : retiredList) {
+				usage.freeBytes += itm.second().initialDataLength;
+			}
+
+			usage.freeSlotCount = deletedKeyMap.size() + retiredList.size();
+			return usage;
+		}
+
+	public:
+
+		int size() {
+			if (!isOpen()) {
+				return 0;
+			} else {
+				return dataMap.size();
+			}
+		}
+
+		bool isExist(const K& k) {
+			TKeyData keyData = toKeyData(k);
+			if (!isOpen()) return false;
+
+			TValueDataPtr pendingPtr;
+			if (findPending(keyData, pendingPtr)) return pendingPtr != nullptr;
+
+			const int presence = presenceFilter.test(keyData);
+			if (presence >= 0) return presence > 0;
+
+			auto guard = sharedLock();
+			return dataMap.contains(keyData);
+		}
+
+
+		TValueDataPtr loadData(const K& k) {
+			TScopeTimer timer(readLatency);
+			TKeyData keyData = toKeyData(k);
+
+			if (!isOpen()) return nullptr;
+
+			TValueDataPtr pendingPtr;
+			if (findPending(keyData, pendingPtr)) return pendingPtr;
+
+			auto guard = sharedLock();
+
+			const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+			if (keyInfo == nullptr) {
+				return nullptr;
+			}
+
+			return readValue(keyData, (*keyInfo)());
+		}
+
+		// read-only view to value data. points into mapped memory if memory mapping is enabled,
+		// otherwise into freshly loaded buffer. while a mapped view is alive its slot is neither 
+		// rewritten in place nor reused, so later saves never change its content
+		TValueView loadView(const K& k) {
+			TScopeTimer timer(readLatency);
+			TKeyData keyData = toKeyData(k);
+
+			if (!isOpen()) return TValueView();
+
+			TValueDataPtr pendingPtr;
+			if (findPending(keyData, pendingPtr)) return (pendingPtr) ? TValueView(pendingPtr) : TValueView();
+
+			auto guard = sharedLock();
+
+			const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+			if (keyInfo == nullptr) {
+				return TValueView();
+			}
+
+			const TKeyEntry& e = (*keyInfo)();
+
+			if (mappedRegion && !isInlineEntry(e) && e.dataPos + e.dataLength <= mappedRegion->size()) {
+				countRead(e.dataLength);
+				return TValueView(mappedRegion->data() + e.dataPos, e.dataLength, pinMappedViews(commitVersion));
+			}
+
+			TValueDataPtr dataPtr = readValue(keyData, e);
+			return (dataPtr) ? TValueView(dataPtr) : TValueView();
+		}
+
+		// bulk existence check under one lock. result[i] is for keys[i]
+		std::vector<bool> existMany(const std::vector<K>& keys) {
+			std::vector<bool> result(keys.size(), false);
+
+			if (!isOpen()) return result;
+
+			std::vector<size_t> missList;
+			for (size_t i = 0; i < keys.size(); i++) {
+				const TKeyData keyData = toKeyData(keys[i]);
+
+				TValueDataPtr pendingPtr;
+				if (findPending(keyData, pendingPtr)) {
+					result[i] = pendingPtr != nullptr;
+					continue;
+				}
+
+				const int presence = presenceFilter.test(keyData);
+				if (presence >= 0) {
+					result[i] = presence > 0;
+				} else {
+					missList.push_back(i);
+				}
+			}
+
+			if (missList.empty()) return result;
+			auto guard = sharedLock();
+
+			for (size_t i : missList) {
+				result[i] = dataMap.contains(toKeyData(keys[i]));
+			}
+
+			return result;
+		}
+
+		// bulk load under one lock. result[i] is for keys[i], nullptr if not found.
+		// reads are performed in file order to keep disk access mostly sequential
+		std::vector<TValueDataPtr> loadMany(const std::vector<K>& keys) {
+			TScopeTimer timer(readLatency);
+			std::vector<TValueDataPtr> result(keys.size(), nullptr);
+
+			if (!isOpen()) return result;
+
+			// queue before file lock, as in loadView()
+			std::vector<size_t> missList;
+			for (size_t i = 0; i < keys.size(); i++) {
+				TValueDataPtr pendingPtr;
+				if (findPending(toKeyData(keys[i]), pendingPtr)) {
+					result[i] = pendingPtr;
+				} else {
+					missList.push_back(i);
+				}
+			}
+
+			if (missList.empty()) return result;
+			auto guard = sharedLock();
+
+			std::vector<std::pair<TKeyEntry, size_t>> readList;
+			readList.reserve(missList.size());
+
+			for (size_t i : missList) {
+				const TKeyData keyData = toKeyData(keys[i]);
+
+				const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+				if (keyInfo != nullptr && isInlineEntry((*keyInfo)())) {
+					result[i] = inlineValue((*keyInfo)());
+					countRead(result[i]->size());
+				} else if (keyInfo != nullptr) {
+					result[i] = valueCache.get(keyData);
+					if (result[i] == nullptr) {
+						readList.push_back({ (*keyInfo)(), i });
+					} else {
+						countRead((*keyInfo)().dataLength);
+					}
+				}
+			}
+
+			std::sort(readList.begin(), readList.end(), [](const std::pair<TKeyEntry, size_t>& lhs, const std::pair<TKeyEntry, size_t>& rhs) {
+				return lhs.first.dataPos < rhs.first.dataPos;
+			});
+
+			for (const auto& itm : readList) {
+				const TKeyEntry& e = itm.first;
+				TValueDataPtr dataPtr = TValueDataPtr(new TValueData);
+				dataPtr->resize(e.dataLength);
+				if (readFile.read(e.dataPos, dataPtr->data(), e.dataLength)) {
+					valueCache.put(e.freeKeyData, dataPtr, e.dataLength);
+					countRead(e.dataLength);
+					result[itm.second] = dataPtr;
+				}
+			}
+
+			return result;
+		}
+
+		// bulk loadView() under one lock. result[i] is for keys[i], empty view if not found.
+		// mapped views share one pin, values of not mapped file are read in file order
+		std::vector<TValueView> loadViewMany(const std::vector<K>& keys) {
+			TScopeTimer timer(readLatency);
+			std::vector<TValueView> result(keys.size());
+
+			if (!isOpen()) return result;
+
+			std::vector<size_t> missList;
+			for (size_t i = 0; i < keys.size(); i++) {
+				TValueDataPtr pendingPtr;
+				if (!findPending(toKeyData(keys[i]), pendingPtr)) {
+					missList.push_back(i);
+				} else if (pendingPtr) {
+					result[i] = TValueView(pendingPtr);
+				}
+			}
+
+			if (missList.empty()) return result;
+			auto guard = sharedLock();
+
+			std::shared_ptr<const void> viewGuard;
+			std::vector<std::pair<TKeyEntry, size_t>> readList;
+
+			for (size_t i : missList) {
+				const TKeyData keyData = toKeyData(keys[i]);
+				const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+				if (keyInfo == nullptr) continue;
+
+				const TKeyEntry& e = (*keyInfo)();
+				if (isInlineEntry(e)) {
+					result[i] = TValueView(inlineValue(e));
+					countRead(valueLength(e));
+				} else if (mappedRegion && e.dataPos + e.dataLength <= mappedRegion->size()) {
+					if (!viewGuard) viewGuard = pinMappedViews(commitVersion);
+					result[i] = TValueView(mappedRegion->data() + e.dataPos, e.dataLength, viewGuard);
+					countRead(e.dataLength);
+				} else {
+					TValueDataPtr dataPtr = valueCache.get(keyData);
+					if (dataPtr) {
+						result[i] = TValueView(dataPtr);
+						countRead(e.dataLength);
+					} else {
+						readList.push_back({ e, i });
+					}
+				}
+			}
+
+			std::sort(readList.begin(), readList.end(), [](const std::pair<TKeyEntry, size_t>& lhs, const std::pair<TKeyEntry, size_t>& rhs) {
+				return lhs.first.dataPos < rhs.first.dataPos;
+			});
+
+			for (const auto& itm : readList) {
+				const TKeyEntry& e = itm.first;
+				TValueDataPtr dataPtr = TValueDataPtr(new TValueData(e.dataLength));
+				if (readFile.read(e.dataPos, dataPtr->data(), e.dataLength)) {
+					valueCache.put(e.freeKeyData, dataPtr, e.dataLength);
+					countRead(e.dataLength);
+					result[itm.second] = TValueView(dataPtr);
+				}
+			}
+
+			return result;
+		}
+
+		// first bytes of value, at most length. reads only them and leaves value cache alone,
+		// for headers of large values. the view owns a copy
+		TValueView loadPrefix(const K& k, ulong64 length) {
+			TKeyData keyData = toKeyData(k);
+
+			if (!isOpen()) return TValueView();
+
+			TValueDataPtr pendingPtr;
+			if (findPending(keyData, pendingPtr)) return (pendingPtr) ? TValueView(pendingPtr) : TValueView();
+
+			auto guard = sharedLock();
+
+			const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+			if (keyInfo == nullptr) {
+				return TValueView();
+			}
+
+			const TKeyEntry& e = (*keyInfo)();
+			if (isInlineEntry(e)) return TValueView(inlineValue(e));
+
+			const ulong64 prefixLength = std::min<ulong64>(length, e.dataLength);
+			TValueDataPtr dataPtr = TValueDataPtr(new TValueData(prefixLength));
+
+			if (mappedRegion && e.dataPos + e.dataLength <= mappedRegion->size()) {
+				std::memcpy(dataPtr->data(), mappedRegion->data() + e.dataPos, prefixLength);
+			} else if (!readFile.read(e.dataPos, dataPtr->data(), prefixLength)) {
+				return TValueView();
+			}
+
+			countRead(prefixLength);
+			return TValueView(dataPtr);
+		}
+
+		// consistent read-only view of the file as it was at snapshot() call, write-behind queue included.
+		// later saves are invisible to it and never block its reads for the time of value writes.
+		// while any snapshot is alive values are not rewritten in place and freed space is not reused,
+		// so keep it short-lived. must not outlive the file
+		class Snapshot {
+			friend class KvFile;
+
+		private:
+
+			KvFile* kvFile = nullptr;
+			std::shared_ptr<TSnapshotState> state;
+
+			// entry as of snapshot. false if key did not exist. expects file lock
+			bool findEntry(const TKeyData& keyData, TKeyEntry& e) const {
+				auto undo = state->undoMap.find(keyData);
+				if (undo != state->undoMap.end()) {
+					e = undo->second;
+					return e.dataLength > 0;
+				}
+
+				const TKeyEntryInfo* keyInfo = kvFile->dataMap.find(keyData);
+				if (keyInfo == nullptr) return false;
+
+				e = (*keyInfo)();
+				return true;
+			}
+
+			// current keys inside box with changes after snapshot taken back, then queue at snapshot time
+			void collectInBox(const K& minKey, const K& maxKey, std::vector<TKeyData>& keyList) const {
+				int32_t minXyz[3], maxXyz[3];
+				std::memcpy(minXyz, toKeyData(minKey).data(), sizeof(minXyz));
+				std::memcpy(maxXyz, toKeyData(maxKey).data(), sizeof(maxXyz));
+
+				std::unordered_set<TKeyData> keySet;
+				bool bChanged = false;
+
+				{
+					auto guard = kvFile->sharedLock();
+					kvFile->visitBox(minKey, maxKey, [&](const TKeyData& keyData) {
+						keyList.push_back(keyData);
+					});
+
+					for (const auto& itm : state->undoMap) {
+						if (!isKeyInBox(itm.first, minXyz, maxXyz)) continue;
+
+						if (!bChanged) keySet.insert(keyList.begin(), keyList.end());
+						bChanged = true;
+
+						// dataLength == 0 - key did not exist at snapshot time
+						if (itm.second.dataLength > 0) {
+							keySet.insert(itm.first);
+						} else {
+							keySet.erase(itm.first);
+						}
+					}
+				}
+
+				for (const auto& itm : state->overlayMap) {
+					if (!isKeyInBox(itm.first, minXyz, maxXyz)) continue;
+
+					if (!bChanged) keySet.insert(keyList.begin(), keyList.end());
+					bChanged = true;
+
+					if (itm.second) {
+						keySet.insert(itm.first);
+					} else {
+						keySet.erase(itm.first);
+					}
+				}
+
+				if (bChanged) keyList.assign(keySet.begin(), keySet.end());
+			}
+
+		public:
+
+			bool isValid() const {
+				return state != nullptr && kvFile->isOpen();
+			}
+
+			// existing keys inside box as of snapshot, see KvFile::forEachInBox()
+			void forEachInBox(const K& minKey, const K& maxKey, std::function<void(const K&)> func) const {
+				if (!isValid()) return;
+
+				std::vector<TKeyData> keyList;
+				collectInBox(minKey, maxKey, keyList);
+
+				for (const TKeyData& keyData : keyList) {
+					K key;
+					std::memcpy(&key, keyData.data(), sizeof(K));
+					func(key);
+				}
+			}
+
+			bool isExist(const K& k) const {
+				if (!isValid()) return false;
+				const TKeyData keyData = toKeyData(k);
+
+				auto pending = state->overlayMap.find(keyData);
+				if (pending != state->overlayMap.end()) return pending->second != nullptr;
+
+				auto guard = kvFile->sharedLock();
+				TKeyEntry e;
+				return findEntry(keyData, e);
+			}
+
+			TValueDataPtr loadData(const K& k) const {
+				if (!isValid()) return nullptr;
+				const TKeyData keyData = toKeyData(k);
+
+				auto pending = state->overlayMap.find(keyData);
+				if (pending != state->overlayMap.end()) return pending->second;
+
+				TScopeTimer timer(kvFile->readLatency);
+				auto guard = kvFile->sharedLock();
+
+				TKeyEntry e;
+				if (!findEntry(keyData, e)) return nullptr;
+
+				// old version is not in value cache
+				if (isInlineEntry(e) || state->undoMap.find(keyData) == state->undoMap.end()) return kvFile->readValue(keyData, e);
+
+				TValueDataPtr dataPtr = TValueDataPtr(new TValueData(e.dataLength));
+				if (!kvFile->readFile.read(e.dataPos, dataPtr->data(), e.dataLength)) return nullptr;
+
+				kvFile->countRead(e.dataLength);
+				return dataPtr;
+			}
+
+			// bulk load of views as of snapshot under one lock, see KvFile::loadViewMany().
+			// mapped views pin snapshot version instead of snapshot itself, 
+			// so they may outlive it without keeping its undo entries
+			std::vector<TValueView> loadViewMany(const std::vector<K>& keys) const {
+				std::vector<TValueView> result(keys.size());
+				if (!isValid()) return result;
+
+				TScopeTimer timer(kvFile->readLatency);
+				auto guard = kvFile->sharedLock();
+
+				const TMappedRegionPtr& region = kvFile->mappedRegion;
+				std::shared_ptr<const void> viewGuard;
+				std::vector<std::pair<TKeyEntry, size_t>> readList;
+
+				for (size_t i = 0; i < keys.size(); i++) {
+					const TKeyData keyData = toKeyData(keys[i]);
+
+					auto pending = state->overlayMap.find(keyData);
+					if (pending != state->overlayMap.end()) {
+						if (pending->second) result[i] = TValueView(pending->second);
+						continue;
+					}
+
+					TKeyEntry e;
+					if (!findEntry(keyData, e)) continue;
+
+					if (isInlineEntry(e)) {
+						result[i] = TValueView(inlineValue(e));
+						kvFile->countRead(valueLength(e));
+					} else if (region && e.dataPos + e.dataLength <= region->size()) {
+						if (!viewGuard) viewGuard = kvFile->pinMappedViews(state->version);
+						result[i] = TValueView(region->data() + e.dataPos, e.dataLength, viewGuard);
+						kvFile->countRead(e.dataLength);
+					} else {
+						readList.push_back({ e, i });
+					}
+				}
+
+				std::sort(readList.begin(), readList.end(), [](const std::pair<TKeyEntry, size_t>& lhs, const std::pair<TKeyEntry, size_t>& rhs) {
+					return lhs.first.dataPos < rhs.first.dataPos;
+				});
+
+				for (const auto& itm : readList) {
+					const TKeyEntry& e = itm.first;
+					TValueDataPtr dataPtr = TValueDataPtr(new TValueData(e.dataLength));
+					if (kvFile->readFile.read(e.dataPos, dataPtr->data(), e.dataLength)) {
+						kvFile->countRead(e.dataLength);
+						result[itm.second] = TValueView(dataPtr);
+					}
+				}
+
+				return result;
+			}
+		};
+
+		Snapshot snapshot() {
+			Snapshot res;
+			if (!isOpen()) return res;
+
+			std::shared_ptr<TSnapshotState> state = std::make_shared<TSnapshotState>();
+
+			while (true) {
+				{
+					// compaction is swapping the file
+					std::unique_lock<std::mutex> snapshotGuard(snapshotMutex);
+					snapshotCondition.wait(snapshotGuard, [&]() { return !bSnapshotBarrier; });
+				}
+
+				// queue first, as in collectInBox. commit publishing queued keys waits for shared lock below
+				std::unique_lock<std::mutex> pendingGuard(pendingMutex);
+				state->overlayMap = inflightMap;
+				for (const auto& itm : pendingMap) {
+					state->overlayMap[itm.first] = itm.second;
+				}
+
+				auto guard = sharedLock();
+				state->version = commitVersion;
+				if (registerSnapshot(state)) break;
+			}
+
+			res.kvFile = this;
+			res.state = state;
+			return res;
+		}
+
+		// existing keys inside box, bounds inclusive. keys as 3 x int32 within +-2^20.
+		// func is called without lock, so it can use this file
+		void forEachInBox(const K& minKey, const K& maxKey, std::function<void(const K&)> func) {
+			if (!isOpen()) return;
+
+			std::vector<TKeyData> keyList;
+			collectInBox(minKey, maxKey, keyList);
+
+			for (const TKeyData& keyData : keyList) {
+				K key;
+				std::memcpy(&key, keyData.data(), sizeof(K));
+				func(key);
+			}
+		}
+
+		ulong64 countInBox(const K& minKey, const K& maxKey) {
+			ulong64 count = 0;
+			if (!isOpen()) return count;
+
+			if (overlaySize > 0) {
+				std::vector<TKeyData> keyList;
+				collectInBox(minKey, maxKey, keyList);
+				return keyList.size();
+			}
+
+			auto guard = sharedLock();
+			visitBox(minKey, maxKey, [&](const TKeyData& keyData) {
+				count++;
+			});
+
+			return count;
+		}
+
+		std::shared_ptr<V> load(const K& k) {
+			return valueFromData(loadData(k));
+		}
+        
+        std::shared_ptr<V> operator[] (const K& k) {
+            return valueFromData(loadData(k));
+        }
+
+		void erase(const K& k) {
+			TKeyData keyData = toKeyData(k);
+
+			if (!isOpen()) return;
+
+			if (bWriteBehind) {
+				{
+					std::unique_lock<std::mutex> pendingGuard(pendingMutex);
+					putPending(keyData, nullptr);
+				}
+
+				pendingCondition.notify_all();
+				return;
+			}
+
+			if (!isExist(k)) return;
+
+			static const TValueData emptyValue;
+			commitOps({ { keyData, &emptyValue } });
+		}
+
+		void save(const K& k, const V& v) {
+			TKeyData keyData = toKeyData(k);
+			TValueData valueData;
+
+            if (std::is_same<V, TValueData>::value) { 
+				valueData = static_cast<TValueData>(v);
+			} else {
+				toValueData(v, valueData);
+			}
+
+			if (!isOpen()) return;
+
+			if (bWriteBehind) {
+				{
+					std::unique_lock<std::mutex> pendingGuard(pendingMutex);
+					waitQueueSpace(pendingGuard);
+					putPending(keyData, (valueData.size() > 0) ? std::make_shared<TValueData>(std::move(valueData)) : nullptr);
+				}
+
+				pendingCondition.notify_all();
+				return;
+			}
+
+			commitOps({ { keyData, &valueData } });
+		}
+
+		// apply whole batch with one flush:
+		// values that fit their slot are rewritten in place in file order unless a snapshot or mapped view 
+		// pins them, other values go to free slots or are appended as one contiguous region before 
+		// the index is locked, changed key entries are coalesced and written in file order
+		TWriteBatchResult commit(const WriteBatch& batch) {
+			if (batch.isEmpty()) return TWriteBatchResult();
+
+			std::vector<TOpRef> opList;
+			opList.reserve(batch.opList.size());
+			for (const auto& op : batch.opList) {
+				opList.push_back({ op.first, &op.second });
+			}
+
+			if (bWriteBehind) {
+				return enqueue(opList);
+			}
+
+			return commitOps(opList);
+		}
+
+		// rewrite live values into fresh file in morton order of keys with one dense key table, 
+		// then swap it with current file. reads and writes keep working meanwhile:
+		// values are copied step by step under shared lock, keys changed after they were copied
+		// are copied again, key table is written and synced without lock. keys changed after that
+		// are patched in while writers wait. only the handle swap takes exclusive lock.
+		// open snapshots are waited for, new ones wait until the swap is done
+		TCompactionResult compact(const TCompactionBudget& budget = TCompactionBudget()) {
+			TCompactionResult result;
+			if (!isOpen()) return result;
+
+			std::unique_lock<std::mutex> compactionGuard(compactionMutex, std::try_to_lock);
+			if (!compactionGuard.owns_lock()) return result;
+
+			const auto start = std::chrono::steady_clock::now();
+			const std::string tempFileName = fileName + ".compact";
+
+			std::vector<std::pair<ulong64, TKeyData>> keyList; // morton code, key
+			{
+				auto guard = exclusiveLock();
+				compactionChangedKeys.reset(new std::unordered_set<TKeyData>());
+				keyList.reserve(dataMap.size());
+				for (const auto& keyInfo : dataMap) {
+					keyList.push_back({ mortonCode(keyInfo().freeKeyData), keyInfo().freeKeyData });
+				}
+				result.oldFileSize = readFile.size();
+			}
+
+			std::sort(keyList.begin(), keyList.end(), [](const std::pair<ulong64, TKeyData>& lhs, const std::pair<ulong64, TKeyData>& rhs) {
+				return lhs.first < rhs.first;
+			});
+
+			const ulong64 tableCapacity = keyList.size() + reservedKeys;
+			const ulong64 tablePos = sizeof(TFileHeader);
+			const ulong64 dataPos = tablePos + sizeof(TTableHeader) + sizeof(TKeyEntry) * tableCapacity;
+
+			std::fstream outFile(tempFileName, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!outFile) {
+				cancelCompaction(tempFileName);
+				return result;
+			}
+
+			// header and key table are written at the end
+			std::vector<char> placeholder(dataPos, 0);
+			outFile.write(placeholder.data(), placeholder.size());
+
+			std::unordered_map<TKeyData, TKeyEntry> newEntryMap;
+			std::unordered_map<ulong64, ulong64> newSlotMap; // data position -> slot length
+			std::unordered_map<ulong64, std::pair<ulong64, ulong64>> newContentMap; // content hash -> data position, length
+			ulong64 outPos = dataPos;
+			TValueData buffer;
+			TValueData copiedData;
+
+			// value at data position of new file
+			auto isCopied = [&](ulong64 pos, const byte* data, ulong64 length) {
+				if (pos >= outPos) {
+					return std::memcmp(buffer.data() + (pos - outPos), data, length) == 0;
+				}
+
+				copiedData.resize(length);
+				outFile.seekg(pos);
+				outFile.read((char*)copiedData.data(), length);
+				outFile.seekp(0, std::ios::end);
+				return !outFile.fail() && std::memcmp(copiedData.data(), data, length) == 0;
+			};
+
+			// copy value to buffer as new pair. identical small values are copied once unless bShare is false,
+			// tiny values of older files move into key entry. expects lock
+			auto copyPair = [&](const TKeyData& keyData, const TKeyEntry& e, bool bShare) {
+				if (isInlineEntry(e)) {
+					newEntryMap[keyData] = e;
+					return true;
+				}
+
+				if (e.dataLength <= inlineValueSize) {
+					byte bytes[KVDB_INLINE_MAX_SIZE];
+					if (!readFile.read(e.dataPos, bytes, e.dataLength)) return false;
+
+					TKeyEntry newEntry = e;
+					setInlineValue(newEntry, bytes, e.dataLength);
+					newEntryMap[keyData] = newEntry;
+					return true;
+				}
+
+				const bool bDedupCandidate = bDeduplication && e.dataLength <= KVDB_DEDUP_MAX_SIZE;
+				const ulong64 slotLength = (bDedupCandidate) ? std::max<ulong64>(e.dataLength, reservedValueSize) : slotLengthFor(keyData, e.dataLength);
+				const size_t offset = buffer.size();
+				buffer.resize(offset + slotLength, 0);
+				if (!readFile.read(e.dataPos, buffer.data() + offset, e.dataLength)) return false;
+
+				TKeyEntry newEntry = e;
+				newEntry.dataPos = outPos + offset;
+
+				if (bDedupCandidate && bShare) {
+					const ulong64 hash = contentHash(buffer.data() + offset, e.dataLength);
+					auto got = newContentMap.find(hash);
+					if (got != newContentMap.end() && got->second.second == e.dataLength && isCopied(got->second.first, buffer.data() + offset, e.dataLength)) {
+						buffer.resize(offset);
+						newEntry.dataPos = got->second.first;
+					} else {
+						newContentMap.insert({ hash, { newEntry.dataPos, e.dataLength } });
+					}
+				}
+
+				newSlotMap.insert({ newEntry.dataPos, slotLength });
+				newEntryMap[keyData] = newEntry;
+				return true;
+			};
+
+			size_t next = 0;
+			while (next < keyList.size()) {
+				if (budget.isCancelled && budget.isCancelled()) {
+					cancelCompaction(tempFileName);
+					return result;
+				}
+
+				const auto stepStart = std::chrono::steady_clock::now();
+				bool bReadSuccess = true;
+				buffer.clear();
+
+				{
+					// writers change slot layout state, so they wait for the step
+					std::unique_lock<std::mutex> writerGuard(writerMutex);
+					auto guard = sharedLock();
+					while (next < keyList.size() && buffer.size() < budget.stepBytes) {
+						const TKeyData& keyData = keyList[next++].second;
+						const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+						if (keyInfo == nullptr) continue; // erased meanwhile
+
+						if (!copyPair(keyData, (*keyInfo)(), true)) {
+							bReadSuccess = false;
+							break;
+						}
+
+						// copied actual value
+						compactionChangedKeys->erase(keyData);
+					}
+				}
+
+				if (!bReadSuccess || !outFile.write((char*)buffer.data(), buffer.size())) {
+					cancelCompaction(tempFileName);
+					return result;
+				}
+
+				outPos += buffer.size();
+
+				if (budget.bytesPerSecond > 0) {
+					const double stepTime = (double)buffer.size() * 2 / budget.bytesPerSecond; // read and write
+					const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count();
+					if (stepTime > elapsed) {
+						std::this_thread::sleep_for(std::chrono::duration<double>(stepTime - elapsed));
+					}
+				}
+			}
+
+			// keys changed during the copy are copied again. writers wait, loads keep going
+			bool bReadSuccess = true;
+			buffer.clear();
+			{
+				std::unique_lock<std::mutex> writerGuard(writerMutex);
+				auto guard = sharedLock();
+				for (const TKeyData& keyData : *compactionChangedKeys) {
+					newEntryMap.erase(keyData);
+
+					const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+					if (keyInfo == nullptr) continue;
+
+					if (!copyPair(keyData, (*keyInfo)(), true)) {
+						bReadSuccess = false;
+						break;
+					}
+
+					result.recopiedKeyCount++;
+				}
+
+				compactionChangedKeys->clear();
+			}
+
+			if (!bReadSuccess || !outFile.write((char*)buffer.data(), buffer.size())) {
+				cancelCompaction(tempFileName);
+				return result;
+			}
+
+			outPos += buffer.size();
+
+			// key table in morton order too. it is written and synced without lock,
+			// entries of keys changed meanwhile are patched at the swap
+			std::vector<std::pair<ulong64, TKeyEntry>> entryList;
+			entryList.reserve(newEntryMap.size());
+			for (const auto& itm : newEntryMap) {
+				TKeyEntry entry = itm.second;
+				entry.freeKeyData = itm.first;
+				entryList.push_back({ mortonCode(itm.first), entry });
+			}
+
+			std::sort(entryList.begin(), entryList.end(), [](const std::pair<ulong64, TKeyEntry>& lhs, const std::pair<ulong64, TKeyEntry>& rhs) {
+				return lhs.first < rhs.first;
+			});
+
+			// first pair of shared slot owns it. owner may have been recopied to other place meanwhile
+			std::unordered_map<ulong64, std::vector<TKeyData>> slotKeyMap; // data position -> pairs pointing to it, owner first
+			for (auto& itm : entryList) {
+				TKeyEntry& entry = itm.second;
+				if (isInlineEntry(entry)) continue;
+
+				std::vector<TKeyData>& slotKeys = slotKeyMap[entry.dataPos];
+				entry.initialDataLength = (slotKeys.empty()) ? newSlotMap[entry.dataPos] : 0;
+				slotKeys.push_back(entry.freeKeyData);
+			}
+
+			std::unordered_map<TKeyData, ulong64> entryPosMap; // key -> key entry position
+			std::vector<ulong64> freeEntryPosList; // reserved key entries
+			ulong64 lastTablePos = 0;
+			ulong64 lastTableCapacity = 0;
+
+			auto writeTable = [&](ulong64 pos, size_t first, size_t count, ulong64 capacity, ulong64 nextTable) {
+				TTableHeader tableHeader;
+				tableHeader.recordCount = capacity;
+				tableHeader.nextTable = nextTable;
+
+				std::fstream* outFilePtr = &outFile;
+				outFile.seekp(pos);
+				outFilePtr << tableHeader;
+
+				const ulong64 entryPos = pos + sizeof(TTableHeader);
+				for (size_t i = first; i < first + count; i++) {
+					outFilePtr << entryList[i].second;
+					entryPosMap[entryList[i].second.freeKeyData] = entryPos + (i - first) * sizeof(TKeyEntry);
+				}
+
+				// reserved key slots
+				for (ulong64 i = count; i < capacity; i++) {
+					TKeyEntry entry;
+					outFilePtr << entry;
+					freeEntryPosList.push_back(entryPos + i * sizeof(TKeyEntry));
+				}
+
+				if (nextTable == 0) {
+					lastTablePos = pos;
+					lastTableCapacity = capacity;
+				}
+			};
+
+			// more new keys than reserved slots - add second table at the end of file
+			const size_t firstTableCount = (entryList.size() < tableCapacity) ? entryList.size() : (size_t)tableCapacity;
+			const size_t overflowCount = entryList.size() - firstTableCount;
+
+			if (overflowCount > 0) {
+				writeTable(outPos, firstTableCount, overflowCount, overflowCount + reservedKeys, 0);
+				outPos = (ulong64)outFile.tellp();
+			}
+
+			writeTable(tablePos, 0, firstTableCount, tableCapacity, (overflowCount > 0) ? lastTablePos : 0);
+
+			// newer generation than any snapshot of current file
+			TFileHeader newFileHeader;
+			newFileHeader.keySize = KVDB_KEY_SIZE;
+			newFileHeader.endOfHeaderOffset = sizeof(newFileHeader);
+			newFileHeader.timestamp = fileHeader.timestamp;
+			newFileHeader.generation = fileHeader.generation + 1;
+
+			std::fstream* outFilePtr = &outFile;
+			outFile.seekp(0);
+			outFilePtr << newFileHeader;
+			outFile.seekp(0, std::ios::end);
+			outFile.flush();
+
+			if (outFile.fail()) {
+				cancelCompaction(tempFileName);
+				return result;
+			}
+
+			syncFile(tempFileName);
+
+			// copy keys changed since the table was written and patch their entries. expects writerMutex
+			auto patchChanged = [&]() {
+				std::map<ulong64, TKeyEntry> patchMap; // by key entry position
+				std::vector<TKeyEntry> addedList;
+				buffer.clear();
+
+				{
+					auto guard = sharedLock();
+					for (const TKeyData& keyData : *compactionChangedKeys) {
+						auto copied = newEntryMap.find(keyData);
+						if (copied != newEntryMap.end()) {
+							const TKeyEntry& e = copied->second;
+							auto slotKeys = (isInlineEntry(e)) ? slotKeyMap.end() : slotKeyMap.find(e.dataPos);
+
+							// owner leaves shared slot, next pair still pointing to it takes it over
+							if (slotKeys != slotKeyMap.end() && slotKeys->second.front() == keyData) {
+								for (TKeyData& slotKey : slotKeys->second) {
+									auto sharer = newEntryMap.find(slotKey);
+									if (compactionChangedKeys->count(slotKey) > 0 || sharer == newEntryMap.end() || 
+										isInlineEntry(sharer->second) || sharer->second.dataPos != e.dataPos) continue;
+
+									sharer->second.initialDataLength = newSlotMap[e.dataPos];
+									sharer->second.freeKeyData = slotKey;
+									patchMap[entryPosMap[slotKey]] = sharer->second;
+									std::swap(slotKey, slotKeys->second.front());
+									break;
+								}
+							}
+
+							newEntryMap.erase(copied);
+						}
+
+						auto entryPos = entryPosMap.find(keyData);
+						const TKeyEntryInfo* keyInfo = dataMap.find(keyData);
+
+						if (keyInfo == nullptr) {
+							// erased, entry becomes reserved key slot
+							if (entryPos != entryPosMap.end()) {
+								patchMap[entryPos->second] = TKeyEntry();
+								freeEntryPosList.push_back(entryPos->second);
+								entryPosMap.erase(entryPos);
+							}
+
+							continue;
+						}
+
+						// own slot, table already says who owns shared ones
+						if (!copyPair(keyData, (*keyInfo)(), false)) return false;
+						result.recopiedKeyCount++;
+
+						TKeyEntry& entry = newEntryMap[keyData];
+						entry.freeKeyData = keyData;
+						if (!isInlineEntry(entry)) entry.initialDataLength = newSlotMap[entry.dataPos];
+
+						if (entryPos != entryPosMap.end()) {
+							patchMap[entryPos->second] = entry;
+						} else {
+							addedList.push_back(entry);
+						}
+					}
+
+					compactionChangedKeys->clear();
+				}
+
+				outFile.seekp(0, std::ios::end);
+				if (!outFile.write((char*)buffer.data(), buffer.size())) return false;
+				outPos += buffer.size();
+
+				// more new keys than reserved slots - one more table at the end of file
+				if (addedList.size() > freeEntryPosList.size()) {
+					const ulong64 prevTablePos = lastTablePos;
+					const ulong64 prevTableCapacity = lastTableCapacity;
+					const ulong64 newTablePos = outPos;
+					writeTable(newTablePos, 0, 0, addedList.size() - freeEntryPosList.size() + reservedKeys, 0);
+					outPos = (ulong64)outFile.tellp();
+
+					TTableHeader prevTableHeader;
+					prevTableHeader.recordCount = prevTableCapacity;
+					prevTableHeader.nextTable = newTablePos;
+					outFile.seekp(prevTablePos);
+					outFilePtr << prevTableHeader;
+				}
+
+				for (const TKeyEntry& entry : addedList) {
+					const ulong64 entryPos = freeEntryPosList.back();
+					freeEntryPosList.pop_back();
+					patchMap[entryPos] = entry;
+					entryPosMap[entry.freeKeyData] = entryPos;
+				}
+
+				for (const auto& itm : patchMap) {
+					outFile.seekp(itm.first);
+					outFilePtr << itm.second;
+				}
+
+				return !outFile.fail();
+			};
+
+			// few rounds while writers keep going, so the last one under writerMutex is short
+			for (int round = 0; round < 3 && bReadSuccess; round++) {
+				std::unique_lock<std::mutex> writerGuard(writerMutex);
+				if (compactionChangedKeys->size() < KVDB_RESERVED_TABLE_SIZE) break;
+				bReadSuccess = patchChanged();
+			}
+
+			if (!bReadSuccess) {
+				outFile.close();
+				cancelCompaction(tempFileName);
+				return result;
+			}
+
+			// snapshots read old file positions and can't survive the swap. new ones wait until it is done,
+			// so short snapshots taken one after another don't starve compaction
+			setSnapshotBarrier(true);
+			if (!waitEntrySnapshots(budget)) {
+				outFile.close();
+				setSnapshotBarrier(false);
+				cancelCompaction(tempFileName);
+				result.bSnapshotTimeout = !(budget.isCancelled && budget.isCancelled());
+				return result;
+			}
+
+			// writers wait until the swap, loads keep going until the handles are swapped
+			std::unique_lock<std::mutex> writerGuard(writerMutex);
+			bReadSuccess = patchChanged();
+			outFile.close();
+
+			if (!bReadSuccess || outFile.fail()) {
+				writerGuard.unlock();
+				setSnapshotBarrier(false);
+				cancelCompaction(tempFileName);
+				return result;
+			}
+
+			// only the delta is left to sync
+			syncFile(tempFileName);
+
+			// index of new file, loaded before the swap
+			KvFile newIndex;
+			newIndex.fileName = tempFileName;
+			newIndex.filePtr = new std::fstream(tempFileName, std::ios::in | std::ios::out | std::ios::binary);
+			if (newIndex.isOpen()) {
+				newIndex.readIndex();
+				newIndex.filePtr->close();
+			}
+
+			delete newIndex.filePtr;
+			newIndex.filePtr = nullptr;
+
+			const int oldFileHold = holdFile(fileName);
+			auto guard = exclusiveLock();
+
+			// swap. file handles are reopened in place because other threads check isOpen() without lock
+			filePtr->close();
+			readFile.close();
+			mappedRegion = nullptr;
+
+			const bool bReplaced = replaceFile(tempFileName, fileName);
+			if (!bReplaced) {
+				std::remove(tempFileName.c_str());
+			}
+
+			filePtr->open(fileName, std::ios::in | std::ios::out | std::ios::binary);
+			if (bReplaced) {
+				takeIndex(newIndex);
+			}
+
+			compactionChangedKeys.reset();
+			readFile.open(fileName);
+			updateMapping();
+			setSnapshotBarrier(false);
+
+			guard.unlock();
+			writerGuard.unlock();
+			releaseFile(oldFileHold);
+
+			result.bSuccess = bReplaced && isOpen() && readFile.isOpen();
+			result.keyCount = dataMap.size();
+			result.newFileSize = readFile.size();
+			result.timeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return result;
 		}
-        
-        ~KvFile() {
-			close();
+
+		// offline compaction of closed file
+		static TCompactionResult compactFile(const std::string& file, const TCompactionBudget& budget = TCompactionBudget()) {
+			KvFile kvFile;
+			if (!kvFile.open(file)) return TCompactionResult();
+			kvFile.setDeduplication(true);
+			return kvFile.compact(budget);
 		}
-		
-		void setReservedValueSize(uint32 val){
-			reservedValueSize = val;
+
+		static bool create(const std::string& file, const std::unordered_map<K, V>& test) {
+			KvFileBuilder<K, V> builder;
+			if (!builder.open(file)) return false;
+
+			for (const auto& e : test) {
+				builder.add(e.first, e.second);
+			}
+
+			return builder.finish();
 		}
+	};
 
-		void close() {
-			if (!isOpen()) return;
-			filePtr->close();
-			dataMap.clear();
-			reservedKeyList.clear();
-			deletedKeyList.clear();
-			tableList.clear();
+	//============================================================================
+	// Bulk builder
+	//============================================================================
+
+	// writes new file from pairs added in any order with bounded memory:
+	// values are spilled to temporary file as they come, index records are sorted 
+	// in runs of limited size, finish() merges runs and writes values in morton order
+	// of keys with one dense key table. last value of the same key wins, empty value - no pair.
+	// new file is written aside and replaces existing one only when complete
+	template <typename K, typename V>
+	class KvFileBuilder {
+
+	private:
+
+		typedef struct TBuildRecord {
+			ulong64 mortonCode = 0;
+			ulong64 seq = 0; // order of adding
+			ulong64 dataPos = 0; // in spill file
+			ulong64 dataLength = 0;
+			TKeyData keyData;
+		} TBuildRecord;
+
+		// sorted run on disk
+		typedef struct TRunReader {
+			std::unique_ptr<std::ifstream> inFile;
+			TBuildRecord record;
+
+			bool next() {
+				return (bool)inFile->read((char*)&record, sizeof(TBuildRecord));
+			}
+		} TRunReader;
+
+		static bool lessRecord(const TBuildRecord& lhs, const TBuildRecord& rhs) {
+			if (lhs.mortonCode != rhs.mortonCode) return lhs.mortonCode < rhs.mortonCode;
+			if (lhs.keyData != rhs.keyData) return lhs.keyData < rhs.keyData;
+			return lhs.seq < rhs.seq;
 		}
 
-		bool isOpen() {
-			return filePtr && filePtr->is_open();
+		std::string fileName;
+		std::ofstream spillFile;
+		ulong64 spillPos = 0;
+		std::vector<TBuildRecord> recordList;
+		std::vector<std::string> runFileList;
+		ulong64 recordCount = 0;
+		size_t runSize = KVDB_BUILDER_RUN_SIZE;
+		uint32 inlineValueSize = KVDB_INLINE_MAX_SIZE;
+
+		std::string spillFileName() const {
+			return fileName + ".build";
 		}
 
-		bool open(const std::string& file) {
-			filePtr = new std::fstream(file, std::ios::in | std::ios::out | std::ios::binary);
+		// file is built aside and replaces target only when complete
+		std::string outFileName() const {
+			return fileName + ".tmp";
+		}
 
-			if (!isOpen()) return false;
+		static void toValueData(const TValueData& value, TValueData& valueData) {
+			valueData = value;
+		}
 
-			TFileHeader fileHeader;
-			filePtr >> fileHeader;
+		template <typename T>
+		static void toValueData(const T& value, TValueData& valueData) {
+			valueData.resize(sizeof(T));
+			std::memcpy(valueData.data(), &value, sizeof(T));
+		}
+
+		bool writeRun() {
+			std::sort(recordList.begin(), recordList.end(), lessRecord);
+
+			const std::string runFileName = fileName + ".run" + std::to_string(runFileList.size());
+			runFileList.push_back(runFileName);
+
+			std::ofstream runFile(runFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+			runFile.write((char*)recordList.data(), recordList.size() * sizeof(TBuildRecord));
+			runFile.close();
+
+			recordList.clear();
+			return !runFile.fail();
+		}
 
-			ulong64 nextTablePos = readTable();
-			while (nextTablePos > 0) {
-				filePtr->seekg(nextTablePos);
-				nextTablePos = readTable();
+		void removeTempFiles() {
+			if (spillFile.is_open()) {
+				spillFile.close();
 			}
-            
-			return true;
+
+			std::remove(spillFileName().c_str());
+			std::remove(outFileName().c_str());
+			for (const std::string& runFileName : runFileList) {
+				std::remove(runFileName.c_str());
+			}
+
+			runFileList.clear();
+			recordList.clear();
 		}
 
-		int size() {
-			if (!isOpen()) {
-				return 0;
-			} else {
-				return dataMap.size();
+		// target file is left as it was
+		bool fail() {
+			removeTempFiles();
+			return false;
+		}
+
+	public:
+
+		~KvFileBuilder() {
+			cancel();
+		}
+
+		bool open(const std::string& file) {
+			cancel();
+
+			fileName = file;
+			spillPos = 0;
+			recordCount = 0;
+			spillFile.open(spillFileName(), std::ios::out | std::ios::binary | std::ios::trunc);
+			return spillFile.is_open();
+		}
+
+		// index records kept in memory before sorted run is written to disk
+		void setRunSize(size_t val) {
+			runSize = (val > 0) ? val : 1;
+		}
+
+		// values up to this size are stored in key entry. 0 - disabled
+		void setInlineValueSize(uint32 val) {
+			inlineValueSize = std::min<uint32>(val, KVDB_INLINE_MAX_SIZE);
+		}
+
+		void add(const K& key, const V& value) {
+			if (!spillFile.is_open()) return;
+
+			TValueData valueData;
+			toValueData(value, valueData);
+
+			TBuildRecord record;
+			std::memcpy(record.keyData.data(), &key, sizeof(K));
+			record.mortonCode = mortonCode(record.keyData);
+			record.seq = recordCount++;
+			record.dataPos = spillPos;
+			record.dataLength = valueData.size();
+
+			spillFile.write((char*)valueData.data(), valueData.size());
+			spillPos += valueData.size();
+
+			recordList.push_back(record);
+			if (recordList.size() >= runSize) {
+				writeRun();
 			}
 		}
 
-		bool isExist(const K& k) {
-			TKeyData keyData = toKeyData(k);
-			if (!isOpen()) return false;
-			std::lock_guard<std::mutex> guard(fileSharedMutex);
-			return !(dataMap.find(keyData) == dataMap.end());
+		// pairs added so far, including repeated keys
+		ulong64 size() const {
+			return recordCount;
 		}
 
+		bool finish(uint32 reservedKeys = KVDB_RESERVED_TABLE_SIZE) {
+			if (!spillFile.is_open()) return false;
 
-		TValueDataPtr loadData(const K& k) {
-			TKeyData keyData = toKeyData(k);
+			spillFile.close();
+			if (spillFile.fail()) return fail();
 
-			if (!isOpen()) return nullptr;
-            std::lock_guard<std::mutex> guard(fileSharedMutex);
+			// one run fits memory, otherwise all of them go through disk
+			if (runFileList.empty()) {
+				std::sort(recordList.begin(), recordList.end(), lessRecord);
+			} else if (!recordList.empty() && !writeRun()) {
+				return fail();
+			}
 
-			auto got = dataMap.find(keyData);
-			if (got == dataMap.end()) {
-				return nullptr;
+			std::vector<TRunReader> runList(runFileList.size());
+			auto greaterRun = [&](size_t lhs, size_t rhs) { return lessRecord(runList[rhs].record, runList[lhs].record); };
+			std::priority_queue<size_t, std::vector<size_t>, decltype(greaterRun)> runQueue(greaterRun);
+
+			for (size_t i = 0; i < runList.size(); i++) {
+				runList[i].inFile.reset(new std::ifstream(runFileList[i], std::ios::in | std::ios::binary));
+				if (runList[i].next()) {
+					runQueue.push(i);
+				}
 			}
 
-			TKeyEntryInfo& i = dataMap[keyData];
-			const TKeyEntry& e = i();
+			size_t nextRecord = 0;
+			auto nextMerged = [&](TBuildRecord& record) {
+				if (runList.empty()) {
+					if (nextRecord >= recordList.size()) return false;
+					record = recordList[nextRecord++];
+					return true;
+				}
 
-			filePtr->seekg(e.dataPos);
+				if (runQueue.empty()) return false;
 
-			TValueDataPtr dataPtr = TValueDataPtr(new TValueData);
-			dataPtr->resize(e.dataLength);
+				const size_t top = runQueue.top();
+				runQueue.pop();
+				record = runList[top].record;
+				if (runList[top].next()) {
+					runQueue.push(top);
+				}
 
-			if (filePtr->read((char*)dataPtr->data(), e.dataLength)) {
-				return dataPtr;
+				return true;
+			};
+
+			std::ifstream spillIn(spillFileName(), std::ios::in | std::ios::binary);
+			std::fstream outFile(outFileName(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!spillIn || !outFile) return fail();
+
+			// repeated keys only leave unused reserved slots
+			const ulong64 tableCapacity = recordCount + reservedKeys;
+			const ulong64 tablePos = sizeof(TFileHeader) + sizeof(TTableHeader);
+			ulong64 outPos = tablePos + sizeof(TKeyEntry) * tableCapacity;
+			ulong64 entryCount = 0;
+
+			std::vector<TKeyEntry> entryBuffer;
+			TValueData valueData;
+
+			auto flushEntries = [&]() {
+				if (entryBuffer.empty()) return;
+				outFile.seekp(tablePos + sizeof(TKeyEntry) * entryCount);
+				outFile.write((char*)entryBuffer.data(), entryBuffer.size() * sizeof(TKeyEntry));
+				entryCount += entryBuffer.size();
+				entryBuffer.clear();
+			};
+
+			auto writePair = [&](const TBuildRecord& record) {
+				if (record.dataLength == 0) return;
+
+				valueData.resize(record.dataLength);
+				spillIn.seekg(record.dataPos);
+				spillIn.read((char*)valueData.data(), valueData.size());
+
+				TKeyEntry entry;
+				entry.freeKeyData = record.keyData;
+
+				if (record.dataLength <= inlineValueSize) {
+					setInlineValue(entry, valueData.data(), valueData.size());
+				} else {
+					outFile.seekp(outPos);
+					outFile.write((char*)valueData.data(), valueData.size());
+
+					entry.dataPos = outPos;
+					entry.dataLength = record.dataLength;
+					entry.initialDataLength = record.dataLength;
+					outPos += record.dataLength;
+				}
+
+				entryBuffer.push_back(entry);
+
+				if (entryBuffer.size() >= 64 * 1024) {
+					flushEntries();
+				}
+			};
+
+			// records of the same key are adjacent, latest is the last one
+			TBuildRecord record;
+			TBuildRecord last;
+			bool bHasLast = false;
+			while (nextMerged(record)) {
+				if (bHasLast && record.keyData != last.keyData) {
+					writePair(last);
+				}
+
+				last = record;
+				bHasLast = true;
 			}
 
-			return nullptr;
+			if (bHasLast) {
+				writePair(last);
+			}
+
+			flushEntries();
+
+			// reserved key slots
+			entryBuffer.resize(64 * 1024);
+			while (entryCount < tableCapacity) {
+				const ulong64 count = std::min<ulong64>(entryBuffer.size(), tableCapacity - entryCount);
+				outFile.seekp(tablePos + sizeof(TKeyEntry) * entryCount);
+				outFile.write((char*)entryBuffer.data(), count * sizeof(TKeyEntry));
+				entryCount += count;
+			}
+
+			TFileHeader fileHeader;
+			fileHeader.keySize = KVDB_KEY_SIZE;
+			fileHeader.endOfHeaderOffset = sizeof(fileHeader);
+			fileHeader.timestamp = fileTimestamp();
+
+			TTableHeader tableHeader;
+			tableHeader.recordCount = tableCapacity;
+
+			std::fstream* outFilePtr = &outFile;
+			outFile.seekp(0);
+			outFilePtr << fileHeader;
+			outFilePtr << tableHeader;
+
+			outFile.close();
+			const bool bSpillFailed = spillIn.fail();
+			spillIn.close();
+			runList.clear();
+
+			if (outFile.fail() || bSpillFailed) return fail();
+
+			// crash before the swap leaves old file in place
+			syncFile(outFileName());
+			if (!replaceFile(outFileName(), fileName)) return fail();
+
+			removeTempFiles();
+			return true;
 		}
 
-		std::shared_ptr<V> load(const K& k) {
-			return valueFromData(loadData(k));
+		// drop everything added, temporary files are removed
+		void cancel() {
+			removeTempFiles();
+			recordCount = 0;
 		}
-        
-        std::shared_ptr<V> operator[] (const K& k) {
-            return valueFromData(loadData(k));
-        }
+	};
 
-		void erase(const K& k) {
-			TKeyData keyData = toKeyData(k);
+	//============================================================================
+	// Column record
+	//
+	// Several values of one key (column families) stored as one value:
+	// uint32 column count, uint32 length of each column, column data.
+	// Empty column - no value.
+	//============================================================================
+	class TColumnRecord {
 
-			if (!isOpen()) return;
-            std::lock_guard<std::mutex> guard(fileSharedMutex);
+	private:
+		TValueView view;
+		std::vector<std::pair<ulong64, ulong64>> columnList; // offset, length
+
+	public:
+
+		TColumnRecord() { }
+
+		explicit TColumnRecord(const TValueView& view_) : view(view_) {
+			if (!view || view.size() < sizeof(uint32)) return;
+
+			uint32 count = 0;
+			std::memcpy(&count, view.data(), sizeof(uint32));
+
+			ulong64 offset = sizeof(uint32) * ((ulong64)count + 1);
+			if (offset > view.size()) return;
 
-			auto got = dataMap.find(keyData);
-			if (got != dataMap.end()) {
-				TKeyEntryInfo keyInfo = dataMap[keyData];
-				earsePair(keyInfo);
+			for (uint32 i = 0; i < count; i++) {
+				uint32 length = 0;
+				std::memcpy(&length, view.data() + sizeof(uint32) * (i + 1), sizeof(uint32));
+				if (offset + length > view.size()) {
+					columnList.clear(); // broken record
+					return;
+				}
+
+				columnList.push_back({ offset, length });
+				offset += length;
 			}
 		}
 
-		void save(const K& k, const V& v) {
-			TKeyData keyData = toKeyData(k);
-			TValueData valueData;
+		uint32 columnCount() const {
+			return (uint32)columnList.size();
+		}
 
-            if (std::is_same<V, TValueData>::value) { 
-				valueData = static_cast<TValueData>(v);
-			} else {
-				toValueData(v, valueData);
+		// record bytes up to length of column, enough for headerHasColumn()
+		static ulong64 headerSize(uint32 column) {
+			return sizeof(uint32) * ((ulong64)column + 2);
+		}
+
+		// column test on record header only, see KvContainer::isExist
+		static bool headerHasColumn(const TValueView& header, uint32 column) {
+			if (!header || header.size() < sizeof(uint32)) return false;
+
+			uint32 count = 0;
+			std::memcpy(&count, header.data(), sizeof(uint32));
+			if (column >= count || header.size() < headerSize(column)) return false;
+
+			uint32 length = 0;
+			std::memcpy(&length, header.data() + sizeof(uint32) * ((ulong64)column + 1), sizeof(uint32));
+			return length > 0;
+		}
+
+		bool hasColumn(uint32 column) const {
+			return column < columnList.size() && columnList[column].second > 0;
+		}
+
+		TValueView column(uint32 column) const {
+			if (!hasColumn(column)) return TValueView();
+			return view.slice(columnList[column].first, columnList[column].second);
+		}
+
+		// column data pointer and length. nullptr - empty column
+		static void pack(const std::vector<std::pair<const byte*, ulong64>>& columnDataList, TValueData& recordData) {
+			const uint32 count = (uint32)columnDataList.size();
+			ulong64 recordSize = sizeof(uint32) * ((ulong64)count + 1);
+			for (const auto& columnData : columnDataList) {
+				recordSize += columnData.second;
 			}
 
-			if (!isOpen()) return;
-            std::lock_guard<std::mutex> guard(fileSharedMutex);
+			recordData.resize(recordSize);
+			std::memcpy(recordData.data(), &count, sizeof(uint32));
 
-			std::unordered_map<TKeyData, TKeyEntryInfo>::const_iterator got = dataMap.find(keyData);
-			if (got == dataMap.end()) {
-				// pair not found  
-				addNew(keyData, valueData);
-			} else {
-				// pair found  
-				change(keyData, valueData);
+			ulong64 offset = sizeof(uint32) * ((ulong64)count + 1);
+			for (uint32 i = 0; i < count; i++) {
+				const uint32 length = (uint32)columnDataList[i].second;
+				std::memcpy(recordData.data() + sizeof(uint32) * (i + 1), &length, sizeof(uint32));
+				if (length > 0) {
+					std::memcpy(recordData.data() + offset, columnDataList[i].first, length);
+				}
+
+				offset += length;
 			}
 		}
+	};
 
-		static bool create(const std::string& file, const std::unordered_map<K, V>& test) {
-			std::ofstream outFile(file, std::ios::out | std::ios::binary);
+	//============================================================================
+	// Column container
+	//============================================================================
 
-			if (!outFile) return false;
+	// one file for several column families sharing one key index.
+	// one lookup and one read serve all columns of a key, changes of all columns
+	// are committed together by one write batch of the underlying file
+	template <typename K>
+	class KvContainer {
 
-			std::ofstream* outFilePtr = &outFile;
+	public:
 
-			static const ulong64 max_key_records = KVDB_RESERVED_TABLE_SIZE;
-			const ulong64 keyRecords = (test.size() > max_key_records) ? test.size() : max_key_records;
+		typedef KvFile<K, TValueData> TFile;
+		typedef typename TFile::WriteBatch WriteBatch;
+		typedef typename TFile::Snapshot Snapshot;
 
-			// save file header
-			TFileHeader fileHeader;
-			fileHeader.keySize = KVDB_KEY_SIZE;
-			fileHeader.endOfHeaderOffset = sizeof(fileHeader);
+	private:
 
-			outFilePtr << fileHeader;
+		TFile kvFile;
 
-			TTableHeader tableHeader;
-			tableHeader.recordCount = keyRecords;
-			outFilePtr << tableHeader;
+		// changed records are merged with stored ones, one merge at a time
+		std::mutex commitMutex;
 
-			ulong64 bodyDataOffset = (ulong64)(outFile.tellp()) + sizeof(TKeyEntry) * keyRecords;
+	public:
 
-			std::vector<byte> dataBody;
+		// underlying file for open, close, compaction and settings
+		TFile& file() {
+			return kvFile;
+		}
 
-			for (auto& e : test) {
-				TKeyEntry entry;
-				entry.freeKeyData = toKeyData(e.first);
-				entry.dataPos = dataBody.size() + bodyDataOffset;
+		bool isOpen() {
+			return kvFile.isOpen();
+		}
 
-				TValueData valueData;
+		// empty record if key doesn't exist
+		TColumnRecord load(const K& k) {
+			return TColumnRecord(kvFile.loadView(k));
+		}
 
-				if (std::is_same<V, TValueData>::value) { //constexpr
-                    valueData = static_cast<TValueData>(e.second);
-				} else {
-					toValueData(e.second, valueData);
+		// records point into mapped memory if file is mapped, so unused columns are not copied.
+		// one lock for all keys, not mapped values are read in file order
+		std::vector<TColumnRecord> loadMany(const std::vector<K>& keys) {
+			return toRecordList(kvFile.loadViewMany(keys));
+		}
+
+		// consistent view of all records, see KvFile::snapshot()
+		Snapshot snapshot() {
+			return kvFile.snapshot();
+		}
+
+		// records as of snapshot. they stay valid after snapshot is released
+		std::vector<TColumnRecord> loadMany(const Snapshot& snapshot, const std::vector<K>& keys) {
+			return toRecordList(snapshot.loadViewMany(keys));
+		}
+
+		// reads record header only
+		bool isExist(const K& k, uint32 column) {
+			return TColumnRecord::headerHasColumn(kvFile.loadPrefix(k, TColumnRecord::headerSize(column)), column);
+		}
+
+		// keys with any column inside box
+		void forEachInBox(const K& minKey, const K& maxKey, std::function<void(const K&)> func) {
+			kvFile.forEachInBox(minKey, maxKey, func);
+		}
+
+		// keys with any column inside box as of snapshot
+		void forEachInBox(const Snapshot& snapshot, const K& minKey, const K& maxKey, std::function<void(const K&)> func) {
+			snapshot.forEachInBox(minKey, maxKey, func);
+		}
+
+		// one batch per column, nullptr - column not changed. 
+		// columns not in batch keep stored values, key without any column is erased
+		TWriteBatchResult commit(const std::vector<const WriteBatch*>& columnBatchList) {
+			std::unique_lock<std::mutex> guard(commitMutex);
+
+			std::unordered_map<TKeyData, std::vector<const TValueData*>> changeMap; // nullptr - column not changed
+			for (uint32 column = 0; column < columnBatchList.size(); column++) {
+				if (columnBatchList[column] == nullptr) continue;
+
+				for (const auto& op : columnBatchList[column]->opList) {
+					std::vector<const TValueData*>& changeList = changeMap[op.first];
+					changeList.resize(columnBatchList.size(), nullptr);
+					changeList[column] = &op.second;
 				}
+			}
 
-				entry.dataLength = valueData.size();
-				entry.initialDataLength = valueData.size();
-				dataBody.insert(std::end(dataBody), std::begin(valueData), std::end(valueData));
+			if (changeMap.empty()) return TWriteBatchResult();
 
-				outFilePtr << entry;
+			std::vector<K> keyList;
+			keyList.reserve(changeMap.size());
+			for (const auto& itm : changeMap) {
+				K key;
+				std::memcpy(&key, itm.first.data(), sizeof(K));
+				keyList.push_back(key);
 			}
 
-			if (test.size() < max_key_records) {
-				// add empty records
-				const ulong64 emptyRecords = max_key_records - test.size();
-				for (int i = 0; i < emptyRecords; i++) {
-					TKeyEntry entry;
-					outFilePtr << entry;
+			const std::vector<TColumnRecord> recordList = loadMany(keyList);
+
+			WriteBatch recordBatch;
+			TValueData recordData;
+			std::vector<std::pair<const byte*, ulong64>> columnDataList;
+
+			for (size_t i = 0; i < keyList.size(); i++) {
+				const std::vector<const TValueData*>& changeList = changeMap[toKeyData(keyList[i])];
+				const TColumnRecord& record = recordList[i];
+				const uint32 count = std::max<uint32>(record.columnCount(), (uint32)changeList.size());
+
+				bool bEmpty = true;
+				columnDataList.assign(count, { nullptr, 0 });
+				for (uint32 column = 0; column < count; column++) {
+					if (column < changeList.size() && changeList[column] != nullptr) {
+						columnDataList[column] = { changeList[column]->data(), changeList[column]->size() };
+					} else {
+						const TValueView view = record.column(column);
+						columnDataList[column] = { view.data(), view.size() };
+					}
+
+					bEmpty = bEmpty && columnDataList[column].second == 0;
+				}
+
+				if (bEmpty) {
+					recordBatch.erase(keyList[i]);
+				} else {
+					TColumnRecord::pack(columnDataList, recordData);
+					recordBatch.put(keyList[i], recordData);
 				}
 			}
 
-			outFilePtr->write((char*)dataBody.data(), dataBody.size());
-			outFile.close();
+			return kvFile.commit(recordBatch);
+		}
 
-			return true;
+	private:
+
+		static TKeyData toKeyData(const K& key) {
+			TKeyData keyData = {};
+			std::memcpy(keyData.data(), &key, sizeof(K));
+			return keyData;
+		}
+
+		static std::vector<TColumnRecord> toRecordList(const std::vector<TValueView>& viewList) {
+			std::vector<TColumnRecord> result;
+			result.reserve(viewList.size());
+			for (const TValueView& view : viewList) {
+				result.push_back(TColumnRecord(view));
+			}
+
+			return result;
 		}
 	};
 
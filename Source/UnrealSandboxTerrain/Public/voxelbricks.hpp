@@ -0,0 +1,503 @@
+#pragma once
+
+//
+// Voxel channels stored in 8x8x8 bricks. No engine dependency,
+// used by TVoxelData and Benchmark/casecode_benchmark.cpp
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#ifndef FORCEINLINE
+#define FORCEINLINE inline
+#endif
+
+#define VOXEL_BRICK_SHIFT 3
+#define VOXEL_BRICK_SIZE (1 << VOXEL_BRICK_SHIFT) // 8 x 8 x 8 voxels
+#define VOXEL_BRICK_MASK (VOXEL_BRICK_SIZE - 1)
+
+// voxel volume split to 8x8x8 bricks. bricks at the far edge of the volume are clipped to the volume size
+class TVoxelBrickGrid {
+
+protected:
+	int voxel_num = 0;
+	int brick_num = 0; // by one axis
+	std::vector<int> extent; // brick size by brick coordinate, same for each axis
+
+	FORCEINLINE int clcBrickIndex(int x, int y, int z) const {
+		return ((x >> VOXEL_BRICK_SHIFT) * brick_num + (y >> VOXEL_BRICK_SHIFT)) * brick_num + (z >> VOXEL_BRICK_SHIFT);
+	}
+
+	FORCEINLINE int clcInBrickIndex(int x, int y, int z) const {
+		const int ey = extent[y >> VOXEL_BRICK_SHIFT];
+		const int ez = extent[z >> VOXEL_BRICK_SHIFT];
+		return ((x & VOXEL_BRICK_MASK) * ey + (y & VOXEL_BRICK_MASK)) * ez + (z & VOXEL_BRICK_MASK);
+	}
+
+	int clcBrickVolume(int b) const {
+		const int bz = b % brick_num;
+		const int by = (b / brick_num) % brick_num;
+		const int bx = b / (brick_num * brick_num);
+		return extent[bx] * extent[by] * extent[bz];
+	}
+
+	// returns brick count
+	int initializeGrid(int num) {
+		voxel_num = num;
+		brick_num = (num + VOXEL_BRICK_MASK) >> VOXEL_BRICK_SHIFT;
+
+		extent.resize(brick_num);
+		for (int i = 0; i < brick_num; i++) {
+			extent[i] = std::min(VOXEL_BRICK_SIZE, num - (i << VOXEL_BRICK_SHIFT));
+		}
+
+		return brick_num * brick_num * brick_num;
+	}
+
+	void clearGrid() {
+		extent.clear();
+		brick_num = 0;
+	}
+
+	// calls func(b, row, offset, length) for each z-run of each brick in linear voxel order:
+	// row - linear index of run start, offset - in-brick index of run start.
+	// runs of one brick come in in-brick order
+	template <typename F>
+	FORCEINLINE void forEachBrickRun(F func) const {
+		for (int x = 0; x < voxel_num; x++) {
+			for (int y = 0; y < voxel_num; y++) {
+				const int b = clcBrickIndex(x, y, 0);
+				const size_t row = ((size_t)x * voxel_num + y) * voxel_num;
+				for (int bz = 0; bz < brick_num; bz++) {
+					const int z = bz << VOXEL_BRICK_SHIFT;
+					func(b + bz, row + z, clcInBrickIndex(x, y, z), extent[bz]);
+				}
+			}
+		}
+	}
+
+public:
+	bool isInitialized() const {
+		return brick_num > 0;
+	}
+};
+
+// voxel channel in bricks. uniform brick keeps one value without storage,
+// dense brick is allocated by the first write of other value
+template <typename T>
+class TVoxelBrickArray : public TVoxelBrickGrid {
+
+private:
+	std::vector<T> fill_list; // value of uniform brick
+	std::vector<T*> brick_list; // nullptr - uniform brick
+
+	void freeBrick(int b) {
+		if (brick_list[b] != nullptr) {
+			delete[] brick_list[b];
+			brick_list[b] = nullptr;
+		}
+	}
+
+public:
+	TVoxelBrickArray() { }
+	TVoxelBrickArray(const TVoxelBrickArray&) = delete;
+	TVoxelBrickArray& operator=(const TVoxelBrickArray&) = delete;
+
+	~TVoxelBrickArray() {
+		clear();
+	}
+
+	void initialize(int num, T value) {
+		clear();
+		const int s = initializeGrid(num);
+		fill_list.assign(s, value);
+		brick_list.assign(s, nullptr);
+	}
+
+	void clear() {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			freeBrick(b);
+		}
+
+		brick_list.clear();
+		fill_list.clear();
+		clearGrid();
+	}
+
+	FORCEINLINE T get(int x, int y, int z) const {
+		const int b = clcBrickIndex(x, y, z);
+		const T* brick = brick_list[b];
+		return (brick != nullptr) ? brick[clcInBrickIndex(x, y, z)] : fill_list[b];
+	}
+
+	FORCEINLINE void set(int x, int y, int z, T value) {
+		const int b = clcBrickIndex(x, y, z);
+		T* brick = brick_list[b];
+		if (brick == nullptr) {
+			if (fill_list[b] == value) {
+				return;
+			}
+
+			const int s = clcBrickVolume(b);
+			brick = new T[s];
+			std::fill(brick, brick + s, fill_list[b]);
+			brick_list[b] = brick;
+		}
+
+		brick[clcInBrickIndex(x, y, z)] = value;
+	}
+
+	// fill from dense array in linear voxel order by z-runs of bricks. 
+	// brick is allocated by the first run with other value, earlier runs are its uniform value
+	void assign(const T* linear) {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			freeBrick(b);
+		}
+
+		forEachBrickRun([&](int b, size_t row, int offset, int length) {
+			const T* src = linear + row;
+			T* brick = brick_list[b];
+			if (brick == nullptr) {
+				if (offset == 0) {
+					fill_list[b] = src[0];
+				}
+
+				if (std::find_if(src, src + length, [&](T v) { return v != fill_list[b]; }) == src + length) {
+					return;
+				}
+
+				brick = new T[clcBrickVolume(b)];
+				std::fill(brick, brick + offset, fill_list[b]);
+				brick_list[b] = brick;
+			}
+
+			memcpy(brick + offset, src, length * sizeof(T));
+		});
+	}
+
+	// copy to dense array in linear voxel order by z-runs of bricks
+	void copyTo(T* linear) const {
+		forEachBrickRun([&](int b, size_t row, int offset, int length) {
+			const T* brick = brick_list[b];
+			if (brick != nullptr) {
+				memcpy(linear + row, brick + offset, length * sizeof(T));
+			} else {
+				std::fill(linear + row, linear + row + length, fill_list[b]);
+			}
+		});
+	}
+
+	// dense bricks holding one value become uniform again
+	void optimize() {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			T* brick = brick_list[b];
+			if (brick == nullptr) continue;
+
+			const int s = clcBrickVolume(b);
+			if (std::find_if(brick + 1, brick + s, [&](T v) { return v != brick[0]; }) == brick + s) {
+				fill_list[b] = brick[0];
+				freeBrick(b);
+			}
+		}
+	}
+
+	int denseBrickCount() const {
+		return (int)std::count_if(brick_list.begin(), brick_list.end(), [](const T* brick) { return brick != nullptr; });
+	}
+
+	// heap memory in bytes
+	size_t memoryUsage() const {
+		size_t res = fill_list.capacity() * sizeof(T) + brick_list.capacity() * sizeof(T*) + extent.capacity() * sizeof(int);
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			if (brick_list[b] != nullptr) {
+				res += clcBrickVolume(b) * sizeof(T);
+			}
+		}
+
+		return res;
+	}
+};
+
+// voxel channel in bricks with few distinct values, like materials. uniform brick keeps one value without storage,
+// other brick keeps its own palette and palette indices packed by 1, 2, 4, 8 or 16 bits.
+// index width grows when palette overflows, unused palette entries are dropped by optimize()
+template <typename T>
+class TVoxelPaletteArray : public TVoxelBrickGrid {
+
+private:
+	typedef struct TPaletteBrick {
+		std::vector<T> palette;
+		std::vector<uint32_t> words; // packed indices, never cross word boundary
+		uint32_t bits = 0;
+	} TPaletteBrick;
+
+	std::vector<T> fill_list; // value of uniform brick
+	std::vector<TPaletteBrick*> brick_list; // nullptr - uniform brick
+
+	static FORCEINLINE uint32_t readIndex(const TPaletteBrick* brick, int i) {
+		const uint32_t pos = i * brick->bits;
+		return (brick->words[pos >> 5] >> (pos & 31)) & ((1u << brick->bits) - 1);
+	}
+
+	static FORCEINLINE void writeIndex(TPaletteBrick* brick, int i, uint32_t idx) {
+		const uint32_t pos = i * brick->bits;
+		const uint32_t mask = ((1u << brick->bits) - 1) << (pos & 31);
+		uint32_t& word = brick->words[pos >> 5];
+		word = (word & ~mask) | (idx << (pos & 31));
+	}
+
+	static int wordCount(int volume, uint32_t bits) {
+		return (volume * bits + 31) >> 5;
+	}
+
+	// repack indices with other width
+	static void repack(TPaletteBrick* brick, int volume, uint32_t bits) {
+		TPaletteBrick packed;
+		packed.bits = bits;
+		packed.words.assign(wordCount(volume, bits), 0);
+		for (int i = 0; i < volume; i++) {
+			writeIndex(&packed, i, readIndex(brick, i));
+		}
+
+		brick->words.swap(packed.words);
+		brick->bits = bits;
+	}
+
+	static uint32_t bitsForPalette(size_t size) {
+		uint32_t bits = 1;
+		while ((size_t)1 << bits < size) bits <<= 1;
+		return bits;
+	}
+
+	// palette index of value, added if missing
+	uint32_t paletteIndex(int b, TPaletteBrick* brick, T value) const {
+		for (uint32_t idx = 0; idx < brick->palette.size(); idx++) {
+			if (brick->palette[idx] == value) return idx;
+		}
+
+		if (brick->palette.size() >= ((size_t)1 << brick->bits)) {
+			repack(brick, clcBrickVolume(b), brick->bits * 2);
+		}
+
+		brick->palette.push_back(value);
+		return (uint32_t)brick->palette.size() - 1;
+	}
+
+public:
+	TVoxelPaletteArray() { }
+	TVoxelPaletteArray(const TVoxelPaletteArray&) = delete;
+	TVoxelPaletteArray& operator=(const TVoxelPaletteArray&) = delete;
+
+	~TVoxelPaletteArray() {
+		clear();
+	}
+
+	void initialize(int num, T value) {
+		clear();
+		const int s = initializeGrid(num);
+		fill_list.assign(s, value);
+		brick_list.assign(s, nullptr);
+	}
+
+	void clear() {
+		for (TPaletteBrick* brick : brick_list) {
+			delete brick;
+		}
+
+		brick_list.clear();
+		fill_list.clear();
+		clearGrid();
+	}
+
+	FORCEINLINE T get(int x, int y, int z) const {
+		const int b = clcBrickIndex(x, y, z);
+		const TPaletteBrick* brick = brick_list[b];
+		return (brick != nullptr) ? brick->palette[readIndex(brick, clcInBrickIndex(x, y, z))] : fill_list[b];
+	}
+
+	FORCEINLINE void set(int x, int y, int z, T value) {
+		const int b = clcBrickIndex(x, y, z);
+		TPaletteBrick* brick = brick_list[b];
+		if (brick == nullptr) {
+			if (fill_list[b] == value) {
+				return;
+			}
+
+			// index 0 - previous uniform value
+			brick = new TPaletteBrick();
+			brick->palette.push_back(fill_list[b]);
+			brick->bits = 1;
+			brick->words.assign(wordCount(clcBrickVolume(b), 1), 0);
+			brick_list[b] = brick;
+		}
+
+		const uint32_t idx = paletteIndex(b, brick, value);
+		writeIndex(brick, clcInBrickIndex(x, y, z), idx);
+	}
+
+	// fill from dense array in linear voxel order by z-runs of bricks.
+	// brick is created by the first run with other value, index 0 of earlier runs is its uniform value
+	void assign(const T* linear) {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			delete brick_list[b];
+			brick_list[b] = nullptr;
+		}
+
+		forEachBrickRun([&](int b, size_t row, int offset, int length) {
+			const T* src = linear + row;
+			TPaletteBrick* brick = brick_list[b];
+			if (brick == nullptr) {
+				if (offset == 0) {
+					fill_list[b] = src[0];
+				}
+
+				if (std::find_if(src, src + length, [&](T v) { return v != fill_list[b]; }) == src + length) {
+					return;
+				}
+
+				brick = new TPaletteBrick();
+				brick->palette.push_back(fill_list[b]);
+				brick->bits = 1;
+				brick->words.assign(wordCount(clcBrickVolume(b), 1), 0);
+				brick_list[b] = brick;
+			}
+
+			for (int i = 0; i < length; i++) {
+				writeIndex(brick, offset + i, paletteIndex(b, brick, src[i]));
+			}
+		});
+	}
+
+	// copy to dense array in linear voxel order by z-runs of bricks
+	void copyTo(T* linear) const {
+		forEachBrickRun([&](int b, size_t row, int offset, int length) {
+			const TPaletteBrick* brick = brick_list[b];
+			if (brick != nullptr) {
+				for (int i = 0; i < length; i++) {
+					linear[row + i] = brick->palette[readIndex(brick, offset + i)];
+				}
+			} else {
+				std::fill(linear + row, linear + row + length, fill_list[b]);
+			}
+		});
+	}
+
+	// drop unused palette entries, narrow indices. brick with one value left becomes uniform
+	void optimize() {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			TPaletteBrick* brick = brick_list[b];
+			if (brick == nullptr) continue;
+
+			const int volume = clcBrickVolume(b);
+			std::vector<int> remap(brick->palette.size(), -1);
+			std::vector<T> palette;
+			for (int i = 0; i < volume; i++) {
+				const uint32_t idx = readIndex(brick, i);
+				if (remap[idx] < 0) {
+					remap[idx] = (int)palette.size();
+					palette.push_back(brick->palette[idx]);
+				}
+			}
+
+			if (palette.size() == 1) {
+				fill_list[b] = palette[0];
+				delete brick;
+				brick_list[b] = nullptr;
+				continue;
+			}
+
+			if (palette.size() == brick->palette.size()) continue;
+
+			TPaletteBrick packed;
+			packed.bits = bitsForPalette(palette.size());
+			packed.words.assign(wordCount(volume, packed.bits), 0);
+			for (int i = 0; i < volume; i++) {
+				writeIndex(&packed, i, remap[readIndex(brick, i)]);
+			}
+
+			brick->palette.swap(palette);
+			brick->words.swap(packed.words);
+			brick->bits = packed.bits;
+		}
+	}
+
+	// per brick: uint8_t index width (0 - uniform brick), then value of uniform brick 
+	// or uint16_t palette size, palette and packed indices
+	template <typename S>
+	void write(S& serializer) const {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			const TPaletteBrick* brick = brick_list[b];
+			if (brick == nullptr) {
+				serializer.writeObj((uint8_t)0);
+				serializer.writeObj(fill_list[b]);
+				continue;
+			}
+
+			serializer.writeObj((uint8_t)brick->bits);
+			serializer.writeObj((uint16_t)brick->palette.size());
+			serializer.write(brick->palette.data(), brick->palette.size());
+			serializer.write(brick->words.data(), brick->words.size());
+		}
+	}
+
+	// expects initialized array of the same size. returns false on index width or palette
+	// not matching the format, array is left uniform then. data length is not checked
+	template <typename D>
+	bool read(D& deserializer) {
+		for (int b = 0; b < (int)brick_list.size(); b++) {
+			delete brick_list[b];
+			brick_list[b] = nullptr;
+
+			uint8_t bits;
+			deserializer.readObj(bits);
+			if (bits == 0) {
+				deserializer.readObj(fill_list[b]);
+				continue;
+			}
+
+			uint16_t paletteSize;
+			deserializer.readObj(paletteSize);
+			if ((bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16) || paletteSize == 0 || paletteSize > ((uint32_t)1 << bits)) {
+				initialize(voxel_num, fill_list[0]);
+				return false;
+			}
+
+			TPaletteBrick* brick = new TPaletteBrick();
+			brick->bits = bits;
+			brick->palette.resize(paletteSize);
+			deserializer.read(brick->palette.data(), paletteSize);
+			brick->words.resize(wordCount(clcBrickVolume(b), bits));
+			deserializer.read(brick->words.data(), brick->words.size());
+			brick_list[b] = brick;
+
+			// every index must point into palette
+			const int volume = clcBrickVolume(b);
+			for (int i = 0; i < volume; i++) {
+				if (readIndex(brick, i) >= paletteSize) {
+					initialize(voxel_num, fill_list[0]);
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	int denseBrickCount() const {
+		return (int)std::count_if(brick_list.begin(), brick_list.end(), [](const TPaletteBrick* brick) { return brick != nullptr; });
+	}
+
+	// heap memory in bytes
+	size_t memoryUsage() const {
+		size_t res = fill_list.capacity() * sizeof(T) + brick_list.capacity() * sizeof(TPaletteBrick*) + extent.capacity() * sizeof(int);
+		for (const TPaletteBrick* brick : brick_list) {
+			if (brick != nullptr) {
+				res += sizeof(TPaletteBrick) + brick->palette.capacity() * sizeof(T) + brick->words.capacity() * sizeof(uint32_t);
+			}
+		}
+
+		return res;
+	}
+};